@@ -0,0 +1,174 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "BitSignatures.h"
+#include "sidecar.h"
+#include <math.h>
+
+using std::string;
+using std::vector;
+
+static const char * bitSignaturesMagic = "MASHBBT2";
+
+void BitSignatures::initFromSketch(const Sketch & sketch, int bitsNew, int binsNew)
+{
+    bits = bitsNew;
+    bins = binsNew;
+    wordsPerReference = uint64_t(bins) * bits / 64;
+    
+    uint64_t mask = (uint64_t(1) << bits) - 1;
+    vector<uint64_t> minimums(bins);
+    
+    words.clear();
+    words.resize(sketch.getReferenceCount() * wordsPerReference, 0);
+    
+    for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+    {
+        const HashList & hashes = sketch.getReference(i).hashesSorted;
+        bool use64 = hashes.get64();
+        
+        // empty bins keep the maximum, which is the same for every reference
+        
+        for ( int j = 0; j < bins; j++ )
+        {
+            minimums[j] = ~uint64_t(0);
+        }
+        
+        for ( int j = 0; j < hashes.size(); j++ )
+        {
+            uint64_t hash = use64 ? hashes.at(j).hash64 : hashes.at(j).hash32;
+            uint64_t bin = hash % bins;
+            
+            if ( hash < minimums[bin] )
+            {
+                minimums[bin] = hash;
+            }
+        }
+        
+        uint64_t * signature = words.data() + i * wordsPerReference;
+        
+        for ( int j = 0; j < bins; j++ )
+        {
+            uint64_t value = (minimums[j] / bins) & mask;
+            uint64_t bit = uint64_t(j) * bits;
+            
+            signature[bit / 64] |= value << (bit % 64);
+        }
+    }
+}
+
+bool BitSignatures::initFromSidecar(const string & sketchFile, uint64_t referenceCount)
+{
+    FILE * stream = openSidecarForReading(sketchFile, suffixBitSignatures, bitSignaturesMagic, referenceCount);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    int32_t parameters[2];
+    bool success = false;
+    
+    if ( fread(parameters, sizeof(int32_t), 2, stream) == 2 && validParameters(parameters[0], parameters[1]) )
+    {
+        bits = parameters[0];
+        bins = parameters[1];
+        wordsPerReference = uint64_t(bins) * bits / 64;
+        words.resize(referenceCount * wordsPerReference);
+        
+        success = fread(words.data(), sizeof(uint64_t), words.size(), stream) == words.size();
+    }
+    
+    fclose(stream);
+    
+    if ( ! success )
+    {
+        words.clear();
+        wordsPerReference = 0;
+    }
+    
+    return success;
+}
+
+bool BitSignatures::mayMeetJaccard(uint64_t index, const BitSignatures & other, uint64_t indexOther, double jaccardMin) const
+{
+    // Bins match with probability J + (1 - J) / 2^b, so invert that for the
+    // estimate and let pairs through if the threshold is within three standard
+    // errors of it.
+    
+    double chance = 1. / (uint64_t(1) << bits);
+    double matches = double(bins - mismatches(index, other, indexOther)) / bins;
+    double jaccard = (matches - chance) / (1. - chance);
+    double variance = matches * (1. - matches);
+    
+    if ( variance < 1. / bins )
+    {
+        variance = 1. / bins;
+    }
+    
+    return jaccard + 3. * sqrt(variance / bins) / (1. - chance) >= jaccardMin;
+}
+
+uint64_t BitSignatures::mismatches(uint64_t index, const BitSignatures & other, uint64_t indexOther) const
+{
+    const uint64_t * a = words.data() + index * wordsPerReference;
+    const uint64_t * b = other.words.data() + indexOther * other.wordsPerReference;
+    
+    // bits set in the lowest position of each slot
+    
+    uint64_t slots = 0;
+    
+    for ( int i = 0; i < 64; i += bits )
+    {
+        slots |= uint64_t(1) << i;
+    }
+    
+    uint64_t count = 0;
+    
+    for ( uint64_t i = 0; i < wordsPerReference; i++ )
+    {
+        uint64_t diff = a[i] ^ b[i];
+        
+        // fold each slot down to its lowest bit
+        
+        for ( int shift = 1; shift < bits; shift <<= 1 )
+        {
+            diff |= diff >> shift;
+        }
+        
+        count += __builtin_popcountll(diff & slots);
+    }
+    
+    return count;
+}
+
+bool BitSignatures::writeToSidecar(const string & sketchFile) const
+{
+    FILE * stream = openSidecarForWriting(sketchFile, suffixBitSignatures, bitSignaturesMagic, getReferenceCount());
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    int32_t parameters[2] = {bits, bins};
+    
+    bool success =
+        fwrite(parameters, sizeof(int32_t), 2, stream) == 2 &&
+        fwrite(words.data(), sizeof(uint64_t), words.size(), stream) == words.size();
+    
+    return fclose(stream) == 0 && success;
+}
+
+bool BitSignatures::validParameters(int bits, int bins)
+{
+    if ( bits != 1 && bits != 2 && bits != 4 && bits != 8 && bits != 16 )
+    {
+        return false;
+    }
+    
+    return bins > 0 && (uint64_t(bins) * bits) % 64 == 0;
+}
@@ -0,0 +1,51 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef BitSignatures_h
+#define BitSignatures_h
+
+#include "Sketch.h"
+#include <string>
+#include <vector>
+
+static const char * suffixBitSignatures = ".bbit";
+
+static const int bitSignatureBitsDefault = 4;
+static const int bitSignatureBinsDefault = 256;
+
+// Compact b-bit signatures of the references in a sketch, for cheaply ruling
+// out pairs before an exact comparison. Each reference's hashes are spread over
+// a fixed number of bins (one permutation hashing) and only the lowest b bits
+// of the minimum hash in each bin are kept, so a signature is bins * b bits and
+// two are compared with XOR and popcount. Empty bins get the same value for all
+// references, which only makes the estimate more generous.
+
+class BitSignatures
+{
+public:
+    
+    BitSignatures() : bits(0), bins(0), wordsPerReference(0) {}
+    
+    int getBins() const {return bins;}
+    int getBits() const {return bits;}
+    uint64_t getReferenceCount() const {return wordsPerReference ? words.size() / wordsPerReference : 0;}
+    void initFromSketch(const Sketch & sketch, int bitsNew, int binsNew);
+    bool initFromSidecar(const std::string & sketchFile, uint64_t referenceCount);
+    bool mayMeetJaccard(uint64_t index, const BitSignatures & other, uint64_t indexOther, double jaccardMin) const;
+    uint64_t mismatches(uint64_t index, const BitSignatures & other, uint64_t indexOther) const;
+    bool writeToSidecar(const std::string & sketchFile) const;
+    
+    static bool validParameters(int bits, int bins);
+
+private:
+    
+    int bits;
+    int bins;
+    uint64_t wordsPerReference;
+    std::vector<uint64_t> words;
+};
+
+#endif
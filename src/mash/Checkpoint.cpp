@@ -0,0 +1,178 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "Checkpoint.h"
+#include "MurmurHash3.h"
+#include <iostream>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+
+int Checkpoint::init(const string & fileNew, uint64_t digestNew, bool resume, uint64_t & position)
+{
+    // Sets position to where the run should start, which is left as given
+    // unless resuming.
+    
+    struct stat outputInfo;
+    
+    file = fileNew;
+    digest = digestNew;
+    
+    if ( fstat(STDOUT_FILENO, &outputInfo) == -1 || ! S_ISREG(outputInfo.st_mode) )
+    {
+        cerr << "ERROR: Checkpoints require output to be redirected to a file." << endl;
+        return 1;
+    }
+    
+    if ( resume )
+    {
+        FILE * stream = fopen(file.c_str(), "r");
+        uint64_t digestRead;
+        uint64_t positionRead;
+        uint64_t bytes;
+        
+        if ( stream == 0 )
+        {
+            cerr << "ERROR: Could not open checkpoint " << file << " for reading." << endl;
+            return 1;
+        }
+        
+        int fields = fscanf(stream, "%" SCNx64 "\t%" SCNu64 "\t%" SCNu64, &digestRead, &positionRead, &bytes);
+        
+        fclose(stream);
+        
+        if ( fields != 3 )
+        {
+            cerr << "ERROR: " << file << " is not a checkpoint." << endl;
+            return 1;
+        }
+        
+        if ( digestRead != digest )
+        {
+            cerr << "ERROR: The checkpoint " << file << " is for different inputs or options." << endl;
+            return 1;
+        }
+        
+        if ( uint64_t(outputInfo.st_size) < bytes )
+        {
+            cerr << "ERROR: The output is shorter than when checkpointed; it must be appended to (>>) when resuming." << endl;
+            return 1;
+        }
+        
+        if ( ftruncate(STDOUT_FILENO, bytes) == -1 || lseek(STDOUT_FILENO, bytes, SEEK_SET) == -1 )
+        {
+            cerr << "ERROR: Could not truncate the output to resume." << endl;
+            return 1;
+        }
+        
+        cerr << "Resuming at pair " << positionRead << "." << endl;
+        position = positionRead;
+    }
+    
+    active = true;
+    positionWritten = position;
+    update(true);
+    
+    return 0;
+}
+
+void Checkpoint::finish()
+{
+    update(true);
+}
+
+void Checkpoint::taskSubmitted(uint64_t positionEnd)
+{
+    positionsPending.push_back(positionEnd);
+}
+
+void Checkpoint::taskWritten()
+{
+    positionWritten = positionsPending.front();
+    positionsPending.pop_front();
+    update(false);
+}
+
+void Checkpoint::update(bool force)
+{
+    // The output is synced before the checkpoint is written and renamed into
+    // place, so a checkpoint never refers to output that could be lost.
+    
+    if ( ! active || (! force && time(0) - written < checkpointInterval) )
+    {
+        return;
+    }
+    
+    cout.flush();
+    fsync(STDOUT_FILENO);
+    
+    // The length of the output rather than the offset of standard output,
+    // which for a file opened to append (>>) is 0 until the first write, even
+    // if the file already holds output from before.
+    
+    struct stat outputInfo;
+    off_t bytes = fstat(STDOUT_FILENO, &outputInfo) == -1 ? -1 : outputInfo.st_size;
+    string fileTemp = file + ".tmp";
+    FILE * stream = fopen(fileTemp.c_str(), "w");
+    
+    if ( stream == 0 || bytes == -1 )
+    {
+        cerr << "WARNING: Could not write checkpoint " << file << "." << endl;
+        
+        if ( stream )
+        {
+            fclose(stream);
+        }
+    }
+    else
+    {
+        fprintf(stream, "%016" PRIx64 "\t%" PRIu64 "\t%" PRIu64 "\n", digest, positionWritten, uint64_t(bytes));
+        fflush(stream);
+        fsync(fileno(stream));
+        fclose(stream);
+        
+        if ( rename(fileTemp.c_str(), file.c_str()) == -1 )
+        {
+            cerr << "WARNING: Could not write checkpoint " << file << "." << endl;
+        }
+    }
+    
+    written = time(0);
+}
+
+uint64_t getSketchDigest(const Sketch & sketch, uint64_t count, const string & settings)
+{
+    uint64_t digest[2];
+    
+    MurmurHash3_x64_128(settings.c_str(), settings.length(), 0, digest);
+    
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        const Sketch::Reference & ref = sketch.getReference(i);
+        string data((const char *)digest, sizeof(uint64_t));
+        
+        data.append(ref.name);
+        data.append(1, '\0');
+        data.append(ref.comment);
+        data.append(1, '\0');
+        data.append((const char *)&ref.length, sizeof(uint64_t));
+        
+        for ( uint64_t j = 0; j < ref.hashesSorted.size(); j++ )
+        {
+            uint64_t hash = ref.hashesSorted.get64() ? ref.hashesSorted.at(j).hash64 : ref.hashesSorted.at(j).hash32;
+            data.append((const char *)&hash, sizeof(uint64_t));
+        }
+        
+        MurmurHash3_x64_128(data.c_str(), data.length(), 0, digest);
+    }
+    
+    return digest[0];
+}
@@ -0,0 +1,56 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef Checkpoint_h
+#define Checkpoint_h
+
+#include "Sketch.h"
+#include <deque>
+#include <inttypes.h>
+#include <string>
+#include <time.h>
+
+static const int checkpointInterval = 60; // seconds between checkpoints
+
+// Records how far the output of a long run of pairs has been written, so a
+// stopped run can be resumed. Output is standard output, which must be a file
+// opened for appending (>>), so the resumed run can cut off anything written
+// after the last checkpoint and carry on from it. The digest identifies the
+// inputs and options, so a checkpoint is never applied to a different run.
+//
+// Tasks must be written in the order they are submitted, as with ThreadPool.
+
+class Checkpoint
+{
+public:
+    
+    Checkpoint() : active(false) {}
+    
+    void finish();
+    bool getActive() const {return active;}
+    int init(const std::string & fileNew, uint64_t digestNew, bool resume, uint64_t & position);
+    void taskSubmitted(uint64_t positionEnd);
+    void taskWritten();
+    
+private:
+    
+    void update(bool force);
+    
+    std::deque<uint64_t> positionsPending; // ends of tasks submitted, in order
+    uint64_t positionWritten; // end of the last task written
+    std::string file;
+    uint64_t digest;
+    time_t written;
+    bool active;
+};
+
+// Digest of the first count references of a sketch (names, comments, lengths
+// and hashes) along with a string of settings. It is chained over references,
+// so it only changes for a prefix if the prefix itself changes.
+//
+uint64_t getSketchDigest(const Sketch & sketch, uint64_t count, const std::string & settings);
+
+#endif
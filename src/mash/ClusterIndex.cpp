@@ -0,0 +1,309 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "ClusterIndex.h"
+#include "CommandDistance.h"
+#include "ThreadPool.h"
+#include "VpTree.h"
+#include "sidecar.h"
+#include <algorithm>
+
+using std::string;
+using std::vector;
+
+static const char * clusterIndexMagic = "MASHCLU3";
+
+void ClusterIndex::getRepresentatives(vector<uint64_t> & representativeByReference) const
+{
+    representativeByReference.resize(referenceCount);
+    
+    for ( uint64_t i = 0; i < representatives.size(); i++ )
+    {
+        representativeByReference[representatives[i]] = representatives[i];
+        
+        for ( uint64_t j = memberStarts[i]; j < memberStarts[i + 1]; j++ )
+        {
+            representativeByReference[members[j].index] = representatives[i];
+        }
+    }
+}
+
+bool ClusterIndex::initFromSidecar(const string & sketchFile, uint64_t referenceCountNew)
+{
+    FILE * stream = openSidecarForReading(sketchFile, suffixClusterIndex, clusterIndexMagic, referenceCountNew);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    uint64_t counts[2];
+    bool success = fread(counts, sizeof(uint64_t), 2, stream) == 2 && counts[0] <= referenceCountNew && counts[0] + counts[1] == referenceCountNew;
+    
+    if ( success )
+    {
+        representatives.resize(counts[0]);
+        radii.resize(counts[0]);
+        memberStarts.resize(counts[0] + 1);
+        members.resize(counts[1]);
+        
+        success =
+            fread(representatives.data(), sizeof(uint64_t), representatives.size(), stream) == representatives.size() &&
+            fread(radii.data(), sizeof(double), radii.size(), stream) == radii.size() &&
+            fread(memberStarts.data(), sizeof(uint64_t), memberStarts.size(), stream) == memberStarts.size() &&
+            fread(members.data(), sizeof(Member), members.size(), stream) == members.size();
+    }
+    
+    for ( uint64_t i = 0; success && i < representatives.size(); i++ )
+    {
+        success = representatives[i] < referenceCountNew && memberStarts[i] <= memberStarts[i + 1] && memberStarts[i + 1] <= members.size();
+    }
+    
+    for ( uint64_t i = 0; success && i < members.size(); i++ )
+    {
+        success = members[i].index < referenceCountNew;
+    }
+    
+    fclose(stream);
+    
+    if ( ! success )
+    {
+        representatives.clear();
+        members.clear();
+    }
+    
+    referenceCount = referenceCountNew;
+    
+    return success;
+}
+
+void ClusterIndex::initFromSketch(const Sketch & sketch, double radius, int threads)
+{
+    referenceCount = sketch.getReferenceCount();
+    representatives.clear();
+    
+    vector<int64_t> clusterByReference(referenceCount);
+    vector<double> distanceByReference(referenceCount);
+    ThreadPool<AssignInput, AssignOutput> threadPool(assignCluster, threads);
+    
+    for ( uint64_t start = 0; start < referenceCount; start += clusterBatchSize )
+    {
+        uint64_t end = start + clusterBatchSize < referenceCount ? start + clusterBatchSize : referenceCount;
+        uint64_t representativesBefore = representatives.size();
+        vector<AssignOutput *> outputs;
+        
+        for ( uint64_t i = start; i < end; i++ )
+        {
+            threadPool.runWhenThreadAvailable(new AssignInput(*this, sketch, i, radius));
+            
+            while ( threadPool.outputAvailable() )
+            {
+                outputs.push_back(threadPool.popOutputWhenAvailable());
+            }
+        }
+        
+        while ( threadPool.running() )
+        {
+            outputs.push_back(threadPool.popOutputWhenAvailable());
+        }
+        
+        for ( uint64_t i = 0; i < outputs.size(); i++ )
+        {
+            AssignOutput * output = outputs[i];
+            
+            findRepresentative(sketch, output->index, radius, representativesBefore, *output);
+            
+            if ( output->cluster == -1 )
+            {
+                output->cluster = representatives.size();
+                output->distance = 0;
+                representatives.push_back(output->index);
+            }
+            
+            clusterByReference[output->index] = output->cluster;
+            distanceByReference[output->index] = output->distance;
+            
+            delete output;
+        }
+    }
+    
+    // group members by cluster
+    
+    radii.clear();
+    radii.resize(representatives.size(), 0);
+    memberStarts.clear();
+    memberStarts.resize(representatives.size() + 1, 0);
+    members.resize(referenceCount - representatives.size());
+    
+    for ( uint64_t i = 0; i < referenceCount; i++ )
+    {
+        if ( representatives[clusterByReference[i]] != i )
+        {
+            memberStarts[clusterByReference[i] + 1]++;
+        }
+    }
+    
+    for ( uint64_t i = 0; i < representatives.size(); i++ )
+    {
+        memberStarts[i + 1] += memberStarts[i];
+    }
+    
+    vector<uint64_t> memberEnds(memberStarts.begin(), memberStarts.end() - 1);
+    
+    for ( uint64_t i = 0; i < referenceCount; i++ )
+    {
+        int64_t cluster = clusterByReference[i];
+        
+        if ( representatives[cluster] != i )
+        {
+            Member & member = members[memberEnds[cluster]++];
+            
+            member.index = i;
+            member.distance = distanceByReference[i];
+            
+            if ( member.distance > radii[cluster] )
+            {
+                radii[cluster] = member.distance;
+            }
+        }
+    }
+    
+    for ( uint64_t i = 0; i < representatives.size(); i++ )
+    {
+        std::sort(members.begin() + memberStarts[i], members.begin() + memberStarts[i + 1]);
+    }
+}
+
+uint64_t ClusterIndex::rangeQuery(const Sketch & sketch, const Sketch::Reference & query, uint64_t sketchSize, double radius, vector<uint64_t> & results) const
+{
+    // Returns references whose estimated distance could be within the radius,
+    // sorted, and the number of comparisons made to find them (as for
+    // VpTree::rangeQuery, including returning all references if the query's
+    // sketch size is smaller than the index's).
+    
+    uint64_t comparisons = 0;
+    
+    results.clear();
+    
+    if ( sketchSize < sketch.getMinHashesPerWindow() )
+    {
+        for ( uint64_t i = 0; i < referenceCount; i++ )
+        {
+            results.push_back(i);
+        }
+        
+        return 0;
+    }
+    
+    radius = VpTree::sketchRadius(radius);
+    
+    for ( uint64_t i = 0; i < representatives.size(); i++ )
+    {
+        double distance = VpTree::jaccardDistance(sketch, sketch.getReference(representatives[i]), query);
+        
+        comparisons++;
+        
+        if ( distance <= radius )
+        {
+            results.push_back(representatives[i]);
+        }
+        
+        if ( distance - radii[i] - vpTreeSlack > radius )
+        {
+            continue;
+        }
+        
+        // only members whose distance to the representative is close to the
+        // query's can be in range
+        
+        Member low;
+        
+        low.index = 0;
+        low.distance = distance - radius - vpTreeSlack;
+        
+        vector<Member>::const_iterator member = std::lower_bound(members.begin() + memberStarts[i], members.begin() + memberStarts[i + 1], low);
+        vector<Member>::const_iterator end = members.begin() + memberStarts[i + 1];
+        
+        for ( ; member != end && member->distance <= distance + radius + vpTreeSlack; member++ )
+        {
+            comparisons++;
+            
+            if ( VpTree::jaccardDistance(sketch, sketch.getReference(member->index), query) <= radius )
+            {
+                results.push_back(member->index);
+            }
+        }
+    }
+    
+    std::sort(results.begin(), results.end());
+    
+    return comparisons;
+}
+
+bool ClusterIndex::writeToSidecar(const string & sketchFile) const
+{
+    FILE * stream = openSidecarForWriting(sketchFile, suffixClusterIndex, clusterIndexMagic, referenceCount);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    uint64_t counts[2] = {representatives.size(), members.size()};
+    
+    bool success =
+        fwrite(counts, sizeof(uint64_t), 2, stream) == 2 &&
+        fwrite(representatives.data(), sizeof(uint64_t), representatives.size(), stream) == representatives.size() &&
+        fwrite(radii.data(), sizeof(double), radii.size(), stream) == radii.size() &&
+        fwrite(memberStarts.data(), sizeof(uint64_t), memberStarts.size(), stream) == memberStarts.size() &&
+        fwrite(members.data(), sizeof(Member), members.size(), stream) == members.size();
+    
+    return fclose(stream) == 0 && success;
+}
+
+void ClusterIndex::findRepresentative(const Sketch & sketch, uint64_t index, double radius, uint64_t first, AssignOutput & output) const
+{
+    // Nearest representative (from the given one on) within the radius, by
+    // estimated distance, if nearer than the one already in the output (from
+    // earlier representatives); ties go to the earlier one. The distance kept
+    // for range queries is the metric one.
+    
+    const Sketch::Reference & ref = sketch.getReference(index);
+    int64_t clusterBefore = output.cluster;
+    
+    output.index = index;
+    
+    for ( uint64_t i = first; i < representatives.size(); i++ )
+    {
+        uint64_t common;
+        uint64_t denom;
+        
+        mash::sketchDistance(sketch.getReference(representatives[i]), ref, sketch.getMinHashesPerWindow(), sketch.getKmerSize(), common, denom);
+        
+        double distance = denom ? 1. - double(common) / denom : 0.;
+        
+        if ( distance <= radius && (output.cluster == -1 || distance < output.estimate) )
+        {
+            output.cluster = i;
+            output.estimate = distance;
+        }
+    }
+    
+    if ( output.cluster != -1 && output.cluster != clusterBefore )
+    {
+        output.distance = VpTree::jaccardDistance(sketch, sketch.getReference(representatives[output.cluster]), ref);
+    }
+}
+
+ClusterIndex::AssignOutput * assignCluster(ClusterIndex::AssignInput * input)
+{
+    ClusterIndex::AssignOutput * output = new ClusterIndex::AssignOutput();
+    
+    output->cluster = -1;
+    input->clusters.findRepresentative(input->sketch, input->index, input->radius, 0, *output);
+    
+    return output;
+}
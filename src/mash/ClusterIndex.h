@@ -0,0 +1,88 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef ClusterIndex_h
+#define ClusterIndex_h
+
+#include "Sketch.h"
+#include <string>
+#include <vector>
+
+static const char * suffixClusterIndex = ".clu";
+
+static const uint64_t clusterBatchSize = 4096;
+
+// Greedy clustering of the references in a sketch around representatives, for
+// range queries that only look inside clusters whose representative is close
+// enough. Like VpTree, this works with the exact Jaccard distance between the
+// sketches' hash sets, which is a metric, so references are only ruled out if
+// the triangle inequality proves they cannot be in range.
+//
+// References are assigned in batches. Each batch is compared to the existing
+// representatives in parallel; each reference is then compared, in order, to
+// representatives made earlier in the batch, keeping the nearest of all, or
+// becomes a new one. This gives the same clusters as assigning references one
+// at a time, regardless of the batch size and thread count.
+
+class ClusterIndex
+{
+public:
+    
+    struct Member
+    {
+        uint64_t index;
+        double distance; // to representative
+        
+        bool operator<(const Member & other) const {return distance < other.distance || (distance == other.distance && index < other.index);}
+    };
+    
+    struct AssignInput
+    {
+        AssignInput(const ClusterIndex & clustersNew, const Sketch & sketchNew, uint64_t indexNew, double radiusNew)
+            :
+            clusters(clustersNew),
+            sketch(sketchNew),
+            index(indexNew),
+            radius(radiusNew)
+            {}
+        
+        const ClusterIndex & clusters;
+        const Sketch & sketch;
+        uint64_t index;
+        double radius;
+    };
+    
+    struct AssignOutput
+    {
+        uint64_t index;
+        int64_t cluster; // -1 if no representative is within the radius
+        double estimate; // estimated distance to the representative, which picks the nearest
+        double distance; // metric distance to it (see VpTree::jaccardDistance())
+    };
+    
+    uint64_t getClusterCount() const {return representatives.size();}
+    void getRepresentatives(std::vector<uint64_t> & representativeByReference) const;
+    bool initFromSidecar(const std::string & sketchFile, uint64_t referenceCount);
+    void initFromSketch(const Sketch & sketch, double radius, int threads);
+    uint64_t rangeQuery(const Sketch & sketch, const Sketch::Reference & query, uint64_t sketchSize, double radius, std::vector<uint64_t> & results) const;
+    bool writeToSidecar(const std::string & sketchFile) const;
+
+private:
+    
+    friend AssignOutput * assignCluster(AssignInput * input);
+    
+    void findRepresentative(const Sketch & sketch, uint64_t index, double radius, uint64_t first, AssignOutput & output) const;
+    
+    std::vector<uint64_t> representatives;
+    std::vector<double> radii;
+    std::vector<uint64_t> memberStarts; // by cluster, plus end
+    std::vector<Member> members; // grouped by cluster, sorted by distance; excludes representatives
+    uint64_t referenceCount;
+};
+
+ClusterIndex::AssignOutput * assignCluster(ClusterIndex::AssignInput * input);
+
+#endif
@@ -8,8 +8,12 @@
 #include <sys/ioctl.h>
 #include <sstream>
 #include <fstream>
+#include <algorithm>
+#include <dirent.h>
 
 #include "Command.h"
+#include "CommandServe.h"
+#include "Checkpoint.h"
 #include "version.h"
 
 using std::cout;
@@ -180,6 +184,7 @@ Command::Command()
     addAvailableOption("minCov", Option(Option::Integer, "m", "Reads", "Minimum copies of each k-mer required to pass noise filter for reads. Implies -r.", "1"));
     addAvailableOption("targetCov", Option(Option::Number, "c", "Reads", "Target coverage. Sketching will conclude if this coverage is reached before the end of the input file (estimated by average k-mer multiplicity). Implies -r."));
     addAvailableOption("genome", Option(Option::Size, "g", "Reads", "Genome size (raw bases or with K/M/G/T). If specified, will be used for p-value calculation instead of an estimated size from k-mer content. Implies -r."));
+    addAvailableOption("cache", Option(Option::File, "cache", "Sketch", "Directory (created if needed) to keep sketches of sequence files in, so files are only sketched again if they change (by path, size, inode or modification time) or the sketch options do. Can be shared by concurrent runs. Read sets and individual sequences (-i) are not cached.", ""));
     addAvailableOption("noncanonical", Option(Option::Boolean, "n", "Alphabet", "Preserve strand (by default, strand is ignored by using canonical DNA k-mers, which are alphabetical minima of forward-reverse pairs). Implied if an alphabet is specified with -a or -z.", ""));
     addAvailableOption("protein", Option(Option::Boolean, "a", "Alphabet", "Use amino acid alphabet (A-Z, except BJOUXZ). Implies -n, -k 9.", ""));
     addAvailableOption("alphabet", Option(Option::String, "z", "Alphabet", "Alphabet to base hashes on (case ignored by default; see -Z). K-mers with other characters will be ignored. Implies -n.", ""));
@@ -189,6 +194,11 @@ Command::Command()
     addAvailableOption("illumina", Option(Option::Boolean, "illumina", "", "Use default settings for Illumina sequences.", ""));
     addAvailableOption("nanopore", Option(Option::Boolean, "nanopore", "", "Use default settings for Oxford Nanopore sequences.", ""));
     addAvailableOption("factor", Option(Option::Number, "f", "Window", "Compression factor", "100"));
+    addAvailableOption("server", Option(Option::File, "server", "", "Run on a server started with \"mash serve\" listening on this socket, using its resident copy of the reference if it has one. Output is the same as running locally.", ""));
+    addAvailableOption("prefilter", Option(Option::Boolean, "F", "", "Prefilter pairs with b-bit signatures, skipping exact comparison of pairs that are clearly beyond the maximum distance (-d, which must be below 1). Reference signatures built by \"mash index -bbit\" are used if present and up to date; otherwise they are computed. The filter is statistical, so pairs very close to the maximum distance may occasionally be missed.", ""));
+    addAvailableOption("shard", Option(Option::String, "shard", "", "Compute only this shard of the pair space, given as <i>/<N> (e.g. 2/8). Pairs are divided into N equally sized ranges in output order, so concatenating the outputs of shards 1 through N (e.g. with cat) reproduces the output of an unsharded run.", ""));
+    addAvailableOption("checkpoint", Option(Option::File, "checkpoint", "", "Record in this file how far output has been written, every " + std::to_string(checkpointInterval) + " seconds, so the run can be continued with -resume if it is stopped. Output must be redirected to a file.", ""));
+    addAvailableOption("resume", Option(Option::Boolean, "resume", "", "Continue from the -checkpoint file of a stopped run with the same inputs and options, discarding output written after the checkpoint. Output must be appended (>>) to the same file.", ""));
     
     addCategory("", "");
     addCategory("Input", "Input");
@@ -197,6 +207,10 @@ Command::Command()
     addCategory("Window", "Sketching (windowed)");
     addCategory("Reads", "Sketching (reads)");
     addCategory("Alphabet", "Sketching (alphabet)");
+    addCategory("Signature", "b-bit signatures");
+    addCategory("LSH", "LSH index");
+    addCategory("HNSW", "Nearest neighbour graph");
+    addCategory("Clusters", "Clusters");
 }
 
 void Command::print() const
@@ -343,9 +357,71 @@ int Command::run(int argc, const char ** argv)
         }
     }
     
+    if ( hasOption("server") && options.at("server").active )
+    {
+        vector<string> request;
+        
+        for ( int i = 0; i < argc; i++ )
+        {
+            if ( argv[i] == "-" + options.at("server").identifier )
+            {
+                i++;
+                continue;
+            }
+            
+            request.push_back(argv[i]);
+        }
+        
+        return runOnServer(options.at("server").argument, name, request);
+    }
+    
     return run();
 }
 
+int Command::getShardRange(uint64_t pairCount, uint64_t & pairFirst, uint64_t & pairLast) const
+{
+    pairFirst = 0;
+    pairLast = pairCount;
+    
+    if ( ! hasOption("shard") || ! options.at("shard").active )
+    {
+        return 0;
+    }
+    
+    const string & argument = options.at("shard").argument;
+    size_t slash = argument.find('/');
+    uint64_t shard = 0;
+    uint64_t shardCount = 0;
+    bool failed = slash == string::npos;
+    
+    if ( ! failed )
+    {
+        try
+        {
+            shard = std::stoull(argument.substr(0, slash));
+            shardCount = std::stoull(argument.substr(slash + 1));
+        }
+        catch ( const exception & e )
+        {
+            failed = true;
+        }
+    }
+    
+    if ( failed || shardCount == 0 || shard == 0 || shard > shardCount )
+    {
+        cerr << "ERROR: Argument to -" << options.at("shard").identifier << " must be of the form <i>/<N>, with 1 <= i <= N (" << argument << " given)." << endl;
+        return 1;
+    }
+    
+    // Ranges are computed from the total so that every shard agrees on its
+    // boundaries without communicating.
+    //
+    pairFirst = pairCount / shardCount * (shard - 1) + pairCount % shardCount * (shard - 1) / shardCount;
+    pairLast = pairCount / shardCount * shard + pairCount % shardCount * shard / shardCount;
+    
+    return 0;
+}
+
 void Command::useOption(string name)
 {
     addOption(name, optionsAvailable.at(name));
@@ -413,6 +489,39 @@ void splitFile(const string & file, vector<string> & lines)
     }
 }
 
+void listDirectory(const string & path, const string & suffix, vector<string> & files)
+{
+    DIR * dir = opendir(path.c_str());
+    
+    if ( dir == 0 )
+    {
+        // not a directory; use as is
+        
+        files.push_back(path);
+        return;
+    }
+    
+    vector<string> entries;
+    struct dirent * entry;
+    
+    while ( (entry = readdir(dir)) != 0 )
+    {
+        string name = entry->d_name;
+        
+        if ( name.length() > suffix.length() && name.compare(name.length() - suffix.length(), suffix.length(), suffix) == 0 )
+        {
+            entries.push_back(path + '/' + name);
+        }
+    }
+    
+    closedir(dir);
+    
+    // sort for an order that does not depend on the file system
+    //
+    std::sort(entries.begin(), entries.end());
+    files.insert(files.end(), entries.begin(), entries.end());
+}
+
 void printColumns(const vector<vector<string>> & columns, int indent, int spacing, const char * missing, int max)
 {
 	printColumns(columns, vector<pair<int, string>>(), indent, spacing, missing, max);
@@ -11,6 +11,7 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <inttypes.h>
 
 namespace mash {
 
@@ -79,6 +80,7 @@ public:
     
 protected:
 	
+    int getShardRange(uint64_t pairCount, uint64_t & pairFirst, uint64_t & pairLast) const;
     void useOption(std::string name);
 	void useSketchOptions();
 	
@@ -98,6 +100,7 @@ private:
 };
 
 inline const Command::Option & Command::getOption(std::string name) const {return options.at(name);}
+void listDirectory(const std::string & path, const std::string & suffix, std::vector<std::string> & files);
 void splitFile(const std::string & file, std::vector<std::string> & lines);
 void printColumns(const std::vector<std::vector<std::string>> & columns, int indent = 2, int spacing = 2, const char * missing = "-", int max = 80);
 void printColumns(const std::vector<std::vector<std::string>> & columns, const std::vector<std::pair<int, std::string>> & dividers, int indent = 2, int spacing = 2, const char * missing = "-", int max = 80);
@@ -0,0 +1,122 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandCompact.h"
+#include "Sketch.h"
+#include "columnar.h"
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "unistd.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace mash {
+
+CommandCompact::CommandCompact()
+: Command()
+{
+    name = "compact";
+    summary = "Rewrite a sketch file without its removed references.";
+    description = "Rewrite a sketch file in place as a single segment of its current references, dropping those removed with \"mash remove\" and merging segments appended with \"mash paste -a\" or written by \"mash sketch -segment\". The rewritten file replaces the old one in one step, so runs already reading the old one are not affected. Appends wait for compaction to finish; if one was made while the file was being read, compaction fails and can be run again.";
+    argumentString = "<sketch>";
+    
+    useOption("help");
+    useOption("threads");
+    addOption("packed", Option(Option::Boolean, "packed", "", "Delta code and bit pack hashes and counts, making the file smaller. Packed files cannot be read by older versions of Mash.", ""));
+}
+
+int CommandCompact::run() const
+{
+    if ( arguments.size() != 1 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    const string & file = arguments[0];
+    
+    if ( ! hasSuffix(file, suffixSketch) )
+    {
+        cerr << "ERROR: The file \"" << file << "\" does not look like a sketch (windowed sketches are not supported)." << endl;
+        return 1;
+    }
+    
+    if ( isColumnarSketch(file.c_str()) )
+    {
+        cerr << "ERROR: Cannot compact the columnar sketch \"" << file << "\"." << endl;
+        return 1;
+    }
+    
+    struct stat fileInfo;
+    
+    if ( stat(file.c_str(), &fileInfo) == -1 )
+    {
+        cerr << "ERROR: could not open \"" << file << "\" for reading." << endl;
+        return 1;
+    }
+    
+    // The file is read before locking it, since reading takes a shared lock
+    // (see mapSketchFile), and is then checked to be the same one.
+    
+    Sketch sketch;
+    Sketch::Parameters parameters;
+    
+    parameters.parallelism = options.at("threads").getArgumentAsNumber();
+    sketch.initFromFiles(vector<string>(1, file), parameters);
+    
+    int fdLock = lockSketchFile(file.c_str());
+    struct stat lockInfo;
+    
+    if ( fdLock < 0 || fstat(fdLock, &lockInfo) == -1 )
+    {
+        cerr << "ERROR: could not lock \"" << file << "\" for writing." << endl;
+        return 1;
+    }
+    
+    if ( lockInfo.st_ino != fileInfo.st_ino || lockInfo.st_size != fileInfo.st_size || lockInfo.st_mtime != fileInfo.st_mtime )
+    {
+        cerr << "ERROR: \"" << file << "\" changed while compacting; try again." << endl;
+        close(fdLock);
+        return 1;
+    }
+    
+    string fileTemp = file + ".XXXXXX";
+    vector<char> name(fileTemp.begin(), fileTemp.end());
+    
+    name.push_back(0);
+    
+    int fdTemp = mkstemp(name.data());
+    
+    if ( fdTemp < 0 )
+    {
+        cerr << "ERROR: could not open " << fileTemp << " for writing." << endl;
+        close(fdLock);
+        return 1;
+    }
+    
+    fchmod(fdTemp, fileInfo.st_mode & 07777);
+    close(fdTemp);
+    
+    cerr << "Writing " << sketch.getReferenceCount() << " references to " << file << "..." << endl;
+    
+    if ( sketch.writeToCapnp(name.data(), options.at("packed").active) != 0 || rename(name.data(), file.c_str()) == -1 )
+    {
+        cerr << "ERROR: Could not write \"" << file << "\"." << endl;
+        unlink(name.data());
+        close(fdLock);
+        return 1;
+    }
+    
+    close(fdLock);
+    return 0;
+}
+
+} // namespace mash
@@ -5,6 +5,7 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "CommandContain.h"
+#include "CommandServe.h"
 #include "Sketch.h"
 #include <iostream>
 #include <zlib.h>
@@ -27,6 +28,7 @@ CommandContain::CommandContain()
     addOption("list", Option(Option::Boolean, "l", "Input", "List input. Each query file contains a list of sequence files, one per line. The reference file is not affected.", ""));
     addOption("errorThreshold", Option(Option::Number, "e", "Output", "Error bound threshold for reporting scores values. Error bounds can generally be increased by increasing the sketch size of the reference.", "0.05"));
     useOption("help");
+    useOption("server");
     useSketchOptions();
 }
 
@@ -50,7 +52,7 @@ int CommandContain::run() const
     	return 1;
     }
     
-    Sketch sketchRef;
+    Sketch sketchLoaded;
     
     const string & fileReference = arguments[0];
     
@@ -90,7 +92,13 @@ int CommandContain::run() const
     
     //cerr << "Sketch for " << fileReference << " not found or out of date; creating..." << endl;
     
-    sketchRef.initFromFiles(refArgVector, parameters);
+    const CommandServe::ResidentReference * resident = getResidentReference(fileReference);
+    const Sketch & sketchRef = resident ? resident->sketch : sketchLoaded;
+    
+    if ( ! resident )
+    {
+        sketchLoaded.initFromFiles(refArgVector, parameters);
+    }
     
     if ( isSketch )
     {
@@ -0,0 +1,90 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandConvert.h"
+#include "Sketch.h"
+#include "columnar.h"
+#include <iostream>
+#include "unistd.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace mash {
+
+CommandConvert::CommandConvert()
+: Command()
+{
+    name = "convert";
+    summary = "Convert a sketch file between the Cap'n Proto and columnar formats.";
+    description = "Convert a sketch file between the Cap'n Proto format and the columnar (version 2) format, which stores hashes in a single aligned matrix that is used in place when loaded. Both formats use the .msh suffix and can be used by any command. Conversion is lossless in either direction.";
+    argumentString = "<sketch> <out_prefix>";
+    
+    useOption("help");
+    useOption("threads");
+    addOption("columnar", Option(Option::Boolean, "v2", "", "Write the columnar format (otherwise Cap'n Proto).", ""));
+    addOption("packed", Option(Option::Boolean, "packed", "", "Delta code and bit pack hashes and counts of Cap'n Proto output, making files smaller. Packed files cannot be read by older versions of Mash.", ""));
+}
+
+int CommandConvert::run() const
+{
+    if ( arguments.size() != 2 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    const string & file = arguments[0];
+    string out = arguments[1];
+    
+    if ( ! hasSuffix(file, suffixSketch) )
+    {
+        cerr << "ERROR: The file \"" << file << "\" does not look like a sketch (windowed sketches are not supported)." << endl;
+        return 1;
+    }
+    
+    if ( ! hasSuffix(out, suffixSketch) )
+    {
+        out += suffixSketch;
+    }
+    
+    if ( options.at("columnar").active && options.at("packed").active )
+    {
+        cerr << "ERROR: The -" << options.at("packed").identifier << " option only applies to Cap'n Proto output." << endl;
+        return 1;
+    }
+    
+    if ( access(out.c_str(), F_OK) != -1 )
+    {
+        cerr << "ERROR: \"" << out << "\" exists; remove to write." << endl;
+        return 1;
+    }
+    
+    Sketch sketch;
+    Sketch::Parameters parameters;
+    vector<string> files;
+    
+    parameters.parallelism = options.at("threads").getArgumentAsNumber();
+    files.push_back(file);
+    
+    if ( sketch.initFromFiles(files, parameters) )
+    {
+        return 1;
+    }
+    
+    cerr << "Writing " << out << "..." << endl;
+    
+    if ( options.at("columnar").active )
+    {
+        return writeColumnar(sketch, out.c_str());
+    }
+    
+    return sketch.writeToCapnp(out.c_str(), options.at("packed").active);
+}
+
+} // namespace mash
@@ -5,8 +5,11 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "CommandDistance.h"
+#include "CommandServe.h"
 #include "Sketch.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <zlib.h>
 #include "ThreadPool.h"
 #include "sketchParameterSetup.h"
@@ -32,13 +35,23 @@ CommandDistance::CommandDistance()
     argumentString = "<reference> <query> [<query>] ...";
     
     useOption("help");
+    addOption("referenceList", Option(Option::Boolean, "R", "Input", "Reference list. Lines in <reference> specify paths to reference files, one per line. References are loaded in parallel (see -p) and compared as if they were one file, without needing \"mash paste\". With or without this option, a directory can be given for a reference, in which case all sketch files (.msh) in it are used.", ""));
     addOption("list", Option(Option::Boolean, "l", "Input", "List input. Lines in each <query> specify paths to sequence files, one per line. The reference file is not affected.", ""));
     addOption("table", Option(Option::Boolean, "t", "Output", "Table output (will not report p-values, but fields will be blank if they do not meet the p-value threshold).", ""));
     //addOption("log", Option(Option::Boolean, "L", "Output", "Log scale distances and divide by k-mer size to provide a better analog to phylogenetic distance. The special case of zero shared min-hashes will result in a distance of 1.", ""));
     addOption("pvalue", Option(Option::Number, "v", "Output", "Maximum p-value to report.", "1.0", 0., 1.));
     addOption("distance", Option(Option::Number, "d", "Output", "Maximum distance to report.", "1.0", 0., 1.));
     addOption("comment", Option(Option::Boolean, "C", "Output", "Show comment fields with reference/query names (denoted with ':').", "1.0", 0., 1.));
+    addOption("batch", Option(Option::Integer, "B", "Input", "Stream queries in batches of this many files. Each batch is sketched, compared and written before the next is read, bounding memory and giving early results. With -l, lists are read as they are written, and a list of \"-\" is read from standard input. Incompatible with -shard. If 0, all queries are sketched before comparing.", "0"));
+    addOption("vp", Option(Option::Boolean, "vp", "", "Find references within the maximum distance (-d, which must be below 1) using a vantage-point tree, skipping references that cannot be within it. Results are the same as without this option. A tree built by \"mash index -vp\" is used if present and up to date; otherwise one is built. The number of comparisons made is reported.", ""));
+    addOption("clusters", Option(Option::Boolean, "clusters", "", "Find references within the maximum distance (-d, which must be below 1) by comparing to cluster representatives first, and then only to members of clusters that could be within it. Clusters must be built with \"mash index -clusters\". Results are the same as without this option. Incompatible with -vp.", ""));
+    useOption("prefilter");
+    useOption("shard");
+    useOption("checkpoint");
+    useOption("resume");
+    useOption("server");
     useSketchOptions();
+    useOption("cache");
 }
 
 int CommandDistance::run() const
@@ -49,13 +62,13 @@ int CommandDistance::run() const
         return 0;
     }
     
-    int threads = options.at("threads").getArgumentAsNumber();
     bool list = options.at("list").active;
     bool table = options.at("table").active;
     bool comment = options.at("comment").active;
     //bool log = options.at("log").active;
     double pValueMax = options.at("pvalue").getArgumentAsNumber();
     double distanceMax = options.at("distance").getArgumentAsNumber();
+    uint64_t batchSize = options.at("batch").getArgumentAsNumber();
     
     Sketch::Parameters parameters;
     
@@ -64,7 +77,7 @@ int CommandDistance::run() const
     	return 1;
     }
     
-    Sketch sketchRef;
+    Sketch sketchLoaded;
     
     uint64_t lengthMax;
     double randomChance;
@@ -73,8 +86,31 @@ int CommandDistance::run() const
     int warningCount = 0;
     
     const string & fileReference = arguments[0];
+    vector<string> refArgVector;
+    
+    if ( options.at("referenceList").active )
+    {
+        vector<string> lines;
+        
+        splitFile(fileReference, lines);
+        
+        for ( int i = 0; i < lines.size(); i++ )
+        {
+            listDirectory(lines[i], suffixSketch, refArgVector);
+        }
+    }
+    else
+    {
+        listDirectory(fileReference, suffixSketch, refArgVector);
+    }
+    
+    if ( refArgVector.size() == 0 )
+    {
+        cerr << "ERROR: No reference files found in " << fileReference << "." << endl;
+        return 1;
+    }
     
-    bool isSketch = hasSuffix(fileReference, suffixSketch);
+    bool isSketch = hasSuffix(refArgVector[0], suffixSketch);
     
     if ( isSketch )
     {
@@ -107,12 +143,15 @@ int CommandDistance::run() const
         cerr << "Sketching " << fileReference << " (provide sketch file made with \"mash sketch\" to skip)...";
     }
     
-    vector<string> refArgVector;
-    refArgVector.push_back(fileReference);
-    
     //cerr << "Sketch for " << fileReference << " not found or out of date; creating..." << endl;
     
-    sketchRef.initFromFiles(refArgVector, parameters);
+    const CommandServe::ResidentReference * resident = refArgVector.size() == 1 ? getResidentReference(refArgVector[0]) : 0;
+    const Sketch & sketchRef = resident ? resident->sketch : sketchLoaded;
+    
+    if ( ! resident )
+    {
+        sketchLoaded.initFromFiles(refArgVector, parameters);
+    }
     
     double lengthThreshold = (parameters.warning * sketchRef.getKmerSpace()) / (1. - parameters.warning);
     
@@ -160,40 +199,172 @@ int CommandDistance::run() const
         cerr << "done.\n";
     }
     
-    if ( table )
+    BitSignatures signaturesLoaded;
+    const BitSignatures * signaturesRef = 0;
+    
+    if ( options.at("prefilter").active )
     {
-        cout << "#query";
+        if ( distanceMax >= 1 )
+        {
+            cerr << "ERROR: The option -" << options.at("prefilter").identifier << " requires a maximum distance (-" << options.at("distance").identifier << ") below 1." << endl;
+            return 1;
+        }
         
-        for ( int i = 0; i < sketchRef.getReferenceCount(); i++ )
+        if ( ! (refArgVector.size() == 1 && isSketch && signaturesLoaded.initFromSidecar(refArgVector[0], sketchRef.getReferenceCount())) )
         {
-            cout << '\t' << sketchRef.getReference(i).name;
+            signaturesLoaded.initFromSketch(sketchRef, bitSignatureBitsDefault, bitSignatureBinsDefault);
         }
         
-        cout << endl;
+        signaturesRef = &signaturesLoaded;
     }
     
-    ThreadPool<CompareInput, CompareOutput> threadPool(compare, threads);
+    VpTree treeLoaded;
+    const VpTree * tree = 0;
     
-    vector<string> queryFiles;
+    if ( options.at("vp").active )
+    {
+        if ( distanceMax >= 1 )
+        {
+            cerr << "ERROR: The option -" << options.at("vp").identifier << " requires a maximum distance (-" << options.at("distance").identifier << ") below 1." << endl;
+            return 1;
+        }
+        
+        if ( ! (refArgVector.size() == 1 && isSketch && treeLoaded.initFromSidecar(refArgVector[0], sketchRef.getReferenceCount())) )
+        {
+            cerr << "Building vantage-point tree (run \"mash index -vp\" to skip)..." << endl;
+            treeLoaded.initFromSketch(sketchRef);
+        }
+        
+        tree = &treeLoaded;
+    }
     
-    for ( int i = 1; i < arguments.size(); i++ )
+    ClusterIndex clustersLoaded;
+    const ClusterIndex * clusters = 0;
+    
+    if ( options.at("clusters").active )
     {
-        if ( list )
+        if ( tree )
         {
-            splitFile(arguments[i], queryFiles);
+            cerr << "ERROR: The options -" << options.at("vp").identifier << " and -" << options.at("clusters").identifier << " are incompatible." << endl;
+            return 1;
         }
-        else
+        
+        if ( distanceMax >= 1 )
         {
-            queryFiles.push_back(arguments[i]);
+            cerr << "ERROR: The option -" << options.at("clusters").identifier << " requires a maximum distance (-" << options.at("distance").identifier << ") below 1." << endl;
+            return 1;
         }
+        
+        if ( ! (refArgVector.size() == 1 && isSketch && clustersLoaded.initFromSidecar(refArgVector[0], sketchRef.getReferenceCount())) )
+        {
+            cerr << "ERROR: No up-to-date clusters found for " << fileReference << " (build them with \"mash index -clusters\")." << endl;
+            return 1;
+        }
+        
+        clusters = &clustersLoaded;
     }
     
-    Sketch sketchQuery;
+    if ( options.at("resume").active && ! options.at("checkpoint").active )
+    {
+        cerr << "ERROR: The option -" << options.at("resume").identifier << " requires a checkpoint file (-" << options.at("checkpoint").identifier << ")." << endl;
+        return 1;
+    }
     
-    sketchQuery.initFromFiles(queryFiles, parameters, 0, true);
+    if ( batchSize > 0 )
+    {
+        if ( options.at("shard").active || options.at("checkpoint").active )
+        {
+            cerr << "ERROR: The option -" << options.at("batch").identifier << " is incompatible with -" << options.at("shard").identifier << " and -" << options.at("checkpoint").identifier << "." << endl;
+            return 1;
+        }
+        
+        if ( table )
+        {
+            writeTableHeader(sketchRef);
+        }
+        
+        streamQueries(sketchRef, parameters, batchSize, list, table, comment, distanceMax, pValueMax, signaturesRef, tree, clusters);
+    }
+    else
+    {
+        vector<string> queryFiles;
+        
+        for ( int i = 1; i < arguments.size(); i++ )
+        {
+            if ( list )
+            {
+                splitFile(arguments[i], queryFiles);
+            }
+            else
+            {
+                queryFiles.push_back(arguments[i]);
+            }
+        }
+        
+        Sketch sketchQuery;
+        
+        sketchQuery.initFromFiles(queryFiles, parameters, 0, true);
+        
+        uint64_t pairCount = sketchRef.getReferenceCount() * sketchQuery.getReferenceCount();
+        uint64_t pairFirst;
+        uint64_t pairLast;
+        
+        if ( getShardRange(pairCount, pairFirst, pairLast) )
+        {
+            return 1;
+        }
+        
+        Checkpoint checkpoint;
+        
+        if ( options.at("checkpoint").active )
+        {
+            // Pair order and output are determined by the inputs and options,
+            // so the digest covers both sketches and every option that
+            // changes what is written.
+            
+            ostringstream settings;
+            
+            settings << getSketchDigest(sketchRef, sketchRef.getReferenceCount(), "") << " t=" << table << " C=" << comment << " d=" << distanceMax << " v=" << pValueMax << " F=" << (signaturesRef != 0) << " pairs=" << pairFirst << "-" << pairLast;
+            
+            if ( checkpoint.init(options.at("checkpoint").argument, getSketchDigest(sketchQuery, sketchQuery.getReferenceCount(), settings.str()), options.at("resume").active, pairFirst) )
+            {
+                return 1;
+            }
+        }
+        
+        if ( table && pairFirst == 0 )
+        {
+            writeTableHeader(sketchRef);
+        }
+        
+        compareRange(sketchRef, sketchQuery, pairFirst, pairLast, parameters, table, comment, distanceMax, pValueMax, signaturesRef, tree, clusters, checkpoint.getActive() ? &checkpoint : 0);
+        
+        if ( checkpoint.getActive() )
+        {
+            checkpoint.finish();
+        }
+    }
     
-    uint64_t pairCount = sketchRef.getReferenceCount() * sketchQuery.getReferenceCount();
-    uint64_t pairsPerThread = pairCount / parameters.parallelism;
+    if ( warningCount > 0 && ! parameters.reads )
+    {
+    	warnKmerSize(parameters, *this, lengthMax, lengthMaxName, randomChance, kMin, warningCount);
+    }
+    
+    return 0;
+}
+
+void CommandDistance::compareRange(const Sketch & sketchRef, const Sketch & sketchQuery, uint64_t pairFirst, uint64_t pairLast, const Sketch::Parameters & parameters, bool table, bool comment, double distanceMax, double pValueMax, const BitSignatures * signaturesRef, const VpTree * tree, const ClusterIndex * clusters, Checkpoint * checkpoint) const
+{
+    ThreadPool<CompareInput, CompareOutput> threadPool(compare, parameters.parallelism);
+    
+    BitSignatures signaturesQuery;
+    
+    if ( signaturesRef )
+    {
+        signaturesQuery.initFromSketch(sketchQuery, signaturesRef->getBits(), signaturesRef->getBins());
+    }
+    
+    uint64_t pairsPerThread = (pairLast - pairFirst) / parameters.parallelism;
     
     if ( pairsPerThread == 0 )
     {
@@ -207,44 +378,127 @@ int CommandDistance::run() const
         pairsPerThread = maxPairsPerThread;
     }
     
-    uint64_t iFloor = pairsPerThread / sketchRef.getReferenceCount();
-    uint64_t iMod = pairsPerThread % sketchRef.getReferenceCount();
+    uint64_t pairsThisThread;
+    uint64_t comparisons = 0;
     
-    for ( uint64_t i = 0, j = 0; i < sketchQuery.getReferenceCount(); i += iFloor, j += iMod )
+    for ( uint64_t pair = pairFirst; pair < pairLast; pair += pairsThisThread )
     {
-        if ( j >= sketchRef.getReferenceCount() )
+        pairsThisThread = pairLast - pair < pairsPerThread ? pairLast - pair : pairsPerThread;
+        
+        if ( tree || clusters )
         {
-            if ( i == sketchQuery.getReferenceCount() - 1 )
-            {
-                break;
-            }
+            // one query per task, so each range query is only done once
             
-            i++;
-            j -= sketchRef.getReferenceCount();
+            uint64_t pairsThisRow = sketchRef.getReferenceCount() - pair % sketchRef.getReferenceCount();
+            
+            pairsThisThread = pairLast - pair < pairsThisRow ? pairLast - pair : pairsThisRow;
         }
         
-        threadPool.runWhenThreadAvailable(new CompareInput(sketchRef, sketchQuery, j, i, pairsPerThread, parameters, distanceMax, pValueMax));
+        threadPool.runWhenThreadAvailable(new CompareInput(sketchRef, sketchQuery, pair % sketchRef.getReferenceCount(), pair / sketchRef.getReferenceCount(), pairsThisThread, parameters, distanceMax, pValueMax, signaturesRef, signaturesRef ? &signaturesQuery : 0, tree, clusters));
+        
+        if ( checkpoint )
+        {
+            checkpoint->taskSubmitted(pair + pairsThisThread);
+        }
         
         while ( threadPool.outputAvailable() )
         {
-            writeOutput(threadPool.popOutputWhenAvailable(), table, comment);
+            CompareOutput * output = threadPool.popOutputWhenAvailable();
+            
+            comparisons += output->comparisons;
+            writeOutput(output, table, comment, checkpoint);
         }
     }
     
     while ( threadPool.running() )
     {
-        writeOutput(threadPool.popOutputWhenAvailable(), table, comment);
+        CompareOutput * output = threadPool.popOutputWhenAvailable();
+        
+        comparisons += output->comparisons;
+        writeOutput(output, table, comment, checkpoint);
     }
     
-    if ( warningCount > 0 && ! parameters.reads )
+    if ( tree || clusters )
     {
-    	warnKmerSize(parameters, *this, lengthMax, lengthMaxName, randomChance, kMin, warningCount);
+        cerr << "Range queries made " << comparisons << " comparisons for " << (pairLast - pairFirst) << " pairs." << endl;
     }
+}
+
+void CommandDistance::streamQueries(const Sketch & sketchRef, const Sketch::Parameters & parameters, uint64_t batchSize, bool list, bool table, bool comment, double distanceMax, double pValueMax, const BitSignatures * signaturesRef, const VpTree * tree, const ClusterIndex * clusters) const
+{
+    // Sketch, compare and write queries a batch at a time so memory is bounded
+    // by the batch size and results appear as soon as the first batch is done.
+    // Lists are read line by line, so a list on stdin can be fed continuously.
     
-    return 0;
+    vector<string> batch;
+    
+    for ( int i = 1; i <= arguments.size(); i++ )
+    {
+        if ( i < arguments.size() && list )
+        {
+            std::ifstream listFile;
+            std::istream * in = &std::cin;
+            string line;
+            
+            if ( arguments[i] != "-" )
+            {
+                listFile.open(arguments[i]);
+                
+                if ( listFile.fail() )
+                {
+                    cerr << "ERROR: Could not open " << arguments[i] << ".\n";
+                    exit(1);
+                }
+                
+                in = &listFile;
+            }
+            
+            while ( getline(*in, line) )
+            {
+                batch.push_back(line);
+                
+                if ( batch.size() == batchSize )
+                {
+                    compareBatch(sketchRef, batch, parameters, table, comment, distanceMax, pValueMax, signaturesRef, tree, clusters);
+                }
+            }
+        }
+        else if ( i < arguments.size() )
+        {
+            batch.push_back(arguments[i]);
+        }
+        
+        if ( batch.size() == batchSize || (i == arguments.size() && batch.size() > 0) )
+        {
+            compareBatch(sketchRef, batch, parameters, table, comment, distanceMax, pValueMax, signaturesRef, tree, clusters);
+        }
+    }
+}
+
+void CommandDistance::compareBatch(const Sketch & sketchRef, vector<string> & batch, const Sketch::Parameters & parameters, bool table, bool comment, double distanceMax, double pValueMax, const BitSignatures * signaturesRef, const VpTree * tree, const ClusterIndex * clusters) const
+{
+    Sketch sketchQuery;
+    
+    sketchQuery.initFromFiles(batch, parameters, 0, true);
+    compareRange(sketchRef, sketchQuery, 0, sketchRef.getReferenceCount() * sketchQuery.getReferenceCount(), parameters, table, comment, distanceMax, pValueMax, signaturesRef, tree, clusters);
+    cout.flush();
+    
+    batch.clear();
 }
 
-void CommandDistance::writeOutput(CompareOutput * output, bool table, bool comment) const
+void CommandDistance::writeTableHeader(const Sketch & sketchRef) const
+{
+    cout << "#query";
+    
+    for ( int i = 0; i < sketchRef.getReferenceCount(); i++ )
+    {
+        cout << '\t' << sketchRef.getReference(i).name;
+    }
+    
+    cout << endl;
+}
+
+void CommandDistance::writeOutput(CompareOutput * output, bool table, bool comment, Checkpoint * checkpoint) const
 {
     uint64_t i = output->indexQuery;
     uint64_t j = output->indexRef;
@@ -301,6 +555,11 @@ void CommandDistance::writeOutput(CompareOutput * output, bool table, bool comme
     }
     
     delete output;
+    
+    if ( checkpoint )
+    {
+        checkpoint->taskWritten();
+    }
 }
 
 CommandDistance::CompareOutput * compare(CommandDistance::CompareInput * input)
@@ -314,12 +573,51 @@ CommandDistance::CompareOutput * compare(CommandDistance::CompareInput * input)
         sketchQuery.getMinHashesPerWindow() :
         sketchRef.getMinHashesPerWindow();
     
+    double jaccardMin = jaccardFromDistance(input->maxDistance, sketchRef.getKmerSize());
+    
     uint64_t i = input->indexQuery;
     uint64_t j = input->indexRef;
     
+    // with a range index, only references found by a range query (for the
+    // single query in this task) are compared
+    
+    bool ranged = input->tree || input->clusters;
+    vector<uint64_t> inRange;
+    uint64_t inRangeNext = 0;
+    
+    if ( input->tree )
+    {
+        output->comparisons = input->tree->rangeQuery(sketchRef, sketchQuery.getReference(i), sketchSize, 1. - jaccardMin, inRange);
+    }
+    else if ( input->clusters )
+    {
+        output->comparisons = input->clusters->rangeQuery(sketchRef, sketchQuery.getReference(i), sketchSize, 1. - jaccardMin, inRange);
+    }
+    
     for ( uint64_t k = 0; k < input->pairCount && i < sketchQuery.getReferenceCount(); k++ )
     {
-        compareSketches(&output->pairs[k], sketchRef.getReference(j), sketchQuery.getReference(i), sketchSize, sketchRef.getKmerSize(), sketchRef.getKmerSpace(), input->maxDistance, input->maxPValue);
+        while ( inRangeNext < inRange.size() && inRange[inRangeNext] < j )
+        {
+            inRangeNext++;
+        }
+        
+        if ( ranged && (inRangeNext == inRange.size() || inRange[inRangeNext] != j) )
+        {
+            output->pairs[k].pass = false;
+            output->pairs[k].distance = 1.;
+            output->pairs[k].pValue = 0.;
+        }
+        else if ( input->signaturesRef && ! input->signaturesRef->mayMeetJaccard(j, *input->signaturesQuery, i, jaccardMin) )
+        {
+            output->pairs[k].pass = false;
+            output->pairs[k].distance = 1.;
+            output->pairs[k].pValue = 0.;
+        }
+        else
+        {
+            compareSketches(&output->pairs[k], sketchRef.getReference(j), sketchQuery.getReference(i), sketchSize, sketchRef.getKmerSize(), sketchRef.getKmerSpace(), input->maxDistance, input->maxPValue);
+            output->comparisons++;
+        }
         
         j++;
         
@@ -334,15 +632,50 @@ CommandDistance::CompareOutput * compare(CommandDistance::CompareInput * input)
 }
 
 void compareSketches(CommandDistance::CompareOutput::PairOutput * output, const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, double kmerSpace, double maxDistance, double maxPValue)
+{
+    uint64_t common;
+    uint64_t denom;
+    
+    output->pass = false;
+    
+    double distance = sketchDistance(refRef, refQry, sketchSize, kmerSize, common, denom);
+    
+    if ( maxDistance >= 0 && distance > maxDistance )
+    {
+        return;
+    }
+    
+    output->numer = common;
+    output->denom = denom;
+    output->distance = distance;
+    output->pValue = pValue(common, refRef.length, refQry.length, kmerSpace, denom);
+    
+    if ( maxPValue >= 0 && output->pValue > maxPValue )
+    {
+        return;
+    }
+    
+    output->pass = true;
+}
+
+double jaccardFromDistance(double distance, int kmerSize)
+{
+    // inverse of the Mash distance, D = -ln(2J / (1 + J)) / k
+    
+    double x = exp(-distance * kmerSize);
+    
+    return x / (2. - x);
+}
+
+double sketchDistance(const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, uint64_t & common, uint64_t & denom)
 {
     uint64_t i = 0;
     uint64_t j = 0;
-    uint64_t common = 0;
-    uint64_t denom = 0;
     const HashList & hashesSortedRef = refRef.hashesSorted;
     const HashList & hashesSortedQry = refQry.hashesSorted;
     
-    output->pass = false;
+    common = 0;
+    denom = 0;
     
     while ( denom < sketchSize && i < hashesSortedRef.size() && j < hashesSortedQry.size() )
     {
@@ -406,22 +739,7 @@ void compareSketches(CommandDistance::CompareOutput::PairOutput * output, const
         }
     }
     
-    if ( maxDistance >= 0 && distance > maxDistance )
-    {
-        return;
-    }
-    
-    output->numer = common;
-    output->denom = denom;
-    output->distance = distance;
-    output->pValue = pValue(common, refRef.length, refQry.length, kmerSpace, denom);
-    
-    if ( maxPValue >= 0 && output->pValue > maxPValue )
-    {
-        return;
-    }
-    
-    output->pass = true;
+    return distance;
 }
 
 double pValue(uint64_t x, uint64_t lengthRef, uint64_t lengthQuery, double kmerSpace, uint64_t sketchSize)
@@ -7,8 +7,12 @@
 #ifndef INCLUDED_CommandDistance
 #define INCLUDED_CommandDistance
 
+#include "BitSignatures.h"
+#include "ClusterIndex.h"
 #include "Command.h"
 #include "Sketch.h"
+#include "VpTree.h"
+#include "Checkpoint.h"
 
 namespace mash {
 
@@ -18,7 +22,7 @@ public:
     
     struct CompareInput
     {
-        CompareInput(const Sketch & sketchRefNew, const Sketch & sketchQueryNew, uint64_t indexRefNew, uint64_t indexQueryNew, uint64_t pairCountNew, const Sketch::Parameters & parametersNew, double maxDistanceNew, double maxPValueNew)
+        CompareInput(const Sketch & sketchRefNew, const Sketch & sketchQueryNew, uint64_t indexRefNew, uint64_t indexQueryNew, uint64_t pairCountNew, const Sketch::Parameters & parametersNew, double maxDistanceNew, double maxPValueNew, const BitSignatures * signaturesRefNew = 0, const BitSignatures * signaturesQueryNew = 0, const VpTree * treeNew = 0, const ClusterIndex * clustersNew = 0)
             :
             sketchRef(sketchRefNew),
             sketchQuery(sketchQueryNew),
@@ -27,7 +31,11 @@ public:
             pairCount(pairCountNew),
             parameters(parametersNew),
             maxDistance(maxDistanceNew),
-            maxPValue(maxPValueNew)
+            maxPValue(maxPValueNew),
+            signaturesRef(signaturesRefNew),
+            signaturesQuery(signaturesQueryNew),
+            tree(treeNew),
+            clusters(clustersNew)
             {}
         
         const Sketch & sketchRef;
@@ -40,6 +48,14 @@ public:
         const Sketch::Parameters & parameters;
         double maxDistance;
         double maxPValue;
+        
+        // for prefiltering; 0 if not used
+        const BitSignatures * signaturesRef;
+        const BitSignatures * signaturesQuery;
+        
+        // for range queries; 0 if not used
+        const VpTree * tree;
+        const ClusterIndex * clusters;
     };
     
     struct CompareOutput
@@ -50,7 +66,8 @@ public:
             sketchQuery(sketchQueryNew),
             indexRef(indexRefNew),
             indexQuery(indexQueryNew),
-            pairCount(pairCountNew)
+            pairCount(pairCountNew),
+            comparisons(0)
         {
             pairs = new PairOutput[pairCount];
         }
@@ -75,6 +92,7 @@ public:
         uint64_t indexRef;
         uint64_t indexQuery;
         uint64_t pairCount;
+        uint64_t comparisons;
         
         PairOutput * pairs;
     };
@@ -85,12 +103,18 @@ public:
     
 private:
     
-    void writeOutput(CompareOutput * output, bool table, bool comment) const;
+    void compareBatch(const Sketch & sketchRef, std::vector<std::string> & batch, const Sketch::Parameters & parameters, bool table, bool comment, double distanceMax, double pValueMax, const BitSignatures * signaturesRef, const VpTree * tree, const ClusterIndex * clusters) const;
+    void compareRange(const Sketch & sketchRef, const Sketch & sketchQuery, uint64_t pairFirst, uint64_t pairLast, const Sketch::Parameters & parameters, bool table, bool comment, double distanceMax, double pValueMax, const BitSignatures * signaturesRef, const VpTree * tree, const ClusterIndex * clusters, Checkpoint * checkpoint = 0) const;
+    void streamQueries(const Sketch & sketchRef, const Sketch::Parameters & parameters, uint64_t batchSize, bool list, bool table, bool comment, double distanceMax, double pValueMax, const BitSignatures * signaturesRef, const VpTree * tree, const ClusterIndex * clusters) const;
+    void writeOutput(CompareOutput * output, bool table, bool comment, Checkpoint * checkpoint = 0) const;
+    void writeTableHeader(const Sketch & sketchRef) const;
 };
 
 CommandDistance::CompareOutput * compare(CommandDistance::CompareInput * input);
 void compareSketches(CommandDistance::CompareOutput::PairOutput * output, const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, double kmerSpace, double maxDistance, double maxPValue);
+double jaccardFromDistance(double distance, int kmerSize);
 double pValue(uint64_t x, uint64_t lengthRef, uint64_t lengthQuery, double kmerSpace, uint64_t sketchSize);
+double sketchDistance(const Sketch::Reference & refRef, const Sketch::Reference & refQry, uint64_t sketchSize, int kmerSize, uint64_t & common, uint64_t & denom);
 
 } // namespace mash
 
@@ -0,0 +1,180 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandExtract.h"
+#include "NameIndex.h"
+#include "Sketch.h"
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+#include <unordered_set>
+#include "unistd.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
+
+namespace mash {
+
+CommandExtract::CommandExtract()
+: Command()
+{
+    name = "extract";
+    summary = "Write named references of a sketch file to a new sketch file.";
+    description = "Write the references with the given names (IDs) from a sketch file to a new sketch file, decoding only those references. If a name index (" + string(suffixNameIndex) + ", built by \"mash index -names\") is present next to the sketch file, it is used to find them without reading every name.";
+    argumentString = "<sketch> <name> [<name>] ...";
+    
+    useOption("help");
+    addOption("output", Option(Option::File, "o", "", "Output prefix (required). The suffix '.msh' will be appended.", ""));
+    addOption("list", Option(Option::Boolean, "l", "", "Names are given as files listing them, one per line.", ""));
+}
+
+int CommandExtract::run() const
+{
+    if ( arguments.size() < 2 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    const string & file = arguments[0];
+    string out = options.at("output").argument;
+    
+    if ( out == "" )
+    {
+        cerr << "ERROR: Output prefix (-" << options.at("output").identifier << ") required." << endl;
+        return 1;
+    }
+    
+    if ( ! hasSuffix(file, suffixSketch) )
+    {
+        cerr << "ERROR: The file \"" << file << "\" does not look like a sketch (windowed sketches are not supported)." << endl;
+        return 1;
+    }
+    
+    if ( ! hasSuffix(out, suffixSketch) )
+    {
+        out += suffixSketch;
+    }
+    
+    if ( access(out.c_str(), F_OK) != -1 )
+    {
+        cerr << "ERROR: \"" << out << "\" exists; remove to write." << endl;
+        return 1;
+    }
+    
+    vector<string> names;
+    
+    for ( int i = 1; i < arguments.size(); i++ )
+    {
+        if ( options.at("list").active )
+        {
+            splitFile(arguments[i], names);
+        }
+        else
+        {
+            names.push_back(arguments[i]);
+        }
+    }
+    
+    uint64_t referenceCount = Sketch().initParametersFromCapnp(file.c_str());
+    
+    // Candidate positions for each name, from the name index if there is
+    // one, or else from reading just the names of the file.
+    
+    NameIndex nameIndex;
+    vector<uint64_t> candidates;
+    
+    if ( nameIndex.initFromSidecar(file, referenceCount) )
+    {
+        for ( int i = 0; i < names.size(); i++ )
+        {
+            nameIndex.find(names[i], candidates);
+        }
+    }
+    else
+    {
+        vector<string> namesAll;
+        
+        if ( ! getCapnpReferenceNames(file.c_str(), namesAll) )
+        {
+            cerr << "ERROR: Could not read names from \"" << file << "\"." << endl;
+            return 1;
+        }
+        
+        unordered_set<string> namesWanted(names.begin(), names.end());
+        
+        for ( uint64_t i = 0; i < namesAll.size(); i++ )
+        {
+            if ( namesWanted.count(namesAll[i]) )
+            {
+                candidates.push_back(i);
+            }
+        }
+    }
+    
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    
+    // Index hashes can collide, so decode the candidates and keep the ones
+    // whose names actually match, in the order the names were given.
+    
+    Sketch sketchCandidates;
+    
+    if ( sketchCandidates.initFromCapnpReferences(file.c_str(), candidates) )
+    {
+        return 1;
+    }
+    
+    unordered_map<string, uint64_t> candidateByName;
+    
+    for ( uint64_t i = 0; i < sketchCandidates.getReferenceCount(); i++ )
+    {
+        candidateByName.emplace(sketchCandidates.getReference(i).name, i);
+    }
+    
+    vector<uint64_t> indices;
+    unordered_set<string> namesFound;
+    
+    for ( int i = 0; i < names.size(); i++ )
+    {
+        if ( namesFound.count(names[i]) )
+        {
+            continue;
+        }
+        
+        unordered_map<string, uint64_t>::const_iterator candidate = candidateByName.find(names[i]);
+        
+        if ( candidate == candidateByName.end() )
+        {
+            cerr << "WARNING: \"" << names[i] << "\" not found in \"" << file << "\"." << endl;
+            continue;
+        }
+        
+        namesFound.insert(names[i]);
+        indices.push_back(candidate->second);
+    }
+    
+    if ( indices.size() == 0 )
+    {
+        cerr << "ERROR: None of the names were found in \"" << file << "\"." << endl;
+        return 1;
+    }
+    
+    Sketch sketch;
+    
+    sketch.initFromReferences(sketchCandidates, indices);
+    
+    cerr << "Writing " << out << "..." << endl;
+    sketch.writeToCapnp(out.c_str());
+    
+    return 0;
+}
+
+} // namespace mash
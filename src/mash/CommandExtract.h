@@ -0,0 +1,25 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_CommandExtract
+#define INCLUDED_CommandExtract
+
+#include "Command.h"
+
+namespace mash {
+
+class CommandExtract : public Command
+{
+public:
+    
+    CommandExtract();
+    
+    int run() const; // override
+};
+
+} // namespace mash
+
+#endif
@@ -0,0 +1,248 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandIndex.h"
+#include "BitSignatures.h"
+#include "ClusterIndex.h"
+#include "CommandDistance.h"
+#include "HnswIndex.h"
+#include "LshIndex.h"
+#include "NameIndex.h"
+#include "VpTree.h"
+#include "Sketch.h"
+#include <iostream>
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace mash {
+
+CommandIndex::CommandIndex()
+: Command()
+{
+    name = "index";
+    summary = "Build search structures for sketch files.";
+    description = "Build search structures for sketch files, to speed up later comparisons with them. Each is written next to the sketch file, as <sketch>.msh plus a suffix, and is used automatically by commands that support it. If the sketch file changes, the structures are ignored until rebuilt.";
+    argumentString = "<sketch> [<sketch>] ...";
+    
+    useOption("help");
+    addOption("bbit", Option(Option::Boolean, "bbit", "", "Build b-bit signatures (" + string(suffixBitSignatures) + "), used by the -F prefilter of dist and triangle.", ""));
+    addOption("lsh", Option(Option::Boolean, "lsh", "", "Build a locality-sensitive hashing index (" + string(suffixLshIndex) + "), used by the -lsh option of triangle.", ""));
+    addOption("hnsw", Option(Option::Boolean, "hnsw", "", "Build a nearest neighbour graph (" + string(suffixHnswIndex) + "), used by search.", ""));
+    addOption("vp", Option(Option::Boolean, "vp", "", "Build a vantage-point tree (" + string(suffixVpTree) + "), used by the -vp option of dist.", ""));
+    addOption("clusters", Option(Option::Boolean, "clusters", "", "Cluster references around representatives (" + string(suffixClusterIndex) + "), used by the -clusters option of dist.", ""));
+    addOption("names", Option(Option::Boolean, "names", "", "Index reference names (" + string(suffixNameIndex) + "), used by extract.", ""));
+    addOption("bits", Option(Option::Integer, "b", "Signature", "Bits kept per bin (1, 2, 4, 8 or 16).", to_string(bitSignatureBitsDefault), 1, 16));
+    addOption("bins", Option(Option::Integer, "m", "Signature", "Bins per signature. Bins times bits must be a multiple of 64.", to_string(bitSignatureBinsDefault), 1, 1048576));
+    addOption("bands", Option(Option::Integer, "B", "LSH", "Bands. More bands find more distant pairs, at the cost of more candidates and a larger index.", to_string(lshBandsDefault), 1, 1024));
+    addOption("rows", Option(Option::Integer, "R", "LSH", "Rows per band. More rows make bands more selective. If 0, the most selective value that still finds " + to_string(int(lshRecallTarget * 100)) + "% of pairs within the distance given by -d is used.", "0", 0, lshRowsMax));
+    addOption("distance", Option(Option::Number, "d", "LSH", "Distance the index should be tuned for (see -R).", "0.05", 0., 1.));
+    addOption("neighbors", Option(Option::Integer, "M", "HNSW", "Links per reference in each layer of the graph (twice this in the bottom layer). More links improve recall on clustered references, at the cost of build time and size.", to_string(hnswNeighborsDefault), 2, 1024));
+    addOption("breadth", Option(Option::Integer, "e", "HNSW", "Search breadth used when linking each reference. Larger values give a better graph but take longer to build.", to_string(hnswBreadthBuildDefault), 1, 100000));
+    addOption("clusterDistance", Option(Option::Number, "c", "Clusters", "Maximum distance from a reference to its cluster's representative. Smaller clusters cost more comparisons to representatives; larger ones are harder to rule out.", "0.02", 0., 1.));
+    useOption("threads");
+}
+
+int CommandIndex::run() const
+{
+    if ( arguments.size() == 0 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    bool bbit = options.at("bbit").active;
+    bool lsh = options.at("lsh").active;
+    bool hnsw = options.at("hnsw").active;
+    bool vp = options.at("vp").active;
+    bool clusters = options.at("clusters").active;
+    bool names = options.at("names").active;
+    
+    if ( ! bbit && ! lsh && ! hnsw && ! vp && ! clusters && ! names )
+    {
+        cerr << "ERROR: Specify at least one structure to build (-" << options.at("bbit").identifier << ", -" << options.at("lsh").identifier << ", -" << options.at("hnsw").identifier << ", -" << options.at("vp").identifier << ", -" << options.at("clusters").identifier << ", -" << options.at("names").identifier << ")." << endl;
+        return 1;
+    }
+    
+    Sketch::Parameters parameters;
+    
+    parameters.parallelism = options.at("threads").getArgumentAsNumber();
+    
+    for ( int i = 0; i < arguments.size(); i++ )
+    {
+        const string & file = arguments[i];
+        
+        if ( ! hasSuffix(file, suffixSketch) )
+        {
+            cerr << "ERROR: " << file << " does not look like a sketch (" << suffixSketch << ")." << endl;
+            return 1;
+        }
+        
+        Sketch sketch;
+        vector<string> files;
+        
+        files.push_back(file);
+        sketch.initFromFiles(files, parameters);
+        
+        if ( bbit && indexBitSignatures(sketch, file) )
+        {
+            return 1;
+        }
+        
+        if ( lsh && indexLsh(sketch, file) )
+        {
+            return 1;
+        }
+        
+        if ( hnsw && indexHnsw(sketch, file, parameters.parallelism) )
+        {
+            return 1;
+        }
+        
+        if ( vp && indexVpTree(sketch, file) )
+        {
+            return 1;
+        }
+        
+        if ( clusters && indexClusters(sketch, file, parameters.parallelism) )
+        {
+            return 1;
+        }
+        
+        if ( names && indexNames(sketch, file) )
+        {
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+int CommandIndex::indexBitSignatures(const Sketch & sketch, const string & file) const
+{
+    int bits = options.at("bits").getArgumentAsNumber();
+    int bins = options.at("bins").getArgumentAsNumber();
+    
+    if ( ! BitSignatures::validParameters(bits, bins) )
+    {
+        cerr << "ERROR: Bits (-" << options.at("bits").identifier << ") must be 1, 2, 4, 8 or 16, and bins (-" << options.at("bins").identifier << ") times bits must be a multiple of 64." << endl;
+        return 1;
+    }
+    
+    BitSignatures signatures;
+    
+    signatures.initFromSketch(sketch, bits, bins);
+    
+    if ( ! signatures.writeToSidecar(file) )
+    {
+        return 1;
+    }
+    
+    cerr << "Wrote " << file << suffixBitSignatures << "." << endl;
+    
+    return 0;
+}
+
+int CommandIndex::indexClusters(const Sketch & sketch, const string & file, int threads) const
+{
+    ClusterIndex clusters;
+    double jaccard = jaccardFromDistance(options.at("clusterDistance").getArgumentAsNumber(), sketch.getKmerSize());
+    
+    clusters.initFromSketch(sketch, 1. - jaccard, threads);
+    
+    if ( ! clusters.writeToSidecar(file) )
+    {
+        return 1;
+    }
+    
+    cerr << "Wrote " << file << suffixClusterIndex << " (" << clusters.getClusterCount() << " clusters)." << endl;
+    
+    return 0;
+}
+
+int CommandIndex::indexHnsw(const Sketch & sketch, const string & file, int threads) const
+{
+    HnswIndex index;
+    
+    index.initFromSketch(sketch, options.at("neighbors").getArgumentAsNumber(), options.at("breadth").getArgumentAsNumber(), threads);
+    
+    if ( ! index.writeToSidecar(file) )
+    {
+        return 1;
+    }
+    
+    cerr << "Wrote " << file << suffixHnswIndex << "." << endl;
+    
+    return 0;
+}
+
+int CommandIndex::indexLsh(const Sketch & sketch, const string & file) const
+{
+    int bands = options.at("bands").getArgumentAsNumber();
+    int rows = options.at("rows").getArgumentAsNumber();
+    double jaccard = jaccardFromDistance(options.at("distance").getArgumentAsNumber(), sketch.getKmerSize());
+    
+    if ( rows == 0 )
+    {
+        rows = LshIndex::chooseRows(jaccard, bands);
+    }
+    
+    LshIndex index;
+    
+    index.initFromSketch(sketch, bands, rows);
+    
+    if ( ! index.writeToSidecar(file) )
+    {
+        return 1;
+    }
+    
+    cerr << "Wrote " << file << suffixLshIndex << " (" << bands << " bands of " << rows << " rows; finds pairs within distance " << options.at("distance").getArgumentAsNumber() << " with probability " << LshIndex::collisionChance(jaccard, bands, rows) << ")." << endl;
+    
+    return 0;
+}
+
+int CommandIndex::indexNames(const Sketch & sketch, const string & file) const
+{
+    NameIndex index;
+    vector<string> names(sketch.getReferenceCount());
+    
+    for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+    {
+        names[i] = sketch.getReference(i).name;
+    }
+    
+    index.initFromNames(names);
+    
+    if ( ! index.writeToSidecar(file) )
+    {
+        return 1;
+    }
+    
+    cerr << "Wrote " << file << suffixNameIndex << "." << endl;
+    
+    return 0;
+}
+
+int CommandIndex::indexVpTree(const Sketch & sketch, const string & file) const
+{
+    VpTree tree;
+    
+    tree.initFromSketch(sketch);
+    
+    if ( ! tree.writeToSidecar(file) )
+    {
+        return 1;
+    }
+    
+    cerr << "Wrote " << file << suffixVpTree << "." << endl;
+    
+    return 0;
+}
+
+} // namespace mash
@@ -0,0 +1,35 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_CommandIndex
+#define INCLUDED_CommandIndex
+
+#include "Command.h"
+#include "Sketch.h"
+
+namespace mash {
+
+class CommandIndex : public Command
+{
+public:
+    
+    CommandIndex();
+    
+    int run() const; // override
+
+private:
+    
+    int indexBitSignatures(const Sketch & sketch, const std::string & file) const;
+    int indexClusters(const Sketch & sketch, const std::string & file, int threads) const;
+    int indexHnsw(const Sketch & sketch, const std::string & file, int threads) const;
+    int indexLsh(const Sketch & sketch, const std::string & file) const;
+    int indexNames(const Sketch & sketch, const std::string & file) const;
+    int indexVpTree(const Sketch & sketch, const std::string & file) const;
+};
+
+} // namespace mash
+
+#endif
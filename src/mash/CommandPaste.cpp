@@ -6,7 +6,10 @@
 
 #include "CommandPaste.h"
 #include "Sketch.h"
+#include "columnar.h"
+#include <fcntl.h>
 #include <iostream>
+#include <sys/stat.h>
 #include "unistd.h"
 
 using std::string;
@@ -15,16 +18,20 @@ using std::endl;
 
 namespace mash {
 
+static const uint64_t pasteBufferSize = 1 << 20; // most bytes per write
+
 CommandPaste::CommandPaste()
 : Command()
 {
     name = "paste";
     summary = "Create a single sketch file from multiple sketch files.";
-    description = "Create a single sketch file from multiple sketch files.";
+    description = "Create a single sketch file from multiple sketch files. Inputs are streamed into the output one at a time, so memory use does not grow with their number, and can be appended to an existing sketch file without rewriting it. Inputs are copied as they are where possible, so the output is a sequence of sketch messages, which older versions of Mash read only the first of; \"mash compact\" rewrites it as one.";
     argumentString = "<out_prefix> <sketch> [<sketch>] ...";
     
     useOption("help");
     addOption("list", Option(Option::Boolean, "l", "", "Input files are lists of file names.", ""));
+    addOption("append", Option(Option::Boolean, "a", "", "Append to the output file if it exists. It is not rewritten, and its parameters are used to check the inputs.", ""));
+    addOption("packed", Option(Option::Boolean, "packed", "", "Delta code and bit pack hashes and counts, making the output smaller. Packed files cannot be read by older versions of Mash.", ""));
 }
 
 int CommandPaste::run() const
@@ -36,6 +43,8 @@ int CommandPaste::run() const
     }
     
     bool list = options.at("list").active;
+    bool append = options.at("append").active;
+    bool packed = options.at("packed").active;
     std::vector<string> files;
     
     for ( int i = 1; i < arguments.size(); i++ )
@@ -50,10 +59,7 @@ int CommandPaste::run() const
         }
     }
     
-    Sketch sketch;
     std::vector<string> filesGood;
-    Sketch::Parameters parameters;
-    parameters.parallelism = 1;
     
     for ( int i = 0; i < files.size(); i++ )
     {
@@ -68,24 +74,150 @@ int CommandPaste::run() const
         filesGood.push_back(file);
     }
     
-	sketch.initFromFiles(filesGood, parameters);
     string out = arguments[0];
     
     if ( ! hasSuffix(out, suffixSketch) )
     {
         out += suffixSketch;
     }
-
-	if( access(out.c_str(), F_OK) != -1 )
-	{
-		cerr << "ERROR: \"" << out << "\" exists; remove to write." << endl;
-		exit(1);
-	}
-	
-    cerr << "Writing " << out << "..." << endl;
-    sketch.writeToCapnp(out.c_str());
     
+    struct stat outInfo;
+    bool exists = stat(out.c_str(), &outInfo) == 0;
+    
+    if ( exists && ! append )
+    {
+        cerr << "ERROR: \"" << out << "\" exists; remove to write (or use -" << options.at("append").identifier << " to append)." << endl;
+        exit(1);
+    }
+    
+    if ( exists && isColumnarSketch(out.c_str()) )
+    {
+        cerr << "ERROR: Cannot append to the columnar sketch \"" << out << "\"." << endl;
+        return 1;
+    }
+    
+    for ( int i = 0; exists && i < filesGood.size(); i++ )
+    {
+        struct stat fileInfo;
+        
+        if ( stat(filesGood[i].c_str(), &fileInfo) == 0 && fileInfo.st_dev == outInfo.st_dev && fileInfo.st_ino == outInfo.st_ino )
+        {
+            cerr << "ERROR: Cannot append \"" << filesGood[i] << "\" to itself." << endl;
+            return 1;
+        }
+    }
+    
+    // The output takes its parameters from its existing contents or from the
+    // first input, and inputs that are incompatible with them are skipped.
+    
+    Sketch sketchOut;
+    bool initialized = exists;
+    
+    if ( exists )
+    {
+        sketchOut.initParametersFromCapnp(out.c_str());
+    }
+    
+    // Readers wait for this lock, so they see the output before or after
+    // pasting, but not in between (see lockSketchFile).
+    
+    int fdLock = lockSketchFile(out.c_str());
+    
+    if ( fdLock < 0 || fstat(fdLock, &outInfo) == -1 )
+    {
+        cerr << "ERROR: could not lock \"" << out << "\" for writing." << endl;
+        return 1;
+    }
+    
+    cerr << (exists ? "Appending to " : "Writing ") << out << "..." << endl;
+    
+    for ( int i = 0; i < filesGood.size(); i++ )
+    {
+        const string & file = filesGood[i];
+        Sketch sketchTest;
+        
+        // checked and copied from one mapping, so the bytes copied are the
+        // ones checked, even if the input is appended to meanwhile
+        
+        std::shared_ptr<Sketch::Mapping> mapping = mapSketchFile(file.c_str());
+        
+        sketchTest.initParametersFromMapping(*mapping, file.c_str());
+        
+        if ( ! initialized )
+        {
+            sketchOut.initParametersFromMapping(*mapping, file.c_str());
+            initialized = true;
+        }
+        else if ( ! sketchOut.isCompatible(sketchTest, file) )
+        {
+            continue;
+        }
+        
+        // A sketch file can be a sequence of Cap'n Proto messages, so those
+        // are copied as they are; others are decoded and re-encoded, as are
+        // ones with removals, which would otherwise apply to earlier inputs.
+        
+        bool success;
+        
+        if ( packed || isColumnarSketch(*mapping) || hasRemovedReferences(*mapping) )
+        {
+            Sketch sketch;
+            
+            success =
+                sketch.initFromMapping(mapping, file.c_str()) == 0 &&
+                sketch.writeToCapnp(out.c_str(), packed, true) == 0;
+        }
+        else
+        {
+            success = appendFile(*mapping, out);
+        }
+        
+        if ( ! success )
+        {
+            cerr << "ERROR: Could not write \"" << file << "\" to \"" << out << "\"." << endl;
+            
+            // leave the output as it was
+            
+            if ( exists )
+            {
+                truncate(out.c_str(), outInfo.st_size);
+            }
+            else
+            {
+                unlink(out.c_str());
+            }
+            
+            close(fdLock);
+            return 1;
+        }
+    }
+    
+    close(fdLock);
     return 0;
 }
 
+bool appendFile(const Sketch::Mapping & mapping, const string & out)
+{
+    int fdOut = open(out.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0644);
+    const char * data = (const char *)mapping.data;
+    uint64_t written = 0;
+    bool success = fdOut >= 0;
+    
+    while ( success && written < mapping.size )
+    {
+        uint64_t size = mapping.size - written < pasteBufferSize ? mapping.size - written : pasteBufferSize;
+        ssize_t bytes = write(fdOut, data + written, size);
+        
+        success = bytes > 0;
+        written += success ? bytes : 0;
+    }
+    
+    if ( fdOut >= 0 )
+    {
+        success = close(fdOut) == 0 && success;
+    }
+    
+    return success;
+}
+
 } // namespace mash
@@ -21,6 +21,10 @@ public:
     int run() const; // override
 };
 
+// Appends a mapped file (as it was when mapped) to another.
+//
+bool appendFile(const Sketch::Mapping & mapping, const std::string & out);
+
 } // namespace mash
 
 #endif
@@ -0,0 +1,135 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandRemove.h"
+#include "Sketch.h"
+#include "columnar.h"
+#include <iostream>
+#include <sys/stat.h>
+#include <unordered_set>
+#include "unistd.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::unordered_set;
+using std::vector;
+
+namespace mash {
+
+CommandRemove::CommandRemove()
+: Command()
+{
+    name = "remove";
+    summary = "Remove named references from a sketch file without rewriting it.";
+    description = "Remove the references with the given names (IDs) from a sketch file by appending a record of them, so they are skipped wherever the file is read. References added afterwards (e.g. with \"mash paste -a\") are kept, even with removed names. Removed references still take space until the file is rewritten with \"mash compact\".";
+    argumentString = "<sketch> <name> [<name>] ...";
+    
+    useOption("help");
+    addOption("list", Option(Option::Boolean, "l", "", "Names are given as files listing them, one per line.", ""));
+}
+
+int CommandRemove::run() const
+{
+    if ( arguments.size() < 2 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    const string & file = arguments[0];
+    
+    if ( ! hasSuffix(file, suffixSketch) )
+    {
+        cerr << "ERROR: The file \"" << file << "\" does not look like a sketch (windowed sketches are not supported)." << endl;
+        return 1;
+    }
+    
+    if ( isColumnarSketch(file.c_str()) )
+    {
+        cerr << "ERROR: Cannot remove from the columnar sketch \"" << file << "\"." << endl;
+        return 1;
+    }
+    
+    vector<string> names;
+    
+    for ( int i = 1; i < arguments.size(); i++ )
+    {
+        if ( options.at("list").active )
+        {
+            splitFile(arguments[i], names);
+        }
+        else
+        {
+            names.push_back(arguments[i]);
+        }
+    }
+    
+    vector<string> namesAll;
+    
+    if ( ! getCapnpReferenceNames(file.c_str(), namesAll) )
+    {
+        cerr << "ERROR: Could not read names from \"" << file << "\"." << endl;
+        return 1;
+    }
+    
+    unordered_set<string> namesPresent(namesAll.begin(), namesAll.end());
+    unordered_set<string> namesRemoved;
+    vector<string> removed;
+    
+    for ( int i = 0; i < names.size(); i++ )
+    {
+        if ( namesRemoved.count(names[i]) )
+        {
+            continue;
+        }
+        
+        if ( namesPresent.count(names[i]) == 0 )
+        {
+            cerr << "WARNING: \"" << names[i] << "\" not found in \"" << file << "\"." << endl;
+            continue;
+        }
+        
+        namesRemoved.insert(names[i]);
+        removed.push_back(names[i]);
+    }
+    
+    if ( removed.size() == 0 )
+    {
+        cerr << "ERROR: None of the names were found in \"" << file << "\"." << endl;
+        return 1;
+    }
+    
+    // The removals are appended as a segment with no references, under the
+    // same lock as other appends (see lockSketchFile).
+    
+    Sketch sketch;
+    sketch.initParametersFromCapnp(file.c_str());
+    
+    int fdLock = lockSketchFile(file.c_str());
+    struct stat fileInfo;
+    
+    if ( fdLock < 0 || fstat(fdLock, &fileInfo) == -1 )
+    {
+        cerr << "ERROR: could not lock \"" << file << "\" for writing." << endl;
+        return 1;
+    }
+    
+    cerr << "Removing " << removed.size() << " name" << (removed.size() == 1 ? "" : "s") << " from " << file << "..." << endl;
+    
+    if ( sketch.writeToCapnp(file.c_str(), false, true, 0, &removed) != 0 )
+    {
+        cerr << "ERROR: Could not write to \"" << file << "\"." << endl;
+        truncate(file.c_str(), fileInfo.st_size);
+        close(fdLock);
+        return 1;
+    }
+    
+    close(fdLock);
+    return 0;
+}
+
+} // namespace mash
@@ -0,0 +1,25 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_CommandRemove
+#define INCLUDED_CommandRemove
+
+#include "Command.h"
+
+namespace mash {
+
+class CommandRemove : public Command
+{
+public:
+    
+    CommandRemove();
+    
+    int run() const; // override
+};
+
+} // namespace mash
+
+#endif
@@ -6,6 +6,7 @@
 
 #include "CommandScreen.h"
 #include "CommandDistance.h" // for pvalue
+#include "CommandServe.h"
 #include "Sketch.h"
 #include "kseq.h"
 #include <iostream>
@@ -45,6 +46,7 @@ CommandScreen::CommandScreen()
 	
 	useOption("help");
 	useOption("threads");
+	useOption("server");
 //	useOption("minCov");
 //    addOption("saturation", Option(Option::Boolean, "s", "", "Include saturation curve in output. Each line will have an additional field representing the absolute number of k-mers seen at each Jaccard increase, formatted as a comma-separated list.", ""));
     addOption("winning!", Option(Option::Boolean, "w", "", "Winner-takes-all strategy for identity estimates. After counting hashes for each query, hashes that appear in multiple queries will be removed from all except the one with the best identity (ties broken by larger query), and other identities will be reduced. This removes output redundancy, providing a rough compositional outline.", ""));
@@ -75,10 +77,15 @@ int CommandScreen::run() const
     vector<string> refArgVector;
     refArgVector.push_back(arguments[0]);
 	
-	Sketch sketch;
+	const CommandServe::ResidentReference * resident = getResidentReference(arguments[0]);
+	Sketch sketchLoaded;
+	const Sketch & sketch = resident ? resident->sketch : sketchLoaded;
     Sketch::Parameters parameters;
 	
-    sketch.initFromFiles(refArgVector, parameters);
+	if ( ! resident )
+	{
+	    sketchLoaded.initFromFiles(refArgVector, parameters);
+	}
     
     string alphabet;
     sketch.getAlphabetAsString(alphabet);
@@ -92,27 +99,21 @@ int CommandScreen::run() const
 	parameters.seed = sketch.getHashSeed();
 	parameters.minHashesPerWindow = sketch.getMinHashesPerWindow();
 	
-	HashTable hashTable;
+	HashTable hashTableLoaded;
+	const HashTable & hashTable = resident && resident->hashTable ? *resident->hashTable : hashTableLoaded;
 	unordered_map<uint64_t, std::atomic<uint32_t>> hashCounts;
 	unordered_map<uint64_t, list<uint32_t> > saturationByIndex;
 	
 	cerr << "Loading " << arguments[0] << "..." << endl;
 	
-	for ( int i = 0; i < sketch.getReferenceCount(); i++ )
+	if ( &hashTable == &hashTableLoaded )
 	{
-		const HashList & hashes = sketch.getReference(i).hashesSorted;
-		
-		for ( int j = 0; j < hashes.size(); j++ )
-		{
-			uint64_t hash = hashes.get64() ? hashes.at(j).hash64 : hashes.at(j).hash32;
-			
-			if ( hashTable.count(hash) == 0 )
-			{
-				hashCounts[hash] = 0;
-			}
-			
-			hashTable[hash].insert(i);
-		}
+		buildHashTable(sketch, hashTableLoaded);
+	}
+	
+	for ( HashTable::const_iterator i = hashTable.begin(); i != hashTable.end(); i++ )
+	{
+		hashCounts[i->first] = 0;
 	}
 	
 	cerr << "   " << hashTable.size() << " distinct hashes." << endl;
@@ -461,6 +462,21 @@ int CommandScreen::run() const
 	return 0;
 }
 
+void buildHashTable(const Sketch & sketch, HashTable & hashTable)
+{
+	for ( int i = 0; i < sketch.getReferenceCount(); i++ )
+	{
+		const HashList & hashes = sketch.getReference(i).hashesSorted;
+		
+		for ( int j = 0; j < hashes.size(); j++ )
+		{
+			uint64_t hash = hashes.get64() ? hashes.at(j).hash64 : hashes.at(j).hash32;
+			
+			hashTable[hash].insert(i);
+		}
+	}
+}
+
 double estimateIdentity(uint64_t common, uint64_t denom, int kmerSize, double kmerSpace)
 {
 	double identity;
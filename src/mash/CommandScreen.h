@@ -161,6 +161,7 @@ private:
 };
 
 char aaFromCodon(const char * codon);
+void buildHashTable(const Sketch & sketch, HashTable & hashTable);
 double estimateIdentity(uint64_t common, uint64_t denom, int kmerSize, double kmerSpace);
 CommandScreen::HashOutput * hashSequence(CommandScreen::HashInput * input);
 double pValueWithin(uint64_t x, uint64_t setSize, double kmerSpace, uint64_t sketchSize);
@@ -0,0 +1,198 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandSearch.h"
+#include "CommandDistance.h"
+#include "Sketch.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <iostream>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::to_string;
+using std::vector;
+
+namespace mash {
+
+CommandSearch::CommandSearch()
+: Command()
+{
+    name = "search";
+    summary = "Find the closest references to query sequences using an index.";
+    description = "Find the closest references in a sketch file to each query, using a nearest neighbour graph rather than comparing to every reference. The graph built by \"mash index -hnsw\" is used if present and up to date; otherwise one is built. Queries can be fasta or fastq, gzipped or not, or Mash sketch files (.msh) made with the same parameters as the reference. Results are approximate; see -recall to measure how often they match \"mash dist\". The output fields are [reference-ID, query-ID, distance, p-value, shared-hashes], ordered by distance for each query.";
+    argumentString = "<reference>.msh <query> [<query>] ...";
+    
+    useOption("help");
+    addOption("list", Option(Option::Boolean, "l", "Input", "List input. Lines in each <query> specify paths to sequence files, one per line. The reference file is not affected.", ""));
+    useOption("individual");
+    addOption("neighbors", Option(Option::Integer, "n", "Output", "Number of closest references to report for each query.", "1", 1, 1000000));
+    addOption("breadth", Option(Option::Integer, "e", "Output", "Search breadth. Larger values find the true closest references more often, but take longer.", to_string(hnswBreadthSearchDefault), 1, 1000000));
+    addOption("recall", Option(Option::Boolean, "recall", "Output", "Also compare each query to every reference, and report to stderr the fraction of true closest references that were found.", ""));
+    useOption("threads");
+}
+
+int CommandSearch::run() const
+{
+    if ( arguments.size() < 2 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    if ( ! hasSuffix(arguments[0], suffixSketch) )
+    {
+        cerr << "ERROR: " << arguments[0] << " does not look like a sketch (.msh)" << endl;
+        return 1;
+    }
+    
+    uint64_t count = options.at("neighbors").getArgumentAsNumber();
+    int breadth = options.at("breadth").getArgumentAsNumber();
+    bool recall = options.at("recall").active;
+    
+    Sketch::Parameters parameters;
+    Sketch sketchRef;
+    vector<string> refArgVector;
+    
+    refArgVector.push_back(arguments[0]);
+    sketchRef.initFromFiles(refArgVector, parameters);
+    
+    string alphabet;
+    sketchRef.getAlphabetAsString(alphabet);
+    setAlphabetFromString(parameters, alphabet.c_str());
+    
+    parameters.parallelism = options.at("threads").getArgumentAsNumber();
+    parameters.kmerSize = sketchRef.getKmerSize();
+    parameters.noncanonical = sketchRef.getNoncanonical();
+    parameters.use64 = sketchRef.getUse64();
+    parameters.preserveCase = sketchRef.getPreserveCase();
+    parameters.seed = sketchRef.getHashSeed();
+    parameters.minHashesPerWindow = sketchRef.getMinHashesPerWindow();
+    parameters.concatenated = ! options.at("individual").active;
+    
+    HnswIndex index;
+    
+    if ( ! index.initFromSidecar(arguments[0], sketchRef.getReferenceCount()) )
+    {
+        cerr << "Indexing " << arguments[0] << " (run \"mash index -hnsw\" to skip)..." << endl;
+        index.initFromSketch(sketchRef, hnswNeighborsDefault, hnswBreadthBuildDefault, parameters.parallelism);
+    }
+    
+    vector<string> queryFiles;
+    
+    for ( int i = 1; i < arguments.size(); i++ )
+    {
+        if ( options.at("list").active )
+        {
+            splitFile(arguments[i], queryFiles);
+        }
+        else
+        {
+            queryFiles.push_back(arguments[i]);
+        }
+    }
+    
+    Sketch sketchQuery;
+    
+    sketchQuery.initFromFiles(queryFiles, parameters, 0, true);
+    
+    ThreadPool<SearchInput, SearchOutput> threadPool(search, parameters.parallelism);
+    uint64_t found = 0;
+    uint64_t expected = 0;
+    
+    for ( uint64_t i = 0; i < sketchQuery.getReferenceCount(); i++ )
+    {
+        threadPool.runWhenThreadAvailable(new SearchInput(sketchRef, sketchQuery, index, i, count, breadth, recall));
+        
+        while ( threadPool.outputAvailable() )
+        {
+            SearchOutput * output = threadPool.popOutputWhenAvailable();
+            
+            found += output->found;
+            expected += output->neighbors.size();
+            writeOutput(sketchRef, sketchQuery, output);
+        }
+    }
+    
+    while ( threadPool.running() )
+    {
+        SearchOutput * output = threadPool.popOutputWhenAvailable();
+        
+        found += output->found;
+        expected += output->neighbors.size();
+        writeOutput(sketchRef, sketchQuery, output);
+    }
+    
+    if ( recall )
+    {
+        cerr << "Recall: " << (expected ? double(found) / expected : 1.) << " (" << found << " of " << expected << " closest references found)" << endl;
+    }
+    
+    return 0;
+}
+
+void CommandSearch::writeOutput(const Sketch & sketchRef, const Sketch & sketchQuery, SearchOutput * output) const
+{
+    const Sketch::Reference & query = sketchQuery.getReference(output->indexQuery);
+    
+    for ( uint64_t i = 0; i < output->neighbors.size(); i++ )
+    {
+        const Sketch::Reference & ref = sketchRef.getReference(output->neighbors[i].index);
+        CommandDistance::CompareOutput::PairOutput pair;
+        
+        compareSketches(&pair, ref, query, sketchRef.getMinHashesPerWindow(), sketchRef.getKmerSize(), sketchRef.getKmerSpace(), -1, -1);
+        
+        cout << ref.name << '\t' << query.name << '\t' << pair.distance << '\t' << pair.pValue << '\t' << pair.numer << '/' << pair.denom << endl;
+    }
+    
+    delete output;
+}
+
+CommandSearch::SearchOutput * search(CommandSearch::SearchInput * input)
+{
+    const Sketch & sketchRef = input->sketchRef;
+    const Sketch::Reference & query = input->sketchQuery.getReference(input->indexQuery);
+    
+    CommandSearch::SearchOutput * output = new CommandSearch::SearchOutput();
+    
+    output->indexQuery = input->indexQuery;
+    output->found = 0;
+    
+    input->index.search(sketchRef, query, input->count, input->breadth, output->neighbors);
+    
+    if ( input->exact && output->neighbors.size() > 0 )
+    {
+        vector<HnswIndex::Neighbor> all;
+        
+        for ( uint64_t i = 0; i < sketchRef.getReferenceCount(); i++ )
+        {
+            uint64_t common;
+            uint64_t denom;
+            
+            all.push_back(HnswIndex::Neighbor(sketchDistance(sketchRef.getReference(i), query, sketchRef.getMinHashesPerWindow(), sketchRef.getKmerSize(), common, denom), i));
+        }
+        
+        std::sort(all.begin(), all.end());
+        
+        // count ties with the farthest true neighbour as found
+        
+        double distanceMax = all[output->neighbors.size() - 1].distance;
+        
+        for ( uint64_t i = 0; i < output->neighbors.size(); i++ )
+        {
+            if ( output->neighbors[i].distance <= distanceMax )
+            {
+                output->found++;
+            }
+        }
+    }
+    
+    return output;
+}
+
+} // namespace mash
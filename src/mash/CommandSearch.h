@@ -0,0 +1,62 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_CommandSearch
+#define INCLUDED_CommandSearch
+
+#include "Command.h"
+#include "HnswIndex.h"
+#include "Sketch.h"
+
+namespace mash {
+
+class CommandSearch : public Command
+{
+public:
+    
+    struct SearchInput
+    {
+        SearchInput(const Sketch & sketchRefNew, const Sketch & sketchQueryNew, const HnswIndex & indexNew, uint64_t indexQueryNew, uint64_t countNew, int breadthNew, bool exactNew)
+            :
+            sketchRef(sketchRefNew),
+            sketchQuery(sketchQueryNew),
+            index(indexNew),
+            indexQuery(indexQueryNew),
+            count(countNew),
+            breadth(breadthNew),
+            exact(exactNew)
+            {}
+        
+        const Sketch & sketchRef;
+        const Sketch & sketchQuery;
+        const HnswIndex & index;
+        uint64_t indexQuery;
+        uint64_t count;
+        int breadth;
+        bool exact; // also find neighbours by scanning all references, for recall
+    };
+    
+    struct SearchOutput
+    {
+        uint64_t indexQuery;
+        std::vector<HnswIndex::Neighbor> neighbors;
+        uint64_t found; // of the exact neighbours, if computed
+    };
+    
+    CommandSearch();
+    
+    int run() const; // override
+
+private:
+    
+    void writeOutput(const Sketch & sketchRef, const Sketch & sketchQuery, SearchOutput * output) const;
+};
+
+CommandSearch::SearchOutput * search(CommandSearch::SearchInput * input);
+
+} // namespace mash
+
+#endif
@@ -0,0 +1,507 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandServe.h"
+#include "CommandContain.h"
+#include "CommandDistance.h"
+#include "CommandScreen.h"
+#include "Sketch.h"
+#include <iostream>
+#include <chrono>
+#include <map>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::map;
+using std::string;
+using std::vector;
+
+namespace mash {
+
+typedef std::chrono::steady_clock Clock;
+typedef std::pair<uint64_t, Clock::time_point> Worker; // request ID and start
+typedef map<pid_t, Worker> WorkerMap;
+
+static map<string, CommandServe::ResidentReference *> residentReferences; // by real path
+
+bool readFully(int fd, char * buffer, uint64_t length);
+string realPath(const string & file);
+void reapWorkers(WorkerMap & running, bool wait);
+bool writeFully(int fd, const char * buffer, uint64_t length);
+
+static void handleChild(int signal) {} // only needed to interrupt accept()
+
+CommandServe::CommandServe()
+: Command()
+{
+    name = "serve";
+    summary = "Keep reference sketches resident to answer requests.";
+    description = "Load reference sketch files (.msh) once and answer dist, screen and within requests that use them, so the references are not reloaded and re-indexed for every request. Requests are made by running those commands as usual with -server <socket>; their output is identical to running them directly. A request whose reference is not one of the resident files (compared by real path) loads it as usual. Each request is run by a worker process that shares the resident references with the server, and its latency is reported to standard error.";
+    argumentString = "<socket> <reference>.msh [<reference>.msh] ...";
+    
+    useOption("help");
+    useOption("threads");
+    addOption("screen", Option(Option::Boolean, "s", "", "Also keep the hash tables used by screen requests resident. This speeds up screen requests, but uses considerably more memory.", ""));
+    options.at("threads").description = "Maximum number of requests to run concurrently. Threads used by each request are set with its own -p.";
+}
+
+int CommandServe::run() const
+{
+    if ( arguments.size() < 2 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    int concurrency = options.at("threads").getArgumentAsNumber();
+    bool screen = options.at("screen").active;
+    const string & socketPath = arguments[0];
+    
+    struct sockaddr_un address;
+    
+    if ( socketPath.length() >= sizeof(address.sun_path) )
+    {
+        cerr << "ERROR: The socket path \"" << socketPath << "\" is too long." << endl;
+        return 1;
+    }
+    
+    if ( access(socketPath.c_str(), F_OK) != -1 )
+    {
+        cerr << "ERROR: \"" << socketPath << "\" exists; remove to serve." << endl;
+        return 1;
+    }
+    
+    for ( int i = 1; i < arguments.size(); i++ )
+    {
+        if ( ! hasSuffix(arguments[i], suffixSketch) )
+        {
+            cerr << "ERROR: " << arguments[i] << " does not look like a sketch (.msh)" << endl;
+            return 1;
+        }
+        
+        cerr << "Loading " << arguments[i] << "..." << endl;
+        
+        ResidentReference * resident = new ResidentReference();
+        Sketch::Parameters parameters;
+        vector<string> file;
+        
+        file.push_back(arguments[i]);
+        resident->sketch.initFromFiles(file, parameters);
+        
+        if ( screen )
+        {
+            resident->hashTable = new HashTable();
+            buildHashTable(resident->sketch, *resident->hashTable);
+        }
+        
+        residentReferences[realPath(arguments[i])] = resident;
+    }
+    
+    int fdListen = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    
+    if ( fdListen < 0 || bind(fdListen, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fdListen, 128) != 0 )
+    {
+        cerr << "ERROR: could not listen on " << socketPath << " (" << strerror(errno) << ")." << endl;
+        return 1;
+    }
+    
+    // Child exits interrupt accept() so latency is logged when each request
+    // finishes rather than when the next one arrives.
+    //
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handleChild;
+    sigaction(SIGCHLD, &action, 0);
+    signal(SIGPIPE, SIG_IGN);
+    
+    cerr << "Listening on " << socketPath << "..." << endl;
+    
+    WorkerMap running;
+    uint64_t requestCount = 0;
+    
+    while ( true )
+    {
+        int fd = accept(fdListen, 0, 0);
+        
+        reapWorkers(running, false);
+        
+        if ( fd < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            
+            cerr << "ERROR: could not accept connection on " << socketPath << " (" << strerror(errno) << ")." << endl;
+            close(fdListen);
+            unlink(socketPath.c_str());
+            return 1;
+        }
+        
+        while ( running.size() >= concurrency )
+        {
+            reapWorkers(running, true);
+        }
+        
+        requestCount++;
+        pid_t pid = fork();
+        
+        if ( pid == 0 )
+        {
+            int fdLog = dup(2);
+            
+            close(fdListen);
+            signal(SIGCHLD, SIG_DFL);
+            _exit(serveRequest(fd, requestCount, fdLog));
+        }
+        
+        if ( pid < 0 )
+        {
+            cerr << "WARNING: could not start worker for request " << requestCount << " (" << strerror(errno) << ")." << endl;
+        }
+        else
+        {
+            running[pid] = Worker(requestCount, Clock::now());
+        }
+        
+        close(fd);
+    }
+    
+    return 0;
+}
+
+int CommandServe::serveRequest(int fd, uint64_t id, int fdLog) const
+{
+    // The request is a length-prefixed, null-separated list of the client's
+    // working directory, command name and arguments, sent along with the
+    // client's stdin, stdout and stderr so output goes straight to the client.
+    
+    uint32_t length;
+    int fds[3];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr message;
+    
+    iov.iov_base = &length;
+    iov.iov_len = sizeof(length);
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    struct cmsghdr * cmsg;
+    
+    if
+    (
+        recvmsg(fd, &message, MSG_WAITALL) != sizeof(length) ||
+        (cmsg = CMSG_FIRSTHDR(&message)) == 0 ||
+        cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))
+    )
+    {
+        return 1;
+    }
+    
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    
+    // the length comes from the client, so it is bounded before allocating,
+    // and the last token must be terminated so none is read past the end
+    
+    char * payload = length > 0 && length <= serveRequestSizeMax ? new char[length] : 0;
+    
+    if ( payload == 0 || ! readFully(fd, payload, length) || payload[length - 1] != '\0' )
+    {
+        delete [] payload;
+        
+        for ( int i = 0; i < 3; i++ )
+        {
+            close(fds[i]);
+        }
+        
+        return 1;
+    }
+    
+    vector<string> tokens;
+    
+    for ( uint32_t i = 0; i < length; i += tokens.back().length() + 1 )
+    {
+        tokens.push_back(string(payload + i));
+    }
+    
+    delete [] payload;
+    
+    for ( int i = 0; i < 3; i++ )
+    {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    
+    string log = "Request " + std::to_string(id) + ":";
+    
+    for ( int i = 1; i < tokens.size(); i++ )
+    {
+        log += " " + tokens[i];
+    }
+    
+    log += "\n";
+    writeFully(fdLog, log.c_str(), log.length());
+    
+    Command * command = 0;
+    int status = 1;
+    
+    if ( tokens.size() >= 2 )
+    {
+        if ( tokens[1] == "dist" )
+        {
+            command = new CommandDistance();
+        }
+        else if ( tokens[1] == "screen" )
+        {
+            command = new CommandScreen();
+        }
+#ifdef COMMAND_WITHIN
+        else if ( tokens[1] == "within" )
+        {
+            command = new CommandContain();
+        }
+#endif
+    }
+    
+    if ( command == 0 )
+    {
+        cerr << "ERROR: The server does not handle " << (tokens.size() >= 2 ? "\"" + tokens[1] + "\"" : "this") << " requests." << endl;
+    }
+    else if ( chdir(tokens[0].c_str()) != 0 )
+    {
+        cerr << "ERROR: The server could not change to the directory " << tokens[0] << "." << endl;
+    }
+    else
+    {
+        vector<const char *> argv;
+        
+        for ( int i = 2; i < tokens.size(); i++ )
+        {
+            argv.push_back(tokens[i].c_str());
+        }
+        
+        argv.push_back(0);
+        status = command->run(argv.size() - 1, argv.data());
+        delete command;
+    }
+    
+    cout.flush();
+    cerr.flush();
+    fflush(stdout);
+    
+    char code = status;
+    send(fd, &code, 1, MSG_NOSIGNAL);
+    close(fd);
+    
+    return status;
+}
+
+const CommandServe::ResidentReference * getResidentReference(const string & file)
+{
+    if ( residentReferences.size() == 0 )
+    {
+        return 0;
+    }
+    
+    map<string, CommandServe::ResidentReference *>::const_iterator i = residentReferences.find(realPath(file));
+    
+    return i == residentReferences.end() ? 0 : i->second;
+}
+
+bool readFully(int fd, char * buffer, uint64_t length)
+{
+    while ( length > 0 )
+    {
+        ssize_t count = read(fd, buffer, length);
+        
+        if ( count < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        
+        if ( count <= 0 )
+        {
+            return false;
+        }
+        
+        buffer += count;
+        length -= count;
+    }
+    
+    return true;
+}
+
+string realPath(const string & file)
+{
+    char path[PATH_MAX];
+    
+    if ( realpath(file.c_str(), path) == 0 )
+    {
+        return file;
+    }
+    
+    return path;
+}
+
+void reapWorkers(WorkerMap & running, bool wait)
+{
+    // Logs the latency of finished requests. If waiting, blocks until at
+    // least one has finished.
+    
+    int status;
+    pid_t pid;
+    
+    while ( running.size() > 0 && (pid = waitpid(-1, &status, wait ? 0 : WNOHANG)) != 0 )
+    {
+        if ( pid < 0 )
+        {
+            if ( errno == EINTR )
+            {
+                continue;
+            }
+            
+            break;
+        }
+        
+        if ( running.count(pid) == 0 )
+        {
+            continue;
+        }
+        
+        double seconds = std::chrono::duration<double>(Clock::now() - running.at(pid).second).count();
+        
+        cerr << "Request " << running.at(pid).first << " finished with status " << (WIFEXITED(status) ? WEXITSTATUS(status) : 1) << " in " << seconds << "s." << endl;
+        running.erase(pid);
+        wait = false;
+    }
+}
+
+int runOnServer(const string & socketPath, const string & commandName, const vector<string> & arguments)
+{
+    char cwd[PATH_MAX];
+    
+    if ( getcwd(cwd, sizeof(cwd)) == 0 )
+    {
+        cerr << "ERROR: could not get the working directory." << endl;
+        return 1;
+    }
+    
+    string payload = string(cwd) + '\0' + commandName + '\0';
+    
+    for ( int i = 0; i < arguments.size(); i++ )
+    {
+        payload += arguments[i] + '\0';
+    }
+    
+    if ( payload.length() > serveRequestSizeMax )
+    {
+        cerr << "ERROR: the arguments are too long to send to the server." << endl;
+        return 1;
+    }
+    
+    struct sockaddr_un address;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+    
+    if ( fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0 )
+    {
+        cerr << "ERROR: could not connect to a server at " << socketPath << " (" << strerror(errno) << ")." << endl;
+        return 1;
+    }
+    
+    uint32_t length = payload.length();
+    int fds[3] = {0, 1, 2};
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct iovec iov;
+    struct msghdr message;
+    
+    iov.iov_base = &length;
+    iov.iov_len = sizeof(length);
+    memset(&message, 0, sizeof(message));
+    memset(control, 0, sizeof(control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&message);
+    
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    if ( sendmsg(fd, &message, 0) != sizeof(length) || ! writeFully(fd, payload.c_str(), payload.length()) )
+    {
+        cerr << "ERROR: could not send request to " << socketPath << "." << endl;
+        return 1;
+    }
+    
+    // The worker writes directly to our stdout and stderr; all that comes
+    // back over the socket is the exit status (or nothing, if it exited
+    // early on an error).
+    //
+    char code;
+    
+    if ( ! readFully(fd, &code, 1) )
+    {
+        code = 1;
+    }
+    
+    close(fd);
+    
+    return code;
+}
+
+bool writeFully(int fd, const char * buffer, uint64_t length)
+{
+    while ( length > 0 )
+    {
+        ssize_t count = write(fd, buffer, length);
+        
+        if ( count < 0 && errno == EINTR )
+        {
+            continue;
+        }
+        
+        if ( count <= 0 )
+        {
+            return false;
+        }
+        
+        buffer += count;
+        length -= count;
+    }
+    
+    return true;
+}
+
+} // namespace mash
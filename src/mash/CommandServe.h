@@ -0,0 +1,53 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_CommandServe
+#define INCLUDED_CommandServe
+
+#include "Command.h"
+#include "CommandScreen.h"
+#include "Sketch.h"
+#include <string>
+#include <vector>
+
+namespace mash {
+
+static const uint32_t serveRequestSizeMax = 1 << 24; // bytes of a request's arguments
+
+class CommandServe : public Command
+{
+public:
+    
+    struct ResidentReference
+    {
+        ResidentReference() : hashTable(0) {}
+        
+        Sketch sketch;
+        HashTable * hashTable; // for screen requests; 0 if not built
+    };
+    
+    CommandServe();
+    
+    int run() const; // override
+
+private:
+    
+    int serveRequest(int fd, uint64_t id, int fdLog) const;
+};
+
+// Returns the resident copy of a reference sketch file, if this process is a
+// server worker and the file (compared by real path) was loaded by the server.
+//
+const CommandServe::ResidentReference * getResidentReference(const std::string & file);
+
+// Forwards a command and its arguments (along with the working directory and
+// standard streams of this process) to a server, returning its exit status.
+//
+int runOnServer(const std::string & socketPath, const std::string & commandName, const std::vector<std::string> & arguments);
+
+} // namespace mash
+
+#endif
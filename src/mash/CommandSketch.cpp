@@ -29,6 +29,7 @@ CommandSketch::CommandSketch()
     addOption("prefix", Option(Option::File, "o", "Output", "Output prefix (first input file used if unspecified). The suffix '.msh' will be appended.", ""));
     addOption("id", Option(Option::File, "I", "Sketch", "ID field for sketch of reads (instead of first sequence ID).", ""));
     addOption("comment", Option(Option::File, "C", "Sketch", "Comment for a sketch of reads (instead of first sequence comment).", ""));
+    addOption("segment", Option(Option::Integer, "segment", "Output", "Write sketches to the output in segments of this many while sketching continues, rather than holding all of them until the end. The output is read as a single sketch file. Cannot be used with -I or -C. 0 to write once at the end.", "0", 0, 1e9));
     useSketchOptions();
 }
 
@@ -89,6 +90,45 @@ int CommandSketch::run() const
     	}
     }
     
+    string prefix;
+    
+    if ( options.at("prefix").argument.length() > 0 )
+    {
+        prefix = options.at("prefix").argument;
+    }
+    else
+    {
+        if ( arguments[0] == "-" )
+        {
+            prefix = "stdin";
+        }
+        else
+        {
+            prefix = arguments[0];
+        }
+    }
+    
+    string suffix = parameters.windowed ? suffixSketchWindowed : suffixSketch;
+    
+    if ( ! hasSuffix(prefix, suffix) )
+    {
+        prefix += suffix;
+    }
+    
+    uint64_t segment = options.at("segment").getArgumentAsNumber();
+    
+    if ( segment > 0 )
+    {
+        if ( getOption("id").active || getOption("comment").active )
+        {
+            cerr << "ERROR: -" << getOption("id").identifier << " and -" << getOption("comment").identifier << " cannot be used with -" << getOption("segment").identifier << "." << endl;
+            return 1;
+        }
+        
+        cerr << "Writing to " << prefix << "..." << endl;
+        sketch.setSegmentOutput(prefix, segment);
+    }
+    
     if ( parameters.reads )
     {
     	sketch.initFromReads(files, parameters);
@@ -128,35 +168,23 @@ int CommandSketch::run() const
 		}
 	}
 	
-    string prefix;
-    
-    if ( options.at("prefix").argument.length() > 0 )
+    if ( segment > 0 )
     {
-        prefix = options.at("prefix").argument;
+        if ( sketch.finishSegmentOutput() )
+        {
+            return 1;
+        }
     }
     else
     {
-        if ( arguments[0] == "-" )
-        {
-            prefix = "stdin";
-        }
-        else
+        cerr << "Writing to " << prefix << "..." << endl;
+        
+        if ( sketch.writeToCapnp(prefix.c_str()) )
         {
-            prefix = arguments[0];
+            return 1;
         }
     }
     
-    string suffix = parameters.windowed ? suffixSketchWindowed : suffixSketch;
-    
-    if ( ! hasSuffix(prefix, suffix) )
-    {
-        prefix += suffix;
-    }
-    
-    cerr << "Writing to " << prefix << "..." << endl;
-    
-    sketch.writeToCapnp(prefix.c_str());
-    
     if ( warningCount > 0 && ! parameters.reads )
     {
     	warnKmerSize(parameters, *this, lengthMax, lengthMaxName, randomChance, kMin, warningCount);
@@ -0,0 +1,233 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "CommandSplit.h"
+#include "ClusterIndex.h"
+#include <algorithm>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <unordered_map>
+#include "unistd.h"
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::to_string;
+using std::unordered_map;
+using std::vector;
+
+namespace mash {
+
+CommandSplit::CommandSplit()
+: Command()
+{
+    name = "split";
+    summary = "Split a sketch file into shards of similar total size.";
+    description = "Split a sketch file into a number of sketch files (shards) with the same parameters, balancing the total number of hashes in each. References can be kept together in groups, by name prefix (-prefix) or by cluster (-clusters), in which case whole groups are balanced. Each reference is in exactly one shard, and references keep their order within shards. Shards are written in parallel to <prefix>.<i>.msh, for i from 1 to the number of shards.";
+    argumentString = "<sketch>";
+    
+    useOption("help");
+    useOption("threads");
+    addOption("output", Option(Option::File, "o", "", "Output prefix (required).", ""));
+    addOption("shards", Option(Option::Integer, "n", "", "Number of shards.", "2", 1, 1000000));
+    addOption("prefix", Option(Option::Integer, "prefix", "", "Keep references whose names start with the same this many characters in the same shard.", "0", 0, 1000000));
+    addOption("clusters", Option(Option::Boolean, "clusters", "", "Keep the references of each cluster in the same shard. Clusters must be built with \"mash index -clusters\". Incompatible with -prefix.", ""));
+    addOption("packed", Option(Option::Boolean, "packed", "", "Delta code and bit pack hashes and counts, making the shards smaller. Packed files cannot be read by older versions of Mash.", ""));
+}
+
+int CommandSplit::run() const
+{
+    if ( arguments.size() != 1 || options.at("help").active )
+    {
+        print();
+        return 0;
+    }
+    
+    const string & file = arguments[0];
+    string prefix = options.at("output").argument;
+    uint64_t shardCount = options.at("shards").getArgumentAsNumber();
+    uint64_t prefixLength = options.at("prefix").getArgumentAsNumber();
+    bool clusters = options.at("clusters").active;
+    int threads = options.at("threads").getArgumentAsNumber();
+    
+    if ( prefix == "" )
+    {
+        cerr << "ERROR: Output prefix (-" << options.at("output").identifier << ") required." << endl;
+        return 1;
+    }
+    
+    if ( ! hasSuffix(file, suffixSketch) )
+    {
+        cerr << "ERROR: The file \"" << file << "\" does not look like a sketch (windowed sketches are not supported)." << endl;
+        return 1;
+    }
+    
+    if ( clusters && prefixLength > 0 )
+    {
+        cerr << "ERROR: The options -" << options.at("prefix").identifier << " and -" << options.at("clusters").identifier << " are incompatible." << endl;
+        return 1;
+    }
+    
+    vector<string> files(shardCount);
+    
+    for ( uint64_t i = 0; i < shardCount; i++ )
+    {
+        files[i] = prefix + "." + to_string(i + 1) + suffixSketch;
+        
+        if ( access(files[i].c_str(), F_OK) != -1 )
+        {
+            cerr << "ERROR: \"" << files[i] << "\" exists; remove to write." << endl;
+            return 1;
+        }
+    }
+    
+    Sketch sketch;
+    Sketch::Parameters parameters;
+    
+    parameters.parallelism = threads;
+    sketch.initFromFiles(vector<string>(1, file), parameters);
+    
+    // Each reference is put in a group (its own, by default), numbered in
+    // order of first appearance.
+    
+    vector<uint64_t> groupByReference(sketch.getReferenceCount());
+    vector<uint64_t> groupHashCounts;
+    
+    if ( clusters )
+    {
+        ClusterIndex clusterIndex;
+        vector<uint64_t> representativeByReference;
+        unordered_map<uint64_t, uint64_t> groupByRepresentative;
+        
+        if ( ! clusterIndex.initFromSidecar(file, sketch.getReferenceCount()) )
+        {
+            cerr << "ERROR: No up-to-date clusters found for " << file << " (build them with \"mash index -clusters\")." << endl;
+            return 1;
+        }
+        
+        clusterIndex.getRepresentatives(representativeByReference);
+        
+        for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+        {
+            groupByReference[i] = groupByRepresentative.emplace(representativeByReference[i], groupByRepresentative.size()).first->second;
+        }
+    }
+    else if ( prefixLength > 0 )
+    {
+        unordered_map<string, uint64_t> groupByPrefix;
+        
+        for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+        {
+            groupByReference[i] = groupByPrefix.emplace(sketch.getReference(i).name.substr(0, prefixLength), groupByPrefix.size()).first->second;
+        }
+    }
+    else
+    {
+        for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+        {
+            groupByReference[i] = i;
+        }
+    }
+    
+    for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+    {
+        if ( groupByReference[i] == groupHashCounts.size() )
+        {
+            groupHashCounts.push_back(0);
+        }
+        
+        groupHashCounts[groupByReference[i]] += sketch.getReference(i).hashesSorted.size();
+    }
+    
+    // Groups are assigned largest first to the shard with the fewest hashes
+    // so far (ties broken by shard order), so no shard is over the best
+    // possible balance by more than the largest group.
+    
+    vector<std::pair<uint64_t, uint64_t>> groupsBySize(groupHashCounts.size()); // hash count, group
+    vector<uint64_t> shardByGroup(groupHashCounts.size());
+    vector<uint64_t> shardHashCounts(shardCount, 0);
+    std::priority_queue<std::pair<uint64_t, uint64_t>, vector<std::pair<uint64_t, uint64_t>>, std::greater<std::pair<uint64_t, uint64_t>>> shardsBySize;
+    
+    for ( uint64_t i = 0; i < groupsBySize.size(); i++ )
+    {
+        groupsBySize[i] = std::make_pair(groupHashCounts[i], i);
+    }
+    
+    std::sort(groupsBySize.rbegin(), groupsBySize.rend());
+    
+    for ( uint64_t i = 0; i < shardCount; i++ )
+    {
+        shardsBySize.push(std::make_pair(0, i));
+    }
+    
+    for ( uint64_t i = 0; i < groupsBySize.size(); i++ )
+    {
+        std::pair<uint64_t, uint64_t> shard = shardsBySize.top();
+        
+        shardsBySize.pop();
+        shardByGroup[groupsBySize[i].second] = shard.second;
+        shardHashCounts[shard.second] += groupsBySize[i].first;
+        shardsBySize.push(std::make_pair(shardHashCounts[shard.second], shard.second));
+    }
+    
+    vector<vector<uint64_t>> indicesByShard(shardCount);
+    
+    for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+    {
+        indicesByShard[shardByGroup[groupByReference[i]]].push_back(i);
+    }
+    
+    ThreadPool<WriteInput, WriteOutput> threadPool(writeShard, threads);
+    bool success = true;
+    
+    for ( uint64_t i = 0; i < shardCount; i++ )
+    {
+        cerr << "Writing " << indicesByShard[i].size() << " references (" << shardHashCounts[i] << " hashes) to " << files[i] << "..." << endl;
+        
+        if ( indicesByShard[i].size() == 0 )
+        {
+            cerr << "WARNING: " << files[i] << " will be empty (there are fewer groups than shards)." << endl;
+        }
+        
+        threadPool.runWhenThreadAvailable(new WriteInput(sketch, indicesByShard[i], files[i], options.at("packed").active));
+        
+        while ( threadPool.outputAvailable() )
+        {
+            WriteOutput * output = threadPool.popOutputWhenAvailable();
+            success = success && output->success;
+            delete output;
+        }
+    }
+    
+    while ( threadPool.running() )
+    {
+        WriteOutput * output = threadPool.popOutputWhenAvailable();
+        success = success && output->success;
+        delete output;
+    }
+    
+    if ( ! success )
+    {
+        cerr << "ERROR: Could not write shards." << endl;
+        return 1;
+    }
+    
+    return 0;
+}
+
+CommandSplit::WriteOutput * writeShard(CommandSplit::WriteInput * input)
+{
+    CommandSplit::WriteOutput * output = new CommandSplit::WriteOutput();
+    Sketch shard;
+    
+    shard.initFromReferences(input->sketch, input->indices);
+    output->success = shard.writeToCapnp(input->file.c_str(), input->packed) == 0;
+    
+    return output;
+}
+
+} // namespace mash
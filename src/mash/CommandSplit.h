@@ -0,0 +1,51 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef INCLUDED_CommandSplit
+#define INCLUDED_CommandSplit
+
+#include "Command.h"
+#include "Sketch.h"
+#include <string>
+#include <vector>
+
+namespace mash {
+
+class CommandSplit : public Command
+{
+public:
+    
+    struct WriteInput
+    {
+        WriteInput(const Sketch & sketchNew, const std::vector<uint64_t> & indicesNew, const std::string & fileNew, bool packedNew)
+            :
+            sketch(sketchNew),
+            indices(indicesNew),
+            file(fileNew),
+            packed(packedNew)
+            {}
+        
+        const Sketch & sketch;
+        std::vector<uint64_t> indices; // references of the shard, in input order
+        std::string file;
+        bool packed;
+    };
+    
+    struct WriteOutput
+    {
+        bool success;
+    };
+    
+    CommandSplit();
+    
+    int run() const; // override
+};
+
+CommandSplit::WriteOutput * writeShard(CommandSplit::WriteInput * input);
+
+} // namespace mash
+
+#endif
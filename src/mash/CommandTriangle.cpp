@@ -4,14 +4,19 @@
 //
 // See the LICENSE.txt file included with this software for license information.
 
+#include "ClusterIndex.h"
 #include "CommandDistance.h"
 #include "CommandTriangle.h"
+#include "LshIndex.h"
 #include "Sketch.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <zlib.h>
 #include "ThreadPool.h"
 #include "sketchParameterSetup.h"
 #include <math.h>
+#include <algorithm>
 
 #ifdef USE_BOOST
     #include <boost/math/distributions/binomial.hpp>
@@ -39,7 +44,18 @@ CommandTriangle::CommandTriangle()
     addOption("pvalue", Option(Option::Number, "v", "Output", "Maximum p-value to report in edge list. Implies -" + getOption("edge").identifier + ".", "1.0", 0., 1.));
     addOption("distance", Option(Option::Number, "d", "Output", "Maximum distance to report in edge list. Implies -" + getOption("edge").identifier + ".", "1.0", 0., 1.));
     //addOption("log", Option(Option::Boolean, "L", "Output", "Log scale distances and divide by k-mer size to provide a better analog to phylogenetic distance. The special case of zero shared min-hashes will result in a distance of 1.", ""));
+    addOption("lsh", Option(Option::Boolean, "lsh", "Output", "Compare only pairs that collide in a locality-sensitive hashing index, rather than all pairs. Requires a maximum distance (-d) below 1. An index built by \"mash index -lsh\" is used if present and up to date; otherwise one is built for the maximum distance. Pairs within the distance are found with high probability, but not certainty. To bound memory, a sketch in an index bucket of more than " + to_string(lshBucketMax) + " sketches (e.g. a large cluster of near-identical ones) is only paired with the " + to_string(lshBucketMax) + " before it in the bucket. Edges are written in the same order as without this option.", ""));
+    addOption("sparse", Option(Option::Boolean, "sparse", "Output", "Compare only pairs that share enough hashes to be within the maximum distance, found by looking up the sketches that contain each hash, rather than all pairs. Requires a maximum distance (-d) below 1. Hashes in more than " + to_string(triangleSparsePostingsMax) + " sketches are not looked up; sketches that could be within the distance by those hashes alone are compared to each other exhaustively. Edges are the same, and in the same order, as without this option.", ""));
+    addOption("digest", Option(Option::File, "digest", "Output", "Append the number of sketches and a digest of them (and of the output options) to this file, so the output can be extended later with -extend.", ""));
+    addOption("extend", Option(Option::File, "extend", "Output", "Previous output to extend with sketches added after the ones it covers. It is copied, followed by only the rows or edges involving new sketches. The previous sketches must be given first and unchanged, which is verified against the last digest in the -digest file for fewer sketches than given now; the output options must also match.", ""));
+    addOption("cluster", Option(Option::Boolean, "cluster", "Output", "Instead of edges, write the single-linkage cluster of each sketch, joining pairs that pass the maximum distance (-d, which must be below 1) and p-value as they are compared, so memory does not grow with the number of edges. Each line is a sketch, its cluster number and the first sketch in its cluster. Works with -" + getOption("sparse").identifier + " and -" + getOption("lsh").identifier + ".", ""));
+    addOption("centroid", Option(Option::Boolean, "centroid", "Output", "Instead of edges, write clusters formed by greedy dereplication: in input order, each sketch joins the nearest centroid within the maximum distance (-d, which must be below 1) or becomes a new one. Only sketches and centroids are compared. Output is as for -cluster, with the centroid in place of the first sketch.", ""));
+    useOption("prefilter");
+    useOption("shard");
+    useOption("checkpoint");
+    useOption("resume");
     useSketchOptions();
+    useOption("cache");
 }
 
 int CommandTriangle::run() const
@@ -50,7 +66,6 @@ int CommandTriangle::run() const
         return 0;
     }
     
-    int threads = options.at("threads").getArgumentAsNumber();
     bool list = options.at("list").active;
     //bool log = options.at("log").active;
     bool comment = options.at("comment").active;
@@ -120,61 +135,617 @@ int CommandTriangle::run() const
 		}
 	}
     
+    BitSignatures signaturesLoaded;
+    const BitSignatures * signatures = 0;
+    
+    if ( options.at("prefilter").active )
+    {
+        if ( ! edge || distanceMax >= 1 )
+        {
+            cerr << "ERROR: The option -" << options.at("prefilter").identifier << " requires a maximum distance (-" << options.at("distance").identifier << ") below 1." << endl;
+            return 1;
+        }
+        
+        if ( ! (queryFiles.size() == 1 && hasSuffix(queryFiles[0], suffixSketch) && signaturesLoaded.initFromSidecar(queryFiles[0], sketch.getReferenceCount())) )
+        {
+            signaturesLoaded.initFromSketch(sketch, bitSignatureBitsDefault, bitSignatureBinsDefault);
+        }
+        
+        signatures = &signaturesLoaded;
+    }
+    
+    uint64_t pairCount = sketch.getReferenceCount() * (sketch.getReferenceCount() - 1) / 2;
+    uint64_t pairFirst;
+    uint64_t pairLast;
+    uint64_t pairBase = 0; // pairs in the output being extended
+    uint64_t countPrevious = 0;
+    bool shardFirst;
+    string settings = getDigestSettings(sketch, edge, comment, distanceMax, pValueMax);
+    
+    if ( options.at("extend").active )
+    {
+        if ( ! options.at("digest").active )
+        {
+            cerr << "ERROR: The option -" << options.at("extend").identifier << " requires a digest file (-" << options.at("digest").identifier << ")." << endl;
+            return 1;
+        }
+        
+        if ( readDigest(options.at("digest").argument, sketch, settings, countPrevious) )
+        {
+            return 1;
+        }
+        
+        pairBase = countPrevious * (countPrevious - 1) / 2;
+    }
+    
+    bool cluster = options.at("cluster").active;
+    bool centroid = options.at("centroid").active;
+    
+    if ( cluster || centroid )
+    {
+        const Option & option = options.at(cluster ? "cluster" : "centroid");
+        
+        if ( cluster && centroid )
+        {
+            cerr << "ERROR: The options -" << options.at("cluster").identifier << " and -" << options.at("centroid").identifier << " cannot be used together." << endl;
+            return 1;
+        }
+        
+        if ( ! edge || distanceMax >= 1 )
+        {
+            cerr << "ERROR: The option -" << option.identifier << " requires a maximum distance (-" << options.at("distance").identifier << ") below 1." << endl;
+            return 1;
+        }
+        
+        if ( options.at("shard").active || options.at("extend").active || options.at("digest").active )
+        {
+            cerr << "ERROR: The option -" << option.identifier << " needs all pairs and cannot be used with -" << options.at("shard").identifier << ", -" << options.at("extend").identifier << " or -" << options.at("digest").identifier << "." << endl;
+            return 1;
+        }
+    }
+    
+    if ( centroid )
+    {
+        ClusterIndex clusters;
+        vector<uint64_t> representatives;
+        
+        clusters.initFromSketch(sketch, 1. - jaccardFromDistance(distanceMax, sketch.getKmerSize()), parameters.parallelism);
+        clusters.getRepresentatives(representatives);
+        
+        cerr << "Found " << clusters.getClusterCount() << " centroids." << endl;
+        
+        writeClusters(sketch, representatives, comment);
+        
+        return 0;
+    }
+    
+    Checkpoint checkpoint;
+    bool resume = options.at("resume").active;
+    
+    if ( resume && ! options.at("checkpoint").active )
+    {
+        cerr << "ERROR: The option -" << options.at("resume").identifier << " requires a checkpoint file (-" << options.at("checkpoint").identifier << ")." << endl;
+        return 1;
+    }
+    
+    if ( options.at("checkpoint").active && (cluster || options.at("lsh").active) )
+    {
+        cerr << "ERROR: The option -" << options.at("checkpoint").identifier << " cannot be used with -" << options.at("cluster").identifier << " or -" << options.at("lsh").identifier << "." << endl;
+        return 1;
+    }
+    
+    UnionFind linkage(cluster ? sketch.getReferenceCount() : 0);
+    
+    if ( options.at("lsh").active )
+    {
+        if ( ! edge || distanceMax >= 1 )
+        {
+            cerr << "ERROR: The option -" << options.at("lsh").identifier << " requires a maximum distance (-" << options.at("distance").identifier << ") below 1." << endl;
+            return 1;
+        }
+        
+        vector<uint64_t> candidates;
+        
+        if ( getLshCandidates(sketch, queryFiles, distanceMax, candidates) )
+        {
+            return 1;
+        }
+        
+        candidates.erase(candidates.begin(), lower_bound(candidates.begin(), candidates.end(), pairBase));
+        
+        cerr << "Comparing " << candidates.size() << " of " << pairCount - pairBase << " pairs." << endl;
+        
+        if ( getShardRange(candidates.size(), pairFirst, pairLast) )
+        {
+            return 1;
+        }
+        
+        shardFirst = pairFirst == 0;
+        
+        if ( pairBase > 0 && shardFirst && copyOutput(options.at("extend").argument, countPrevious, sketch.getReferenceCount(), edge) )
+        {
+            return 1;
+        }
+        
+        compareCandidates(sketch, candidates, pairFirst, pairLast, parameters, comment, distanceMax, pValueMax, signatures, cluster ? &linkage : 0);
+    }
+    else
+    {
+        if ( options.at("sparse").active && (! edge || distanceMax >= 1) )
+        {
+            cerr << "ERROR: The option -" << options.at("sparse").identifier << " requires a maximum distance (-" << options.at("distance").identifier << ") below 1." << endl;
+            return 1;
+        }
+        
+        if ( getShardRange(pairCount - pairBase, pairFirst, pairLast) )
+        {
+            return 1;
+        }
+        
+        shardFirst = pairFirst == 0;
+        
+        if ( pairBase > 0 && shardFirst && ! resume && copyOutput(options.at("extend").argument, countPrevious, sketch.getReferenceCount(), edge) )
+        {
+            return 1;
+        }
+        
+        pairFirst += pairBase;
+        pairLast += pairBase;
+        
+        if ( options.at("checkpoint").active )
+        {
+            string checkpointSettings = settings + " sparse=" + to_string(options.at("sparse").active) + " F=" + to_string(signatures != 0) + " pairs=" + to_string(pairFirst) + "-" + to_string(pairLast);
+            
+            if ( checkpoint.init(options.at("checkpoint").argument, getSketchDigest(sketch, sketch.getReferenceCount(), checkpointSettings), resume, pairFirst) )
+            {
+                return 1;
+            }
+        }
+        
+        if ( options.at("sparse").active )
+        {
+            SparsePostings postings;
+            
+            initSparsePostings(sketch, distanceMax, postings);
+            compareSparse(sketch, postings, pairFirst, pairLast, parameters, comment, distanceMax, pValueMax, signatures, cluster ? &linkage : 0, checkpoint.getActive() ? &checkpoint : 0);
+        }
+        else
+        {
+            compareRange(sketch, pairFirst, pairLast, parameters, comment, edge, distanceMax, pValueMax, signatures, pValuePeakToSet, cluster ? &linkage : 0, checkpoint.getActive() ? &checkpoint : 0);
+        }
+    }
+    
+    if ( checkpoint.getActive() )
+    {
+        checkpoint.finish();
+    }
+    
+    if ( cluster )
+    {
+        vector<uint64_t> representatives(sketch.getReferenceCount());
+        
+        for ( uint64_t i = 0; i < representatives.size(); i++ )
+        {
+            representatives[i] = linkage.find(i);
+        }
+        
+        writeClusters(sketch, representatives, comment);
+    }
+    
+    // Only the first shard records the digest, so that other shards of the
+    // same extension still find the previous one.
+    //
+    if ( options.at("digest").active && shardFirst && writeDigest(options.at("digest").argument, sketch, settings) )
+    {
+        return 1;
+    }
+    
     if ( !edge )
+    {
+        cerr << "Max p-value: " << pValuePeakToSet << endl;
+    }
+    
+    if ( warningCount > 0 && ! parameters.reads )
+    {
+    	warnKmerSize(parameters, *this, lengthMax, lengthMaxName, randomChance, kMin, warningCount);
+    }
+    
+    return 0;
+}
+
+void CommandTriangle::compareRange(const Sketch & sketch, uint64_t pairFirst, uint64_t pairLast, const Sketch::Parameters & parameters, bool comment, bool edge, double distanceMax, double pValueMax, const BitSignatures * signatures, double & pValuePeakToSet, UnionFind * linkage, Checkpoint * checkpoint) const
+{
+    if ( !edge && pairFirst == 0 )
     {
         cout << '\t' << sketch.getReferenceCount() << endl;
         cout << (comment ? sketch.getReference(0).comment : sketch.getReference(0).name) << endl;
     }
     
-    ThreadPool<TriangleInput, TriangleOutput> threadPool(compare, threads);
+    ThreadPool<TriangleInput, TriangleOutput> threadPool(compare, parameters.parallelism);
+    
+    // Tasks are equal runs of pairs in output order rather than rows, which
+    // grow with their index and would leave the last few to a few threads.
+    // Runs can span rows or be a part of one, so a shard or task boundary can
+    // fall within a row; whichever ends the row terminates its line.
+    //
+    uint64_t pairsPerThread = (pairLast - pairFirst) / parameters.parallelism;
+    
+    if ( pairsPerThread == 0 )
+    {
+        pairsPerThread = 1;
+    }
+    
+    if ( pairsPerThread > triangleTaskPairsMax )
+    {
+        pairsPerThread = triangleTaskPairsMax;
+    }
     
-    for ( uint64_t i = 1; i < sketch.getReferenceCount(); i++ )
+    for ( uint64_t pair = pairFirst; pair < pairLast; )
     {
-        threadPool.runWhenThreadAvailable(new TriangleInput(sketch, i, parameters, distanceMax, pValueMax));
+        uint64_t row = triangleRow(pair);
+        uint64_t start = pair - row * (row - 1) / 2;
+        uint64_t count = pairLast - pair < pairsPerThread ? pairLast - pair : pairsPerThread;
+        
+        threadPool.runWhenThreadAvailable(new TriangleInput(sketch, row, start, count, parameters, distanceMax, pValueMax, signatures, 0, 0, linkage));
+        pair += count;
+        
+        if ( checkpoint )
+        {
+            checkpoint->taskSubmitted(pair);
+        }
         
         while ( threadPool.outputAvailable() )
         {
-            writeOutput(threadPool.popOutputWhenAvailable(), comment, edge, pValuePeakToSet);
+            writeOutput(threadPool.popOutputWhenAvailable(), comment, edge, pValuePeakToSet, checkpoint);
         }
     }
     
     while ( threadPool.running() )
     {
-        writeOutput(threadPool.popOutputWhenAvailable(), comment, edge, pValuePeakToSet);
+        writeOutput(threadPool.popOutputWhenAvailable(), comment, edge, pValuePeakToSet, checkpoint);
     }
+}
+
+void CommandTriangle::compareCandidates(const Sketch & sketch, const vector<uint64_t> & candidates, uint64_t first, uint64_t last, const Sketch::Parameters & parameters, bool comment, double distanceMax, double pValueMax, const BitSignatures * signatures, UnionFind * linkage) const
+{
+    // Candidates are sorted pair numbers, so each row's columns are contiguous
+    // once decoded and can be submitted as one task.
     
-    if ( !edge )
+    vector<uint64_t> rows(last - first);
+    vector<uint64_t> columns(last - first);
+    
+    for ( uint64_t i = first; i < last; i++ )
     {
-        cerr << "Max p-value: " << pValuePeakToSet << endl;
+        rows[i - first] = triangleRow(candidates[i]);
+        columns[i - first] = candidates[i] - rows[i - first] * (rows[i - first] - 1) / 2;
     }
     
-    if ( warningCount > 0 && ! parameters.reads )
+    ThreadPool<TriangleInput, TriangleOutput> threadPool(compare, parameters.parallelism);
+    double pValuePeakToSet = 0;
+    
+    for ( uint64_t i = 0; i < rows.size(); )
     {
-    	warnKmerSize(parameters, *this, lengthMax, lengthMaxName, randomChance, kMin, warningCount);
+        uint64_t count = 1;
+        
+        while ( i + count < rows.size() && rows[i + count] == rows[i] )
+        {
+            count++;
+        }
+        
+        threadPool.runWhenThreadAvailable(new TriangleInput(sketch, rows[i], 0, count, parameters, distanceMax, pValueMax, signatures, columns.data() + i, 0, linkage));
+        i += count;
+        
+        while ( threadPool.outputAvailable() )
+        {
+            writeOutput(threadPool.popOutputWhenAvailable(), comment, true, pValuePeakToSet);
+        }
+    }
+    
+    while ( threadPool.running() )
+    {
+        writeOutput(threadPool.popOutputWhenAvailable(), comment, true, pValuePeakToSet);
+    }
+}
+
+void CommandTriangle::compareSparse(const Sketch & sketch, const SparsePostings & postings, uint64_t pairFirst, uint64_t pairLast, const Sketch::Parameters & parameters, bool comment, double distanceMax, double pValueMax, const BitSignatures * signatures, UnionFind * linkage, Checkpoint * checkpoint) const
+{
+    // Each row of the shard is a task, whose columns are found from the
+    // postings of its hashes and then compared as candidates.
+    
+    if ( pairFirst == pairLast )
+    {
+        return;
+    }
+    
+    ThreadPool<TriangleInput, TriangleOutput> threadPool(compare, parameters.parallelism);
+    double pValuePeakToSet = 0;
+    uint64_t rowFirst = triangleRow(pairFirst);
+    uint64_t rowLast = triangleRow(pairLast - 1);
+    
+    for ( uint64_t row = rowFirst; row <= rowLast; row++ )
+    {
+        uint64_t rowPair = row * (row - 1) / 2;
+        uint64_t start = row == rowFirst ? pairFirst - rowPair : 0;
+        uint64_t end = row == rowLast ? pairLast - rowPair : row;
+        
+        threadPool.runWhenThreadAvailable(new TriangleInput(sketch, row, start, end - start, parameters, distanceMax, pValueMax, signatures, 0, &postings, linkage));
+        
+        if ( checkpoint )
+        {
+            checkpoint->taskSubmitted(rowPair + end);
+        }
+        
+        while ( threadPool.outputAvailable() )
+        {
+            writeOutput(threadPool.popOutputWhenAvailable(), comment, true, pValuePeakToSet, checkpoint);
+        }
+    }
+    
+    while ( threadPool.running() )
+    {
+        writeOutput(threadPool.popOutputWhenAvailable(), comment, true, pValuePeakToSet, checkpoint);
+    }
+}
+
+int CommandTriangle::copyOutput(const string & file, uint64_t countPrevious, uint64_t count, bool edge) const
+{
+    ifstream in(file.c_str());
+    
+    if ( ! in )
+    {
+        cerr << "ERROR: Could not open " << file << " for reading." << endl;
+        return 1;
+    }
+    
+    if ( ! edge )
+    {
+        // The matrix header gives its size, which grows to include the new
+        // rows; the rows themselves are unchanged.
+        
+        string header;
+        getline(in, header);
+        
+        if ( header != "\t" + to_string(countPrevious) )
+        {
+            cerr << "ERROR: " << file << " is not a matrix of " << countPrevious << " sketches." << endl;
+            return 1;
+        }
+        
+        cout << '\t' << count << endl;
+    }
+    
+    if ( in.peek() != EOF )
+    {
+        cout << in.rdbuf();
     }
     
     return 0;
 }
 
-void CommandTriangle::writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet) const
+string CommandTriangle::getDigestSettings(const Sketch & sketch, bool edge, bool comment, double distanceMax, double pValueMax) const
 {
-    const Sketch & sketch = output->sketch;
-    const Sketch::Reference & ref = sketch.getReference(output->index);
+    string alphabet;
+    ostringstream settings;
     
-    if ( !edge )
+    sketch.getAlphabetAsString(alphabet);
+    
+    settings << "k=" << sketch.getKmerSize() << " s=" << sketch.getMinHashesPerWindow() << " S=" << sketch.getHashSeed() << " a=" << alphabet << " n=" << sketch.getNoncanonical() << " 64=" << sketch.getUse64();
+    settings << " E=" << edge << " C=" << comment << " d=" << distanceMax << " v=" << pValueMax;
+    
+    return settings.str();
+}
+
+int CommandTriangle::getLshCandidates(const Sketch & sketch, const vector<string> & files, double distanceMax, vector<uint64_t> & candidates) const
+{
+    LshIndex index;
+    double jaccard = jaccardFromDistance(distanceMax, sketch.getKmerSize());
+    
+    if ( files.size() == 1 && hasSuffix(files[0], suffixSketch) && index.initFromSidecar(files[0], sketch.getReferenceCount()) )
+    {
+        double chance = LshIndex::collisionChance(jaccard, index.getBands(), index.getRows());
+        
+        if ( chance < lshRecallTarget )
+        {
+            cerr << "WARNING: " << files[0] << suffixLshIndex << " finds pairs at distance " << distanceMax << " with probability " << chance << "; consider rebuilding it with \"mash index -lsh -d " << distanceMax << "\"." << endl;
+        }
+    }
+    else
+    {
+        index.initFromSketch(sketch, lshBandsDefault, LshIndex::chooseRows(jaccard, lshBandsDefault));
+    }
+    
+    uint64_t oversized = index.getCandidatePairs(candidates);
+    
+    if ( oversized > 0 )
+    {
+        cerr << "WARNING: " << oversized << " LSH buckets have more than " << lshBucketMax << " sketches; each sketch in them is only paired with the " << lshBucketMax << " before it, so some pairs within them may be missed." << endl;
+    }
+    
+    return 0;
+}
+
+void CommandTriangle::initSparsePostings(const Sketch & sketch, double distanceMax, SparsePostings & postings) const
+{
+    // Posting a hash in n sketches costs n^2/2 count increments, so hashes
+    // in too many are left out and counted per sketch instead. Two sketches
+    // can then share at most the smaller count of frequent hashes beyond what
+    // the postings find.
+    
+    unordered_map<uint64_t, uint32_t> sketchCountsByHash;
+    uint64_t frequentTotal = 0;
+    uint64_t frequentOnlyTotal = 0;
+    double jaccardMin = jaccardFromDistance(distanceMax, sketch.getKmerSize());
+    
+    for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+    {
+        const HashList & hashes = sketch.getReference(i).hashesSorted;
+        
+        for ( uint64_t j = 0; j < hashes.size(); j++ )
+        {
+            sketchCountsByHash[hashes.get64() ? hashes.at(j).hash64 : hashes.at(j).hash32]++;
+        }
+    }
+    
+    postings.frequentCounts.resize(sketch.getReferenceCount(), 0);
+    postings.frequentOnly.resize(sketch.getReferenceCount(), false);
+    
+    for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+    {
+        const HashList & hashes = sketch.getReference(i).hashesSorted;
+        
+        for ( uint64_t j = 0; j < hashes.size(); j++ )
+        {
+            uint64_t hash = hashes.get64() ? hashes.at(j).hash64 : hashes.at(j).hash32;
+            
+            if ( sketchCountsByHash.at(hash) > triangleSparsePostingsMax )
+            {
+                postings.frequentCounts[i]++;
+            }
+            else
+            {
+                postings.referencesByHash[hash].push_back(i);
+            }
+        }
+        
+        if ( postings.frequentCounts[i] > 0 && postings.frequentCounts[i] >= sparseSharedMin(sketch, i, i, jaccardMin) )
+        {
+            postings.frequentOnly[i] = true;
+            frequentOnlyTotal++;
+        }
+    }
+    
+    for ( unordered_map<uint64_t, uint32_t>::const_iterator i = sketchCountsByHash.begin(); i != sketchCountsByHash.end(); i++ )
+    {
+        if ( i->second > triangleSparsePostingsMax )
+        {
+            frequentTotal++;
+        }
+    }
+    
+    if ( frequentTotal > 0 )
+    {
+        cerr << frequentTotal << " hashes are in more than " << triangleSparsePostingsMax << " sketches and will not be looked up; " << frequentOnlyTotal << " sketches will be compared to each other exhaustively." << endl;
+    }
+}
+
+int CommandTriangle::readDigest(const string & file, const Sketch & sketch, const string & settings, uint64_t & countPrevious) const
+{
+    // Lines are "<count>\t<digest>", appended by each run; the last one for
+    // fewer sketches than given now is the output being extended.
+    
+    ifstream in(file.c_str());
+    string line;
+    uint64_t digestPrevious = 0;
+    
+    countPrevious = 0;
+    
+    if ( ! in )
     {
-        cout << (comment ? ref.comment : ref.name);
+        cerr << "ERROR: Could not open " << file << " for reading." << endl;
+        return 1;
     }
     
-    for ( uint64_t i = 0; i < output->index; i++ )
+    while ( getline(in, line) )
+    {
+        uint64_t count;
+        uint64_t digest;
+        
+        if ( sscanf(line.c_str(), "%" SCNu64 "\t%" SCNx64, &count, &digest) != 2 )
+        {
+            cerr << "ERROR: " << file << " is not a digest file." << endl;
+            return 1;
+        }
+        
+        if ( count < sketch.getReferenceCount() )
+        {
+            countPrevious = count;
+            digestPrevious = digest;
+        }
+    }
+    
+    if ( countPrevious == 0 )
+    {
+        cerr << "ERROR: " << file << " has no digest for fewer than the " << sketch.getReferenceCount() << " sketches given." << endl;
+        return 1;
+    }
+    
+    if ( getSketchDigest(sketch, countPrevious, settings) != digestPrevious )
+    {
+        cerr << "ERROR: The first " << countPrevious << " sketches or the output options differ from those of the output being extended (" << settings << ")." << endl;
+        return 1;
+    }
+    
+    cerr << "Extending output of " << countPrevious << " sketches with " << sketch.getReferenceCount() - countPrevious << " new sketches." << endl;
+    
+    return 0;
+}
+
+int CommandTriangle::writeDigest(const string & file, const Sketch & sketch, const string & settings) const
+{
+    FILE * stream = fopen(file.c_str(), "a");
+    
+    if ( stream == 0 )
+    {
+        cerr << "ERROR: Could not open " << file << " for writing." << endl;
+        return 1;
+    }
+    
+    fprintf(stream, "%" PRIu64 "\t%016" PRIx64 "\n", sketch.getReferenceCount(), getSketchDigest(sketch, sketch.getReferenceCount(), settings));
+    fclose(stream);
+    
+    return 0;
+}
+
+void CommandTriangle::writeClusters(const Sketch & sketch, const vector<uint64_t> & representatives, bool comment) const
+{
+    // Clusters are numbered in order of their first sketch.
+    
+    vector<int64_t> clusterByRepresentative(sketch.getReferenceCount(), -1);
+    uint64_t clusterCount = 0;
+    
+    for ( uint64_t i = 0; i < sketch.getReferenceCount(); i++ )
+    {
+        const Sketch::Reference & ref = sketch.getReference(i);
+        const Sketch::Reference & rep = sketch.getReference(representatives[i]);
+        
+        if ( clusterByRepresentative[representatives[i]] == -1 )
+        {
+            clusterByRepresentative[representatives[i]] = clusterCount++;
+        }
+        
+        cout << (comment ? ref.comment : ref.name) << '\t' << clusterByRepresentative[representatives[i]] << '\t' << (comment ? rep.comment : rep.name) << endl;
+    }
+}
+
+void CommandTriangle::writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet, Checkpoint * checkpoint) const
+{
+    // Pairs run row by row from (index, start), unless columns are given, in
+    // which case they are all in row index.
+    
+    const Sketch & sketch = output->sketch;
+    uint64_t row = output->index;
+    uint64_t column = output->start;
+    
+    for ( uint64_t i = 0; i < output->count; i++ )
     {
         const CommandDistance::CompareOutput::PairOutput * pair = &output->pairs[i];
+        const Sketch::Reference & ref = sketch.getReference(row);
+        
+        if ( output->columns )
+        {
+            column = output->columns[i];
+        }
+        
+        if ( !edge && column == 0 )
+        {
+            cout << (comment ? ref.comment : ref.name);
+        }
         
         if ( edge )
         {
-            if ( pair->pass )
+            if ( pair->pass && ! output->linked )
             {
-                const Sketch::Reference & qry = sketch.getReference(i);
+                const Sketch::Reference & qry = sketch.getReference(column);
                 cout << (comment ? ref.comment : ref.name) << '\t'<< (comment ? qry.comment : qry.name) << '\t' << pair->distance << '\t' << pair->pValue << '\t' << pair->numer << '/' << pair->denom << endl;
             }
         }
@@ -187,30 +758,219 @@ void CommandTriangle::writeOutput(TriangleOutput * output, bool comment, bool ed
         {
             pValuePeakToSet = pair->pValue;
         }
+        
+        column++;
+        
+        if ( ! output->columns && column == row )
+        {
+            if ( !edge )
+            {
+                cout << endl;
+            }
+            
+            row++;
+            column = 0;
+        }
     }
     
-    if ( !edge )
+    delete output;
+    
+    if ( checkpoint )
     {
-        cout << endl;
+        checkpoint->taskWritten();
     }
-    
-    delete output;
 }
 
 CommandTriangle::TriangleOutput * compare(CommandTriangle::TriangleInput * input)
 {
     const Sketch & sketch = input->sketch;
     
-    CommandTriangle::TriangleOutput * output = new CommandTriangle::TriangleOutput(input->sketch, input->index);
+    double jaccardMin = jaccardFromDistance(input->maxDistance, sketch.getKmerSize());
+    
+    if ( input->postings )
+    {
+        vector<uint64_t> columns;
+        
+        findSparseColumns(input, jaccardMin, columns);
+        
+        CommandTriangle::TriangleOutput * output = new CommandTriangle::TriangleOutput(input->sketch, input->index, 0, columns.size(), 0);
+        
+        output->linked = input->linkage != 0;
+        
+        output->columnsFound.swap(columns);
+        output->columns = output->columnsFound.data();
+        
+        for ( uint64_t i = 0; i < output->count; i++ )
+        {
+            comparePair(input, input->index, output->columns[i], jaccardMin, &output->pairs[i]);
+        }
+        
+        return output;
+    }
+    
+    CommandTriangle::TriangleOutput * output = new CommandTriangle::TriangleOutput(input->sketch, input->index, input->start, input->count, input->columns);
+    
+    output->linked = input->linkage != 0;
+    
+    if ( input->columns )
+    {
+        for ( uint64_t i = 0; i < input->count; i++ )
+        {
+            comparePair(input, input->index, input->columns[i], jaccardMin, &output->pairs[i]);
+        }
+        
+        return output;
+    }
+    
+    // Pairs run row by row from (index, start). They are computed a block of
+    // columns at a time across all rows of the task, so each block of column
+    // sketches stays in cache while every row is compared to it.
     
-    uint64_t sketchSize = sketch.getMinHashesPerWindow();
+    uint64_t pairFirst = input->index * (input->index - 1) / 2 + input->start;
+    uint64_t pairLast = pairFirst + input->count;
+    uint64_t rowLast = triangleRow(pairLast - 1);
     
-    for ( uint64_t i = 0; i < input->index; i++ )
+    for ( uint64_t block = 0; block < rowLast; block += triangleBlockSize )
     {
-        compareSketches(&output->pairs[i], sketch.getReference(input->index), sketch.getReference(i), sketchSize, sketch.getKmerSize(), sketch.getKmerSpace(), input->maxDistance, input->maxPValue);
+        for ( uint64_t row = input->index; row <= rowLast; row++ )
+        {
+            uint64_t rowPair = row * (row - 1) / 2;
+            uint64_t columnFirst = row == input->index ? input->start : 0;
+            uint64_t columnLast = row == rowLast ? pairLast - rowPair : row;
+            
+            if ( columnFirst < block )
+            {
+                columnFirst = block;
+            }
+            
+            if ( columnLast > block + triangleBlockSize )
+            {
+                columnLast = block + triangleBlockSize;
+            }
+            
+            for ( uint64_t column = columnFirst; column < columnLast; column++ )
+            {
+                comparePair(input, row, column, jaccardMin, &output->pairs[rowPair + column - pairFirst]);
+            }
+        }
     }
     
     return output;
 }
 
+void comparePair(const CommandTriangle::TriangleInput * input, uint64_t row, uint64_t column, double jaccardMin, CommandDistance::CompareOutput::PairOutput * pair)
+{
+    const Sketch & sketch = input->sketch;
+    
+    if ( input->signatures && ! input->signatures->mayMeetJaccard(row, *input->signatures, column, jaccardMin) )
+    {
+        pair->pass = false;
+        pair->distance = 1.;
+        pair->pValue = 0.;
+    }
+    else
+    {
+        compareSketches(pair, sketch.getReference(row), sketch.getReference(column), sketch.getMinHashesPerWindow(), sketch.getKmerSize(), sketch.getKmerSpace(), input->maxDistance, input->maxPValue);
+        
+        if ( input->linkage && pair->pass )
+        {
+            input->linkage->join(row, column);
+        }
+    }
+}
+
+void findSparseColumns(const CommandTriangle::TriangleInput * input, double jaccardMin, vector<uint64_t> & columns)
+{
+    // Columns in [start, start + count) of row index that share enough posted
+    // hashes, plus as many frequent ones as both could share, to pass.
+    
+    const Sketch & sketch = input->sketch;
+    const CommandTriangle::SparsePostings & postings = *input->postings;
+    const HashList & hashes = sketch.getReference(input->index).hashesSorted;
+    uint64_t row = input->index;
+    uint64_t columnFirst = input->start;
+    uint64_t columnLast = input->start + input->count;
+    unordered_map<uint64_t, uint32_t> sharedCounts;
+    
+    for ( uint64_t i = 0; i < hashes.size(); i++ )
+    {
+        unordered_map<uint64_t, vector<uint32_t>>::const_iterator posting = postings.referencesByHash.find(hashes.get64() ? hashes.at(i).hash64 : hashes.at(i).hash32);
+        
+        if ( posting == postings.referencesByHash.end() )
+        {
+            continue; // frequent
+        }
+        
+        const vector<uint32_t> & references = posting->second;
+        
+        for ( vector<uint32_t>::const_iterator j = lower_bound(references.begin(), references.end(), columnFirst); j != references.end() && *j < columnLast; j++ )
+        {
+            sharedCounts[*j]++;
+        }
+    }
+    
+    for ( unordered_map<uint64_t, uint32_t>::const_iterator i = sharedCounts.begin(); i != sharedCounts.end(); i++ )
+    {
+        uint64_t column = i->first;
+        uint32_t frequentShared = min(postings.frequentCounts[row], postings.frequentCounts[column]);
+        
+        if ( i->second + frequentShared >= sparseSharedMin(sketch, row, column, jaccardMin) )
+        {
+            columns.push_back(column);
+        }
+    }
+    
+    if ( postings.frequentOnly[row] )
+    {
+        for ( uint64_t column = columnFirst; column < columnLast; column++ )
+        {
+            if ( postings.frequentOnly[column] && sharedCounts.count(column) == 0 )
+            {
+                columns.push_back(column);
+            }
+        }
+    }
+    
+    sort(columns.begin(), columns.end());
+}
+
+double sparseSharedMin(const Sketch & sketch, uint64_t row, uint64_t column, double jaccardMin)
+{
+    // The union that compareSketches divides by is at least the larger
+    // sketch, up to the sketch size, and shared hashes bound the numerator,
+    // so fewer cannot meet jaccardMin. The slack covers rounding in
+    // converting the distance; at least one hash must be shared regardless.
+    
+    uint64_t denom = max(sketch.getReference(row).hashesSorted.size(), sketch.getReference(column).hashesSorted.size());
+    
+    if ( denom > sketch.getMinHashesPerWindow() )
+    {
+        denom = sketch.getMinHashesPerWindow();
+    }
+    
+    double sharedMin = jaccardMin * denom * (1. - 1e-9);
+    
+    return sharedMin < 1. ? 1. : sharedMin;
+}
+
+uint64_t triangleRow(uint64_t pair)
+{
+    // Row i of the lower triangle holds pairs [i(i-1)/2, i(i+1)/2); estimate
+    // with floating point and correct for rounding.
+    
+    uint64_t row = (1. + sqrt(1. + 8. * pair)) / 2.;
+    
+    while ( row > 1 && row * (row - 1) / 2 > pair )
+    {
+        row--;
+    }
+    
+    while ( row * (row + 1) / 2 <= pair )
+    {
+        row++;
+    }
+    
+    return row;
+}
+
 } // namespace mash
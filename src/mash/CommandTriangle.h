@@ -10,39 +10,71 @@
 #include "Command.h"
 #include "CommandDistance.h"
 #include "Sketch.h"
+#include "UnionFind.h"
+#include "Checkpoint.h"
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace mash {
 
+static const uint64_t triangleTaskPairsMax = 0x10000;
+static const uint64_t triangleBlockSize = 64; // columns compared to all rows of a task at a time
+static const uint64_t triangleSparsePostingsMax = 1024; // sketches a hash can be in and still be posted
+
 class CommandTriangle : public Command
 {
 public:
     
+    struct SparsePostings
+    {
+        std::unordered_map<uint64_t, std::vector<uint32_t>> referencesByHash; // ascending; only hashes that are not frequent
+        std::vector<uint32_t> frequentCounts; // frequent hashes in each reference
+        std::vector<bool> frequentOnly; // whether each reference could pass with another by sharing only frequent hashes
+    };
+    
     struct TriangleInput
     {
-        TriangleInput(const Sketch & sketchNew, uint64_t indexNew, const Sketch::Parameters & parametersNew, double maxDistanceNew, double maxPValueNew)
+        TriangleInput(const Sketch & sketchNew, uint64_t indexNew, uint64_t startNew, uint64_t countNew, const Sketch::Parameters & parametersNew, double maxDistanceNew, double maxPValueNew, const BitSignatures * signaturesNew = 0, const uint64_t * columnsNew = 0, const SparsePostings * postingsNew = 0, UnionFind * linkageNew = 0)
             :
             sketch(sketchNew),
             index(indexNew),
+            start(startNew),
+            count(countNew),
             parameters(parametersNew),
             maxDistance(maxDistanceNew),
-            maxPValue(maxPValueNew)
+            maxPValue(maxPValueNew),
+            signatures(signaturesNew),
+            columns(columnsNew),
+            postings(postingsNew),
+            linkage(linkageNew)
             {}
         
         const Sketch & sketch;
-        uint64_t index;
+        uint64_t index; // row of the first pair
+        uint64_t start; // column of the first pair
+        uint64_t count; // number of pairs, continuing to following rows
         const Sketch::Parameters & parameters;
         double maxDistance;
         double maxPValue;
+        const BitSignatures * signatures; // for prefiltering; 0 if not used
+        const uint64_t * columns; // columns of row index to compare instead; 0 if not used
+        const SparsePostings * postings; // to find columns of row index from start that share hashes; 0 if not used
+        UnionFind * linkage; // to join pairs that pass instead of writing them; 0 if not used
     };
     
     struct TriangleOutput
     {
-        TriangleOutput(const Sketch & sketchNew, uint64_t indexNew)
+        TriangleOutput(const Sketch & sketchNew, uint64_t indexNew, uint64_t startNew, uint64_t countNew, const uint64_t * columnsNew)
             :
             sketch(sketchNew),
-            index(indexNew)
+            index(indexNew),
+            start(startNew),
+            count(countNew),
+            columns(columnsNew),
+            linked(false)
         {
-            pairs = new CommandDistance::CompareOutput::PairOutput[index];
+            pairs = new CommandDistance::CompareOutput::PairOutput[count];
         }
         
         ~TriangleOutput()
@@ -52,6 +84,11 @@ public:
         
         const Sketch & sketch;
         uint64_t index;
+        uint64_t start;
+        uint64_t count;
+        const uint64_t * columns;
+        std::vector<uint64_t> columnsFound; // owns columns if found from postings
+        bool linked; // pairs that pass were joined in a linkage instead of being written
         
         CommandDistance::CompareOutput::PairOutput * pairs;
     };
@@ -65,10 +102,24 @@ private:
     double pValueMax;
     bool comment;
     
-    void writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet) const;
+    void compareCandidates(const Sketch & sketch, const std::vector<uint64_t> & candidates, uint64_t first, uint64_t last, const Sketch::Parameters & parameters, bool comment, double distanceMax, double pValueMax, const BitSignatures * signatures, UnionFind * linkage = 0) const;
+    void compareRange(const Sketch & sketch, uint64_t pairFirst, uint64_t pairLast, const Sketch::Parameters & parameters, bool comment, bool edge, double distanceMax, double pValueMax, const BitSignatures * signatures, double & pValuePeakToSet, UnionFind * linkage = 0, Checkpoint * checkpoint = 0) const;
+    int copyOutput(const std::string & file, uint64_t countPrevious, uint64_t count, bool edge) const;
+    void compareSparse(const Sketch & sketch, const SparsePostings & postings, uint64_t pairFirst, uint64_t pairLast, const Sketch::Parameters & parameters, bool comment, double distanceMax, double pValueMax, const BitSignatures * signatures, UnionFind * linkage = 0, Checkpoint * checkpoint = 0) const;
+    std::string getDigestSettings(const Sketch & sketch, bool edge, bool comment, double distanceMax, double pValueMax) const;
+    int getLshCandidates(const Sketch & sketch, const std::vector<std::string> & files, double distanceMax, std::vector<uint64_t> & candidates) const;
+    void initSparsePostings(const Sketch & sketch, double distanceMax, SparsePostings & postings) const;
+    int readDigest(const std::string & file, const Sketch & sketch, const std::string & settings, uint64_t & countPrevious) const;
+    int writeDigest(const std::string & file, const Sketch & sketch, const std::string & settings) const;
+    void writeClusters(const Sketch & sketch, const std::vector<uint64_t> & representatives, bool comment) const;
+    void writeOutput(TriangleOutput * output, bool comment, bool edge, double & pValuePeakToSet, Checkpoint * checkpoint = 0) const;
 };
 
 CommandTriangle::TriangleOutput * compare(CommandTriangle::TriangleInput * input);
+void findSparseColumns(const CommandTriangle::TriangleInput * input, double jaccardMin, std::vector<uint64_t> & columns);
+void comparePair(const CommandTriangle::TriangleInput * input, uint64_t row, uint64_t column, double jaccardMin, CommandDistance::CompareOutput::PairOutput * pair);
+double sparseSharedMin(const Sketch & sketch, uint64_t row, uint64_t column, double jaccardMin);
+uint64_t triangleRow(uint64_t pair);
 
 } // namespace mash
 
@@ -11,7 +11,18 @@ hash_u HashList::at(int index) const
 {
     hash_u hash;
     
-    if ( use64 )
+    if ( mapped )
+    {
+        if ( use64 )
+        {
+            hash.hash64 = ((const hash64_t *)mapped)[index];
+        }
+        else
+        {
+            hash.hash32 = ((const hash32_t *)mapped)[index];
+        }
+    }
+    else if ( use64 )
     {
         hash.hash64 = hashes64.at(index);
     }
@@ -25,6 +36,8 @@ hash_u HashList::at(int index) const
 
 void HashList::clear()
 {
+    mapped = 0;
+    
     if ( use64 )
     {
         hashes64.clear();
@@ -35,8 +48,24 @@ void HashList::clear()
     }
 }
 
+void HashList::copyMapped()
+{
+    if ( use64 )
+    {
+        hashes64.assign((const hash64_t *)mapped, (const hash64_t *)mapped + mappedSize);
+    }
+    else
+    {
+        hashes32.assign((const hash32_t *)mapped, (const hash32_t *)mapped + mappedSize);
+    }
+    
+    mapped = 0;
+}
+
 void HashList::resize(int size)
 {
+    unmap();
+    
     if ( use64 )
     {
         hashes64.resize(size);
@@ -49,16 +78,31 @@ void HashList::resize(int size)
 
 void HashList::set32(int index, uint32_t value)
 {
+    unmap();
     hashes32[index] = value;
 }
 
 void HashList::set64(int index, uint64_t value)
 {
+    unmap();
     hashes64[index] = value;
 }
 
+void HashList::setMapped(const void * hashes, int size)
+{
+    // Hashes must be sorted, of the width given by setUse64, and outlive this
+    // list or any copies of it.
+    
+    hashes32.clear();
+    hashes64.clear();
+    mapped = hashes;
+    mappedSize = size;
+}
+
 void HashList::sort()
 {
+    unmap();
+    
     if ( use64 )
     {
         std::sort(hashes64.begin(), hashes64.end());
@@ -14,26 +14,37 @@ class HashList
 {
 public:
     
-    HashList() {use64 = true;}
-    HashList(bool use64new) {use64 = use64new;}
+    HashList() : mapped(0) {use64 = true;}
+    HashList(bool use64new) : mapped(0) {use64 = use64new;}
     
     hash_u at(int index) const;
     void clear();
+    bool isMapped() const {return mapped != 0;}
     void resize(int size);
     void set32(int index, uint32_t value);
     void set64(int index, uint64_t value);
+    void setMapped(const void * hashes, int size);
     void setUse64(bool use64New) {use64 = use64New;}
-    int size() const {return use64 ? hashes64.size() : hashes32.size();}
+    int size() const {return mapped ? mappedSize : use64 ? hashes64.size() : hashes32.size();}
     void sort();
-    void push_back32(hash32_t hash) {hashes32.push_back(hash);}
-    void push_back64(hash64_t hash) {hashes64.push_back(hash);}
+    void push_back32(hash32_t hash) {unmap(); hashes32.push_back(hash);}
+    void push_back64(hash64_t hash) {unmap(); hashes64.push_back(hash);}
     bool get64() const {return use64;}
     
 private:
     
+    void unmap() {if ( mapped ) copyMapped();}
+    void copyMapped();
+    
     bool use64;
     std::vector<hash32_t> hashes32;
     std::vector<hash64_t> hashes64;
+    
+    // Sorted hashes owned elsewhere (for example in a memory-mapped sketch
+    // file) rather than by the vectors, which are filled in before any change.
+    //
+    const void * mapped;
+    int mappedSize;
 };
 
 #endif
@@ -0,0 +1,409 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "HnswIndex.h"
+#include "CommandDistance.h"
+#include "ThreadPool.h"
+#include "hash.h"
+#include "sidecar.h"
+#include <algorithm>
+#include <math.h>
+#include <set>
+#include <unordered_set>
+
+using std::set;
+using std::string;
+using std::unordered_set;
+using std::vector;
+
+static const char * hnswIndexMagic = "MASHHNS2";
+static const uint64_t hnswBatchMax = 16384;
+
+void HnswIndex::initFromSketch(const Sketch & sketch, int neighborsMaxNew, int breadth, int threads)
+{
+    uint64_t count = sketch.getReferenceCount();
+    double scale = 1. / log(neighborsMaxNew);
+    
+    neighborsMax = neighborsMaxNew;
+    levelMax = -1;
+    entry = 0;
+    levels.resize(count);
+    links.clear();
+    links.resize(count);
+    linkDistances.resize(count);
+    
+    // levels are drawn from a geometric distribution, seeded by index so
+    // builds are reproducible
+    
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        double uniform = double((getHash((const char *)&i, sizeof(uint64_t), 42, true).hash64 >> 11) + 1) / (uint64_t(1) << 53);
+        
+        levels[i] = -log(uniform) * scale;
+        links[i].resize(levels[i] + 1);
+        linkDistances[i].resize(levels[i] + 1);
+    }
+    
+    if ( count == 0 )
+    {
+        return;
+    }
+    
+    levelMax = levels[0];
+    
+    ThreadPool<InsertInput, InsertOutput> threadPool(hnswInsert, threads);
+    
+    // Each batch is a fraction of the graph so far, so nodes rarely miss
+    // neighbours that are in the same batch.
+    //
+    for ( uint64_t next = 1; next < count; )
+    {
+        uint64_t batch = next / 8;
+        
+        if ( batch < 1 )
+        {
+            batch = 1;
+        }
+        
+        if ( batch > hnswBatchMax )
+        {
+            batch = hnswBatchMax;
+        }
+        
+        if ( batch > count - next )
+        {
+            batch = count - next;
+        }
+        
+        vector<InsertOutput *> outputs;
+        
+        for ( uint64_t i = next; i < next + batch; i++ )
+        {
+            threadPool.runWhenThreadAvailable(new InsertInput(*this, sketch, i, breadth));
+            
+            while ( threadPool.outputAvailable() )
+            {
+                outputs.push_back(threadPool.popOutputWhenAvailable());
+            }
+        }
+        
+        while ( threadPool.running() )
+        {
+            outputs.push_back(threadPool.popOutputWhenAvailable());
+        }
+        
+        for ( uint64_t i = 0; i < outputs.size(); i++ )
+        {
+            link(*outputs[i]);
+            
+            if ( levels[outputs[i]->node] > levelMax )
+            {
+                levelMax = levels[outputs[i]->node];
+                entry = outputs[i]->node;
+            }
+            
+            delete outputs[i];
+        }
+        
+        next += batch;
+    }
+    
+    linkDistances.clear();
+}
+
+bool HnswIndex::initFromSidecar(const string & sketchFile, uint64_t referenceCount)
+{
+    FILE * stream = openSidecarForReading(sketchFile, suffixHnswIndex, hnswIndexMagic, referenceCount);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    int32_t parameters[2];
+    bool success =
+        fread(parameters, sizeof(int32_t), 2, stream) == 2 &&
+        fread(&entry, sizeof(uint64_t), 1, stream) == 1 &&
+        parameters[0] > 0 &&
+        (entry < referenceCount || referenceCount == 0);
+    
+    if ( success )
+    {
+        neighborsMax = parameters[0];
+        levelMax = parameters[1];
+        levels.resize(referenceCount);
+        links.clear();
+        links.resize(referenceCount);
+    }
+    
+    for ( uint64_t i = 0; success && i < referenceCount; i++ )
+    {
+        int32_t level;
+        
+        success = fread(&level, sizeof(int32_t), 1, stream) == 1 && level >= 0 && level <= levelMax;
+        
+        if ( success )
+        {
+            levels[i] = level;
+            links[i].resize(level + 1);
+        }
+        
+        for ( int layer = 0; success && layer <= level; layer++ )
+        {
+            uint32_t count;
+            vector<uint32_t> & nodes = links[i][layer];
+            
+            success = fread(&count, sizeof(uint32_t), 1, stream) == 1 && count <= 2 * neighborsMax;
+            
+            if ( success )
+            {
+                nodes.resize(count);
+                success = fread(nodes.data(), sizeof(uint32_t), count, stream) == count;
+            }
+            
+            for ( uint32_t j = 0; success && j < count; j++ )
+            {
+                success = nodes[j] < referenceCount;
+            }
+        }
+    }
+    
+    fclose(stream);
+    
+    if ( ! success )
+    {
+        levels.clear();
+        links.clear();
+        levelMax = -1;
+    }
+    
+    return success;
+}
+
+void HnswIndex::search(const Sketch & sketch, const Sketch::Reference & query, uint64_t count, int breadth, vector<Neighbor> & results) const
+{
+    results.clear();
+    
+    if ( levels.size() == 0 )
+    {
+        return;
+    }
+    
+    vector<Neighbor> nearest(1, Neighbor(distance(sketch, entry, query), entry));
+    
+    for ( int layer = levelMax; layer > 0; layer-- )
+    {
+        searchLayer(sketch, query, nearest, layer, 1);
+    }
+    
+    searchLayer(sketch, query, nearest, 0, breadth > count ? breadth : count);
+    
+    if ( nearest.size() > count )
+    {
+        nearest.resize(count);
+    }
+    
+    results = nearest;
+}
+
+bool HnswIndex::writeToSidecar(const string & sketchFile) const
+{
+    FILE * stream = openSidecarForWriting(sketchFile, suffixHnswIndex, hnswIndexMagic, levels.size());
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    int32_t parameters[2] = {neighborsMax, levelMax};
+    
+    bool success =
+        fwrite(parameters, sizeof(int32_t), 2, stream) == 2 &&
+        fwrite(&entry, sizeof(uint64_t), 1, stream) == 1;
+    
+    for ( uint64_t i = 0; success && i < levels.size(); i++ )
+    {
+        int32_t level = levels[i];
+        
+        success = fwrite(&level, sizeof(int32_t), 1, stream) == 1;
+        
+        for ( int layer = 0; success && layer <= level; layer++ )
+        {
+            uint32_t count = links[i][layer].size();
+            
+            success =
+                fwrite(&count, sizeof(uint32_t), 1, stream) == 1 &&
+                fwrite(links[i][layer].data(), sizeof(uint32_t), count, stream) == count;
+        }
+    }
+    
+    return fclose(stream) == 0 && success;
+}
+
+double HnswIndex::distance(const Sketch & sketch, uint64_t node, const Sketch::Reference & query) const
+{
+    uint64_t common;
+    uint64_t denom;
+    
+    return mash::sketchDistance(sketch.getReference(node), query, sketch.getMinHashesPerWindow(), sketch.getKmerSize(), common, denom);
+}
+
+void HnswIndex::link(const InsertOutput & output)
+{
+    // Links are made in both directions. When a neighbour has too many, its
+    // farthest is dropped, using distances kept from when links were made.
+    
+    uint64_t node = output.node;
+    
+    for ( int layer = 0; layer < output.neighborsByLayer.size(); layer++ )
+    {
+        const vector<Neighbor> & neighbors = output.neighborsByLayer[layer];
+        uint64_t countMax = layer == 0 ? 2 * neighborsMax : neighborsMax;
+        
+        for ( uint64_t i = 0; i < neighbors.size(); i++ )
+        {
+            uint64_t neighbor = neighbors[i].index;
+            vector<uint32_t> & nodes = links[neighbor][layer];
+            vector<float> & distances = linkDistances[neighbor][layer];
+            
+            links[node][layer].push_back(neighbor);
+            linkDistances[node][layer].push_back(neighbors[i].distance);
+            nodes.push_back(node);
+            distances.push_back(neighbors[i].distance);
+            
+            if ( nodes.size() > countMax )
+            {
+                uint64_t farthest = std::max_element(distances.begin(), distances.end()) - distances.begin();
+                
+                nodes.erase(nodes.begin() + farthest);
+                distances.erase(distances.begin() + farthest);
+            }
+        }
+    }
+}
+
+void HnswIndex::searchLayer(const Sketch & sketch, const Sketch::Reference & query, vector<Neighbor> & nearest, int layer, int breadth) const
+{
+    // Best-first search from the given entry points, keeping the closest
+    // nodes seen; stops when the closest unexpanded node is farther than all
+    // of them.
+    
+    unordered_set<uint64_t> visited;
+    set<Neighbor> candidates;
+    set<Neighbor> results;
+    
+    for ( uint64_t i = 0; i < nearest.size(); i++ )
+    {
+        visited.insert(nearest[i].index);
+        candidates.insert(nearest[i]);
+        results.insert(nearest[i]);
+    }
+    
+    while ( candidates.size() > 0 )
+    {
+        Neighbor candidate = *candidates.begin();
+        
+        candidates.erase(candidates.begin());
+        
+        if ( results.size() >= breadth && candidate.distance > results.rbegin()->distance )
+        {
+            break;
+        }
+        
+        const vector<uint32_t> & nodes = links[candidate.index][layer];
+        
+        for ( uint64_t i = 0; i < nodes.size(); i++ )
+        {
+            if ( ! visited.insert(nodes[i]).second )
+            {
+                continue;
+            }
+            
+            Neighbor neighbor(distance(sketch, nodes[i], query), nodes[i]);
+            
+            if ( results.size() < breadth || neighbor.distance < results.rbegin()->distance )
+            {
+                candidates.insert(neighbor);
+                results.insert(neighbor);
+                
+                if ( results.size() > breadth )
+                {
+                    results.erase(--results.end());
+                }
+            }
+        }
+    }
+    
+    nearest.assign(results.begin(), results.end());
+}
+
+void HnswIndex::selectNeighbors(const Sketch & sketch, const vector<Neighbor> & candidates, uint64_t count, vector<Neighbor> & selected) const
+{
+    // Prefer candidates closer to the node than to any already selected, so
+    // links reach into different clusters; fill up with the rest.
+    
+    vector<Neighbor> pruned;
+    
+    selected.clear();
+    
+    for ( uint64_t i = 0; i < candidates.size() && selected.size() < count; i++ )
+    {
+        bool diverse = true;
+        
+        for ( uint64_t j = 0; j < selected.size() && diverse; j++ )
+        {
+            if ( distance(sketch, selected[j].index, sketch.getReference(candidates[i].index)) < candidates[i].distance )
+            {
+                diverse = false;
+            }
+        }
+        
+        if ( diverse )
+        {
+            selected.push_back(candidates[i]);
+        }
+        else
+        {
+            pruned.push_back(candidates[i]);
+        }
+    }
+    
+    for ( uint64_t i = 0; i < pruned.size() && selected.size() < count; i++ )
+    {
+        selected.push_back(pruned[i]);
+    }
+}
+
+HnswIndex::InsertOutput * hnswInsert(HnswIndex::InsertInput * input)
+{
+    const HnswIndex & index = input->index;
+    const Sketch & sketch = input->sketch;
+    const Sketch::Reference & query = sketch.getReference(input->node);
+    int level = index.levels[input->node];
+    
+    HnswIndex::InsertOutput * output = new HnswIndex::InsertOutput();
+    
+    output->node = input->node;
+    
+    vector<HnswIndex::Neighbor> nearest(1, HnswIndex::Neighbor(index.distance(sketch, index.entry, query), index.entry));
+    
+    for ( int layer = index.levelMax; layer > level; layer-- )
+    {
+        index.searchLayer(sketch, query, nearest, layer, 1);
+    }
+    
+    int layerTop = level < index.levelMax ? level : index.levelMax;
+    
+    output->neighborsByLayer.resize(layerTop + 1);
+    
+    for ( int layer = layerTop; layer >= 0; layer-- )
+    {
+        index.searchLayer(sketch, query, nearest, layer, input->breadth);
+        index.selectNeighbors(sketch, nearest, layer == 0 ? 2 * index.neighborsMax : index.neighborsMax, output->neighborsByLayer[layer]);
+    }
+    
+    return output;
+}
@@ -0,0 +1,92 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef HnswIndex_h
+#define HnswIndex_h
+
+#include "Sketch.h"
+#include <string>
+#include <vector>
+
+static const char * suffixHnswIndex = ".hnsw";
+
+static const int hnswNeighborsDefault = 16;
+static const int hnswBreadthBuildDefault = 100;
+static const int hnswBreadthSearchDefault = 64;
+
+// Hierarchical navigable small world graph over the references in a sketch,
+// for approximate nearest neighbour search by Mash distance. The index holds
+// only the graph; the sketch it was built from must be given when searching.
+//
+// Building inserts references in batches. Each batch is searched against the
+// graph built so far in parallel and then linked in, so results do not depend
+// on the thread count.
+
+class HnswIndex
+{
+public:
+    
+    struct Neighbor
+    {
+        Neighbor() {}
+        Neighbor(double distanceNew, uint64_t indexNew) : distance(distanceNew), index(indexNew) {}
+        
+        bool operator<(const Neighbor & other) const {return distance < other.distance || (distance == other.distance && index < other.index);}
+        
+        double distance;
+        uint64_t index;
+    };
+    
+    struct InsertInput
+    {
+        InsertInput(const HnswIndex & indexNew, const Sketch & sketchNew, uint64_t nodeNew, int breadthNew)
+            :
+            index(indexNew),
+            sketch(sketchNew),
+            node(nodeNew),
+            breadth(breadthNew)
+            {}
+        
+        const HnswIndex & index;
+        const Sketch & sketch;
+        uint64_t node;
+        int breadth;
+    };
+    
+    struct InsertOutput
+    {
+        uint64_t node;
+        std::vector<std::vector<Neighbor>> neighborsByLayer;
+    };
+    
+    HnswIndex() : neighborsMax(0), levelMax(-1), entry(0) {}
+    
+    uint64_t getNodeCount() const {return levels.size();}
+    void initFromSketch(const Sketch & sketch, int neighborsMaxNew, int breadth, int threads);
+    bool initFromSidecar(const std::string & sketchFile, uint64_t referenceCount);
+    void search(const Sketch & sketch, const Sketch::Reference & query, uint64_t count, int breadth, std::vector<Neighbor> & results) const;
+    bool writeToSidecar(const std::string & sketchFile) const;
+
+private:
+    
+    friend InsertOutput * hnswInsert(InsertInput * input);
+    
+    double distance(const Sketch & sketch, uint64_t node, const Sketch::Reference & query) const;
+    void link(const InsertOutput & output);
+    void searchLayer(const Sketch & sketch, const Sketch::Reference & query, std::vector<Neighbor> & nearest, int layer, int breadth) const;
+    void selectNeighbors(const Sketch & sketch, const std::vector<Neighbor> & candidates, uint64_t count, std::vector<Neighbor> & selected) const;
+    
+    int neighborsMax; // per node on upper layers; twice this on layer 0
+    int levelMax;
+    uint64_t entry;
+    std::vector<int> levels;
+    std::vector<std::vector<std::vector<uint32_t>>> links; // by node, then layer
+    std::vector<std::vector<std::vector<float>>> linkDistances; // parallel to links while building
+};
+
+HnswIndex::InsertOutput * hnswInsert(HnswIndex::InsertInput * input);
+
+#endif
@@ -0,0 +1,265 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "LshIndex.h"
+#include "hash.h"
+#include "sidecar.h"
+#include <algorithm>
+#include <math.h>
+
+using std::string;
+using std::vector;
+
+static const char * lshIndexMagic = "MASHLSH2";
+
+uint64_t LshIndex::getCandidatePairs(vector<uint64_t> & pairs) const
+{
+    // Pairs are numbered as in the lower triangle (row i holds pairs
+    // [i(i-1)/2, i(i+1)/2)) and returned sorted without duplicates. They are
+    // gathered a row at a time across bands, so duplicates from different
+    // bands are removed before they accumulate. Returns the number of buckets
+    // larger than lshBucketMax.
+    
+    static const uint64_t positionNone = ~uint64_t(0);
+    
+    vector<vector<uint64_t>> positions(bands); // of each reference in the entries of each band
+    vector<vector<uint64_t>> bucketStarts(bands); // of each entry
+    uint64_t oversized = 0;
+    
+    pairs.clear();
+    
+    for ( int band = 0; band < bands; band++ )
+    {
+        const vector<Entry> & entries = entriesByBand[band];
+        
+        positions[band].assign(referenceCount, positionNone);
+        bucketStarts[band].resize(entries.size());
+        
+        for ( uint64_t start = 0; start < entries.size(); )
+        {
+            uint64_t end = start + 1;
+            
+            while ( end < entries.size() && entries[end].key == entries[start].key )
+            {
+                end++;
+            }
+            
+            for ( uint64_t i = start; i < end; i++ )
+            {
+                positions[band][entries[i].index] = i;
+                bucketStarts[band][i] = start;
+            }
+            
+            if ( end - start > lshBucketMax )
+            {
+                oversized++;
+            }
+            
+            start = end;
+        }
+    }
+    
+    vector<uint64_t> columns;
+    
+    for ( uint64_t row = 0; row < referenceCount; row++ )
+    {
+        columns.clear();
+        
+        for ( int band = 0; band < bands; band++ )
+        {
+            uint64_t position = positions[band][row];
+            
+            if ( position == positionNone )
+            {
+                continue;
+            }
+            
+            // indices within a bucket are ascending, so the entries before
+            // this one are the earlier references
+            
+            uint64_t start = bucketStarts[band][position];
+            
+            if ( position - start > lshBucketMax )
+            {
+                start = position - lshBucketMax;
+            }
+            
+            for ( uint64_t i = start; i < position; i++ )
+            {
+                columns.push_back(entriesByBand[band][i].index);
+            }
+        }
+        
+        std::sort(columns.begin(), columns.end());
+        columns.erase(std::unique(columns.begin(), columns.end()), columns.end());
+        
+        for ( uint64_t i = 0; i < columns.size(); i++ )
+        {
+            pairs.push_back(row * (row - 1) / 2 + columns[i]);
+        }
+    }
+    
+    return oversized;
+}
+
+void LshIndex::initFromSketch(const Sketch & sketch, int bandsNew, int rowsNew)
+{
+    bands = bandsNew;
+    rows = rowsNew;
+    referenceCount = sketch.getReferenceCount();
+    
+    uint64_t bins = uint64_t(bands) * rows;
+    vector<uint64_t> minimums(bins);
+    vector<bool> filled(bins);
+    
+    entriesByBand.clear();
+    entriesByBand.resize(bands);
+    
+    for ( uint64_t i = 0; i < referenceCount; i++ )
+    {
+        const HashList & hashes = sketch.getReference(i).hashesSorted;
+        bool use64 = hashes.get64();
+        
+        for ( uint64_t j = 0; j < bins; j++ )
+        {
+            filled[j] = false;
+        }
+        
+        for ( int j = 0; j < hashes.size(); j++ )
+        {
+            uint64_t hash = use64 ? hashes.at(j).hash64 : hashes.at(j).hash32;
+            uint64_t bin = hash % bins;
+            
+            if ( ! filled[bin] || hash < minimums[bin] )
+            {
+                minimums[bin] = hash;
+                filled[bin] = true;
+            }
+        }
+        
+        for ( int band = 0; band < bands; band++ )
+        {
+            bool complete = true;
+            
+            for ( int row = 0; row < rows; row++ )
+            {
+                if ( ! filled[band * rows + row] )
+                {
+                    complete = false;
+                }
+            }
+            
+            if ( complete )
+            {
+                Entry entry;
+                
+                entry.key = getHash((const char *)(minimums.data() + band * rows), rows * sizeof(uint64_t), band, true).hash64;
+                entry.index = i;
+                
+                entriesByBand[band].push_back(entry);
+            }
+        }
+    }
+    
+    for ( int band = 0; band < bands; band++ )
+    {
+        std::sort(entriesByBand[band].begin(), entriesByBand[band].end());
+    }
+}
+
+bool LshIndex::initFromSidecar(const string & sketchFile, uint64_t referenceCountNew)
+{
+    FILE * stream = openSidecarForReading(sketchFile, suffixLshIndex, lshIndexMagic, referenceCountNew);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    int32_t parameters[2];
+    bool success = fread(parameters, sizeof(int32_t), 2, stream) == 2 && parameters[0] > 0 && parameters[1] > 0;
+    
+    if ( success )
+    {
+        bands = parameters[0];
+        rows = parameters[1];
+        referenceCount = referenceCountNew;
+        entriesByBand.clear();
+        entriesByBand.resize(bands);
+    }
+    
+    for ( int band = 0; success && band < bands; band++ )
+    {
+        uint64_t count;
+        
+        success = fread(&count, sizeof(uint64_t), 1, stream) == 1 && count <= referenceCount;
+        
+        if ( success )
+        {
+            entriesByBand[band].resize(count);
+            success = fread(entriesByBand[band].data(), sizeof(Entry), count, stream) == count;
+        }
+        
+        for ( uint64_t i = 0; success && i < count; i++ )
+        {
+            success = entriesByBand[band][i].index < referenceCount;
+        }
+    }
+    
+    fclose(stream);
+    
+    if ( ! success )
+    {
+        bands = 0;
+        entriesByBand.clear();
+    }
+    
+    return success;
+}
+
+bool LshIndex::writeToSidecar(const string & sketchFile) const
+{
+    FILE * stream = openSidecarForWriting(sketchFile, suffixLshIndex, lshIndexMagic, referenceCount);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    int32_t parameters[2] = {bands, rows};
+    
+    bool success = fwrite(parameters, sizeof(int32_t), 2, stream) == 2;
+    
+    for ( int band = 0; success && band < bands; band++ )
+    {
+        uint64_t count = entriesByBand[band].size();
+        
+        success =
+            fwrite(&count, sizeof(uint64_t), 1, stream) == 1 &&
+            fwrite(entriesByBand[band].data(), sizeof(Entry), count, stream) == count;
+    }
+    
+    return fclose(stream) == 0 && success;
+}
+
+int LshIndex::chooseRows(double jaccard, int bands)
+{
+    // the most selective band width that still finds pairs at the threshold
+    
+    int rows = 1;
+    
+    while ( rows < lshRowsMax && collisionChance(jaccard, bands, rows + 1) >= lshRecallTarget )
+    {
+        rows++;
+    }
+    
+    return rows;
+}
+
+double LshIndex::collisionChance(double jaccard, int bands, int rows)
+{
+    return 1. - pow(1. - pow(jaccard, rows), bands);
+}
@@ -0,0 +1,67 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef LshIndex_h
+#define LshIndex_h
+
+#include "Sketch.h"
+#include <string>
+#include <vector>
+
+static const char * suffixLshIndex = ".lsh";
+
+static const int lshBandsDefault = 32;
+static const int lshRowsMax = 16;
+static const double lshRecallTarget = 0.99;
+static const uint64_t lshBucketMax = 4096; // earlier references each is paired with in a bucket
+
+// Locality-sensitive hashing index of the references in a sketch, for finding
+// similar pairs without comparing all of them. Each reference's hashes are
+// spread over bands * rows bins (one permutation hashing), and the minima of
+// each band's rows are hashed to a key. References sharing a key in any band
+// are candidates; a pair with Jaccard J collides with probability
+// 1 - (1 - J^rows)^bands. Bands with empty bins are left out, so very small
+// sketches may be missed.
+//
+// A bucket of n references yields n^2/2 pairs, so in buckets of more than
+// lshBucketMax (e.g. from large clusters of near-identical references), each
+// reference is only paired with the lshBucketMax before it in the bucket. The
+// bucket stays connected through those pairs, but others in it are missed
+// unless another band finds them.
+
+class LshIndex
+{
+public:
+    
+    struct Entry
+    {
+        uint64_t key;
+        uint64_t index;
+        
+        bool operator<(const Entry & other) const {return key < other.key || (key == other.key && index < other.index);}
+    };
+    
+    LshIndex() : bands(0), rows(0), referenceCount(0) {}
+    
+    int getBands() const {return bands;}
+    uint64_t getCandidatePairs(std::vector<uint64_t> & pairs) const;
+    int getRows() const {return rows;}
+    void initFromSketch(const Sketch & sketch, int bandsNew, int rowsNew);
+    bool initFromSidecar(const std::string & sketchFile, uint64_t referenceCountNew);
+    bool writeToSidecar(const std::string & sketchFile) const;
+    
+    static int chooseRows(double jaccard, int bands);
+    static double collisionChance(double jaccard, int bands, int rows);
+
+private:
+    
+    int bands;
+    int rows;
+    uint64_t referenceCount;
+    std::vector<std::vector<Entry>> entriesByBand; // sorted by key
+};
+
+#endif
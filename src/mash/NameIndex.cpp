@@ -0,0 +1,92 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "NameIndex.h"
+#include "MurmurHash3.h"
+#include "sidecar.h"
+#include <algorithm>
+
+using std::string;
+using std::vector;
+
+static const char * nameIndexMagic = "MASHNID2";
+
+void NameIndex::find(const string & name, vector<uint64_t> & indices) const
+{
+    Entry low;
+    
+    low.hash = hashName(name);
+    low.index = 0;
+    
+    for ( vector<Entry>::const_iterator i = std::lower_bound(entries.begin(), entries.end(), low); i != entries.end() && i->hash == low.hash; i++ )
+    {
+        indices.push_back(i->index);
+    }
+}
+
+bool NameIndex::initFromSidecar(const string & sketchFile, uint64_t referenceCount)
+{
+    FILE * stream = openSidecarForReading(sketchFile, suffixNameIndex, nameIndexMagic, referenceCount);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    entries.resize(referenceCount);
+    
+    bool success = fread(entries.data(), sizeof(Entry), entries.size(), stream) == entries.size();
+    
+    for ( uint64_t i = 0; success && i < entries.size(); i++ )
+    {
+        success = entries[i].index < referenceCount && (i == 0 || ! (entries[i] < entries[i - 1]));
+    }
+    
+    fclose(stream);
+    
+    if ( ! success )
+    {
+        entries.clear();
+    }
+    
+    return success;
+}
+
+void NameIndex::initFromNames(const vector<string> & names)
+{
+    entries.resize(names.size());
+    
+    for ( uint64_t i = 0; i < names.size(); i++ )
+    {
+        entries[i].hash = hashName(names[i]);
+        entries[i].index = i;
+    }
+    
+    std::sort(entries.begin(), entries.end());
+}
+
+bool NameIndex::writeToSidecar(const string & sketchFile) const
+{
+    FILE * stream = openSidecarForWriting(sketchFile, suffixNameIndex, nameIndexMagic, entries.size());
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    bool success = fwrite(entries.data(), sizeof(Entry), entries.size(), stream) == entries.size();
+    
+    return fclose(stream) == 0 && success;
+}
+
+uint64_t NameIndex::hashName(const string & name)
+{
+    uint64_t hash[2];
+    
+    MurmurHash3_x64_128(name.c_str(), name.length(), 0, hash);
+    
+    return hash[0];
+}
@@ -0,0 +1,45 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef NameIndex_h
+#define NameIndex_h
+
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+static const char * suffixNameIndex = ".nid";
+
+// Index from reference names to their positions in a sketch file, so named
+// references can be found without reading every name. Names are stored as
+// 64-bit hashes, so lookups give candidates that must be checked against the
+// names of the references they point to.
+
+class NameIndex
+{
+public:
+    
+    struct Entry
+    {
+        uint64_t hash;
+        uint64_t index;
+        
+        bool operator<(const Entry & other) const {return hash < other.hash || (hash == other.hash && index < other.index);}
+    };
+    
+    void find(const std::string & name, std::vector<uint64_t> & indices) const; // appends candidates
+    bool initFromSidecar(const std::string & sketchFile, uint64_t referenceCount);
+    void initFromNames(const std::vector<std::string> & names);
+    bool writeToSidecar(const std::string & sketchFile) const;
+    
+    static uint64_t hashName(const std::string & name);
+
+private:
+    
+    std::vector<Entry> entries; // sorted
+};
+
+#endif
@@ -18,13 +18,19 @@
 #include <deque>
 #include <set>
 #include "Command.h" // TEMP for column printing
+#include "cache.h"
+#include "columnar.h"
+#include "packing.h"
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <capnp/message.h>
 #include <capnp/serialize.h>
+#include <capnp/any.h>
 #include <sys/mman.h>
 #include <math.h>
 #include <list>
 #include <string.h>
+#include <algorithm>
 
 #define SET_BINARY_MODE(file)
 #define CHUNK 16384
@@ -32,8 +38,36 @@ KSEQ_INIT(gzFile, gzread)
 
 using namespace std;
 
+static const uint64_t decodeBatchSize = 4096; // references per decoding task
+static const uint64_t indexBatchSize = 65536; // references per shard assignment task
+static const uint64_t indexShardCount = 64;
+static const uint64_t headerReadAhead = 64; // sketch files whose headers are read ahead of loading
+static const uint64_t mappedSizeMin = 1 << 20; // smaller sketch files are copied and unmapped once loaded
+
 typedef map < Sketch::hash_t, vector<Sketch::PositionHash> > LociByHash_map;
 
+Sketch::Mapping::~Mapping()
+{
+    munmap(data, size);
+}
+
+static capnp::ReaderOptions getCapnpReaderOptions()
+{
+    capnp::ReaderOptions readerOptions;
+    
+    readerOptions.traversalLimitInWords = 1000000000000;
+    readerOptions.nestingLimit = 1000000;
+    
+    return readerOptions;
+}
+
+static capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader getReferencesReader(capnp::MinHash::Reader reader)
+{
+    capnp::MinHash::ReferenceList::Reader referenceListReader = reader.getReferenceList().getReferences().size() ? reader.getReferenceList() : reader.getReferenceListOld();
+    
+    return referenceListReader.getReferences();
+}
+
 void Sketch::getAlphabetAsString(string & alphabet) const
 {
 	for ( int i = 0; i < 256; i++ )
@@ -45,9 +79,21 @@ void Sketch::getAlphabetAsString(string & alphabet) const
 	}
 }
 
+int Sketch::getHashCount() const
+{
+    int count = 0;
+    
+    for ( uint64_t i = 0; i < lociByHash.size(); i++ )
+    {
+        count += lociByHash[i].size();
+    }
+    
+    return count;
+}
+
 const vector<Sketch::Locus> & Sketch::getLociByHash(Sketch::hash_t hash) const
 {
-    return lociByHash.at(hash);
+    return lociByHash.at(hash % indexShardCount).at(hash);
 }
 
 int Sketch::getMinKmerSize(uint64_t reference) const
@@ -83,9 +129,11 @@ void Sketch::getReferenceHistogram(uint64_t index, map<uint32_t, uint64_t> & his
 
 uint64_t Sketch::getReferenceIndex(string id) const
 {
-    if ( referenceIndecesById.count(id) == 1 )
+    const unordered_map<string, int> & shard = referenceIndecesById.at(std::hash<string>()(id) % indexShardCount);
+    
+    if ( shard.count(id) == 1 )
     {
-        return referenceIndecesById.at(id);
+        return shard.at(id);
     }
     else
     {
@@ -93,94 +141,84 @@ uint64_t Sketch::getReferenceIndex(string id) const
     }
 }
 
+bool Sketch::hasLociByHash(hash_t hash) const
+{
+    return lociByHash.size() != 0 && lociByHash[hash % indexShardCount].count(hash);
+}
+
 void Sketch::initFromReads(const vector<string> & files, const Parameters & parametersNew)
 {
     parameters = parametersNew;
-    
-	useThreadOutput(sketchFile(new SketchInput(files, 0, 0, "", "", parameters)));
 	
+	useThreadOutput(sketchFile(new SketchInput(files, 0, 0, "", "", parameters)));
+    
     createIndex();
 }
 
 int Sketch::initFromFiles(const vector<string> & files, const Parameters & parametersNew, int verbosity, bool enforceParameters, bool contain)
 {
     parameters = parametersNew;
-    
+	
 	ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> threadPool(0, parameters.parallelism);
 	
+	// Sketch files are mapped once, by a separate pool that reads their
+	// headers a bounded number of files ahead; the mappings are then checked
+	// here in order and handed to the loads.
+	//
+	ThreadPool<Sketch::HeaderInput, Sketch::HeaderOutput> headerPool(readSketchHeader, parameters.parallelism);
+	int headerNext = 0;
+	bool counts = false;
+    
     for ( int i = 0; i < files.size(); i++ )
     {
         bool isSketch = hasSuffix(files[i], parameters.windowed ? suffixSketchWindowed : suffixSketch);
         
         if ( isSketch )
         {
-			// init header to check params
-			//
-			Sketch sketchTest;
-			sketchTest.initParametersFromCapnp(files[i].c_str());
-			
+            for ( ; headerNext < files.size() && headerNext < i + headerReadAhead; headerNext++ )
+            {
+                if ( hasSuffix(files[headerNext], parameters.windowed ? suffixSketchWindowed : suffixSketch) )
+                {
+                    headerPool.runWhenThreadAvailable(new HeaderInput(files[headerNext]));
+                }
+            }
+            
+            HeaderOutput * header = headerPool.popOutputWhenAvailable();
+        	
         	if ( i == 0 && ! enforceParameters )
         	{
-        		initParametersFromCapnp(files[i].c_str());
+        		initParametersFromMapping(*header->mapping, files[i].c_str());
         	}
-        	
-            string alphabet;
-            string alphabetTest;
-            
-            getAlphabetAsString(alphabet);
-            sketchTest.getAlphabetAsString(alphabetTest);
             
-            if ( alphabet != alphabetTest )
-            {
-            	cerr << "\nWARNING: The sketch file " << files[i] << " has different alphabet (" << alphabetTest << ") than the current alphabet (" << alphabet << "). This file will be skipped." << endl << endl;
-            	continue;
-            }
-			
-            if ( sketchTest.getHashSeed() != parameters.seed )
+            if ( ! isCompatible(*header->sketch, files[i], contain) )
             {
-				cerr << "\nWARNING: The sketch " << files[i] << " has a seed size (" << sketchTest.getHashSeed() << ") that does not match the current seed (" << parameters.seed << "). This file will be skipped." << endl << endl;
-				continue;
-            }
-			if ( sketchTest.getKmerSize() != parameters.kmerSize )
-			{
-				cerr << "\nWARNING: The sketch " << files[i] << " has a kmer size (" << sketchTest.getKmerSize() << ") that does not match the current kmer size (" << parameters.kmerSize << "). This file will be skipped." << endl << endl;
-				continue;
-			}
-			
-            if ( ! contain && sketchTest.getMinHashesPerWindow() < parameters.minHashesPerWindow )
-            {
-                cerr << "\nWARNING: The sketch file " << files[i] << " has a target sketch size (" << sketchTest.getMinHashesPerWindow() << ") that is smaller than the current sketch size (" << parameters.minHashesPerWindow << "). This file will be skipped." << endl << endl;
+                delete header;
                 continue;
             }
             
-			if ( sketchTest.getNoncanonical() != parameters.noncanonical )
-			{
-				cerr << "\nWARNING: The sketch file " << files[i] << " is " << (sketchTest.getNoncanonical() ? "noncanonical" : "canonical") << ", which is incompatible with the current setting. This file will be skipped." << endl << endl;
-				continue;
-			}
-            
-            if ( sketchTest.getMinHashesPerWindow() > parameters.minHashesPerWindow )
-            {
-                cerr << "\nWARNING: The sketch file " << files[i] << " has a target sketch size (" << sketchTest.getMinHashesPerWindow() << ") that is larger than the current sketch size (" << parameters.minHashesPerWindow << "). Its sketches will be reduced." << endl << endl;
-            }
-            
-            // init fully
+            // init fully; files are loaded by separate threads, so each splits
+            // decoding among only its share of them
             //
             vector<string> file;
             file.push_back(files[i]);
-			threadPool.runWhenThreadAvailable(new SketchInput(file, 0, 0, "", "", parameters), loadCapnp);
+            Parameters parametersLoad = parameters;
+            parametersLoad.parallelism = max(1, parameters.parallelism / int(files.size()));
+            SketchInput * input = new SketchInput(file, 0, 0, "", "", parametersLoad);
+            input->mapping = header->mapping;
+            delete header;
+			threadPool.runWhenThreadAvailable(input, loadCapnp);
         }
         else
 		{
 			FILE * inStream;
-		
+			
 			if ( files[i] == "-" )
 			{
 				if ( verbosity > 0 )
 				{
 					cerr << "Sketching from stdin..." << endl;
 				}
-			
+				
 				inStream = stdin;
 			}
 			else
@@ -189,16 +227,16 @@ int Sketch::initFromFiles(const vector<string> & files, const Parameters & param
 				{
 					cerr << "Sketching " << files[i] << "..." << endl;
 				}
-			
+				
 				inStream = fopen(files[i].c_str(), "r");
-			
+				
 				if ( inStream == NULL )
 				{
 					cerr << "ERROR: could not open " << files[i] << " for reading." << endl;
 					exit(1);
 				}
 			}
-		
+			
 			if ( parameters.concatenated )
 			{
 				if ( files[i] != "-" )
@@ -208,7 +246,12 @@ int Sketch::initFromFiles(const vector<string> & files, const Parameters & param
 				
 				vector<string> file;
 				file.push_back(files[i]);
-				threadPool.runWhenThreadAvailable(new SketchInput(file, 0, 0, "", "", parameters), sketchFile);
+				
+				// sketches of read sets also depend on coverage options, so
+				// they are not cached
+				//
+				bool cached = parameters.cache != "" && files[i] != "-" && ! parameters.reads;
+				threadPool.runWhenThreadAvailable(new SketchInput(file, 0, 0, "", "", parameters), cached ? sketchFileCached : sketchFile);
 			}
 			else
 			{
@@ -217,22 +260,36 @@ int Sketch::initFromFiles(const vector<string> & files, const Parameters & param
 					cerr << "\nERROR: reading " << files[i] << "." << endl;
 					exit(1);
 				}
-			
+				
 				fclose(inStream);
 			}
 		}
-			
+		
 		while ( threadPool.outputAvailable() )
 		{
-			useThreadOutput(threadPool.popOutputWhenAvailable());
+			SketchOutput * output = threadPool.popOutputWhenAvailable();
+			counts = counts || output->counts;
+			useThreadOutput(output);
 		}
     }
-    
+	
 	while ( threadPool.running() )
 	{
-		useThreadOutput(threadPool.popOutputWhenAvailable());
+		SketchOutput * output = threadPool.popOutputWhenAvailable();
+		counts = counts || output->counts;
+		useThreadOutput(output);
 	}
 	
+	// Sketch files only keep hash counts of read sets (as for columnar ones;
+	// see getColumnarParameters), so this keeps loaded counts when written
+	// again, e.g. by paste, compact or split. It is set once all are loaded,
+	// since it would change how later sequence files are sketched.
+	//
+	if ( counts )
+	{
+		parameters.reads = true;
+	}
+    
     /*
     printf("\nCombined hash table:\n\n");
     
@@ -252,42 +309,86 @@ int Sketch::initFromFiles(const vector<string> & files, const Parameters & param
     return 0;
 }
 
-uint64_t Sketch::initParametersFromCapnp(const char * file)
+int Sketch::initFromCapnpReferences(const char * file, const vector<uint64_t> & indices)
 {
-    int fd = open(file, O_RDONLY);
+    return initFromMapping(mapSketchFile(file), file, &indices);
+}
+
+int Sketch::initFromMapping(std::shared_ptr<Mapping> mapping, const char * file, const vector<uint64_t> * indices)
+{
+    // Loads the references at the given indices (all, if none are given) of
+    // a sketch file that has already been mapped, e.g. to check it first.
     
-    if ( fd < 0 )
+    initParametersFromMapping(*mapping, file);
+    
+    SketchOutput * output = loadCapnpReferences(file, parameters, indices, mapping);
+    
+    if ( output == 0 )
     {
-        cerr << "ERROR: could not open \"" << file << "\" for reading." << endl;
-        exit(1);
+        return 1;
     }
     
-    struct stat fileInfo;
-    
-    if ( stat(file, &fileInfo) == -1 )
+    if ( output->counts )
     {
-        cerr << "ERROR: could not get file stats for \"" << file << "\"." << endl;
-        exit(1);
+        parameters.reads = true; // as for initFromFiles
     }
     
-    void * data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    useThreadOutput(output);
+    createIndex();
+    
+    return 0;
+}
+
+void Sketch::initFromReferences(const Sketch & sketch, const vector<uint64_t> & indices)
+{
+    // Hashes that point into mappings of the other sketch are not copied, so
+    // the mappings are shared.
+    
+    parameters = sketch.parameters;
+    mappings = sketch.mappings;
+    references.resize(indices.size());
     
-    if (data == MAP_FAILED)
+    for ( uint64_t i = 0; i < indices.size(); i++ )
     {
-        uint64_t fileSize = fileInfo.st_size;
-        std::cerr << "Error: could not memory-map file " << file << " of size " << fileSize;
-        std::cerr << std::endl;
-        exit(1);
+        references[i] = sketch.references.at(indices[i]);
+        
+        if ( indices[i] < sketch.positionHashesByReference.size() )
+        {
+            positionHashesByReference.resize(indices.size());
+            positionHashesByReference[i] = sketch.positionHashesByReference[indices[i]];
+        }
     }
+    
+    createIndex();
+}
 
-    capnp::ReaderOptions readerOptions;
+uint64_t Sketch::initParametersFromCapnp(const char * file)
+{
+    // the mapping is released on return
     
-    readerOptions.traversalLimitInWords = 1000000000000;
-    readerOptions.nestingLimit = 1000000;
+    return initParametersFromMapping(*mapSketchFile(file), file);
+}
+
+uint64_t Sketch::initParametersFromMapping(const Mapping & mapping, const char * file)
+{
+    if ( isColumnarSketch(mapping) )
+    {
+        return getColumnarParameters(mapping, file, parameters);
+    }
+    
+    // parameters are taken from the first segment; the rest were checked
+    // against it when appended
+    
+    vector<Segment> segments;
     
-    //capnp::StreamFdMessageReader * message = new capnp::StreamFdMessageReader(fd, readerOptions);
-    capnp::FlatArrayMessageReader * message = new capnp::FlatArrayMessageReader(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(data), fileInfo.st_size / sizeof(capnp::word)), readerOptions);
-    capnp::MinHash::Reader reader = message->getRoot<capnp::MinHash>();
+    if ( ! getCapnpSegments(mapping.data, mapping.size, segments) )
+    {
+        cerr << "ERROR: \"" << file << "\" is not a valid sketch file." << endl;
+        exit(1);
+    }
+    
+    capnp::FlatArrayMessageReader message(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(mapping.data), segments[0].size / sizeof(capnp::word)), getCapnpReaderOptions());
+    capnp::MinHash::Reader reader = message.getRoot<capnp::MinHash>();
     
     parameters.kmerSize = reader.getKmerSize();
     parameters.error = reader.getError();
@@ -296,11 +397,6 @@ uint64_t Sketch::initParametersFromCapnp(const char * file)
     parameters.concatenated = reader.getConcatenated();
     parameters.noncanonical = reader.getNoncanonical();
    	parameters.preserveCase = reader.getPreserveCase();
-
-    capnp::MinHash::ReferenceList::Reader referenceListReader = reader.getReferenceList().getReferences().size() ? reader.getReferenceList() : reader.getReferenceListOld();
-    capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader = referenceListReader.getReferences();
-    uint64_t referenceCount = referencesReader.size();
-    
    	parameters.seed = reader.getHashSeed();
     
     if ( reader.hasAlphabet() )
@@ -311,22 +407,67 @@ uint64_t Sketch::initParametersFromCapnp(const char * file)
     {
     	setAlphabetFromString(parameters, alphabetNucleotide);
     }
-	close(fd);
 	
-	try
+	vector<uint64_t> live;
+	
+	if ( getLiveReferences(segments, live) )
 	{
-		delete message;
+		return live.size();
 	}
-	catch (exception e) {}
 	
-	return referenceCount;
+	return segments.back().referenceStart + segments.back().referenceCount;
+}
+
+bool Sketch::isCompatible(const Sketch & sketchTest, const string & file, bool contain) const
+{
+    string alphabet;
+    string alphabetTest;
+    
+    getAlphabetAsString(alphabet);
+    sketchTest.getAlphabetAsString(alphabetTest);
+    
+    if ( alphabet != alphabetTest )
+    {
+        cerr << "\nWARNING: The sketch file " << file << " has different alphabet (" << alphabetTest << ") than the current alphabet (" << alphabet << "). This file will be skipped." << endl << endl;
+        return false;
+    }
+    
+    if ( sketchTest.getHashSeed() != parameters.seed )
+    {
+        cerr << "\nWARNING: The sketch " << file << " has a seed size (" << sketchTest.getHashSeed() << ") that does not match the current seed (" << parameters.seed << "). This file will be skipped." << endl << endl;
+        return false;
+    }
+    if ( sketchTest.getKmerSize() != parameters.kmerSize )
+    {
+        cerr << "\nWARNING: The sketch " << file << " has a kmer size (" << sketchTest.getKmerSize() << ") that does not match the current kmer size (" << parameters.kmerSize << "). This file will be skipped." << endl << endl;
+        return false;
+    }
+    
+    if ( ! contain && sketchTest.getMinHashesPerWindow() < parameters.minHashesPerWindow )
+    {
+        cerr << "\nWARNING: The sketch file " << file << " has a target sketch size (" << sketchTest.getMinHashesPerWindow() << ") that is smaller than the current sketch size (" << parameters.minHashesPerWindow << "). This file will be skipped." << endl << endl;
+        return false;
+    }
+    
+    if ( sketchTest.getNoncanonical() != parameters.noncanonical )
+    {
+        cerr << "\nWARNING: The sketch file " << file << " is " << (sketchTest.getNoncanonical() ? "noncanonical" : "canonical") << ", which is incompatible with the current setting. This file will be skipped." << endl << endl;
+        return false;
+    }
+    
+    if ( sketchTest.getMinHashesPerWindow() > parameters.minHashesPerWindow )
+    {
+        cerr << "\nWARNING: The sketch file " << file << " has a target sketch size (" << sketchTest.getMinHashesPerWindow() << ") that is larger than the current sketch size (" << parameters.minHashesPerWindow << "). Its sketches will be reduced." << endl << endl;
+    }
+    
+    return true;
 }
 
 bool Sketch::sketchFileBySequence(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool)
 {
 	gzFile fp = gzdopen(fileno(file), "r");
 	kseq_t *seq = kseq_init(fp);
-	
+    
     int l;
     int count = 0;
 	bool skipped = false;
@@ -356,7 +497,7 @@ bool Sketch::sketchFileBySequence(FILE * file, ThreadPool<Sketch::SketchInput, S
 		{
 			useThreadOutput(threadPool->popOutputWhenAvailable());
 		}
-    	
+		
 		count++;
 	}
 	
@@ -368,11 +509,59 @@ bool Sketch::sketchFileBySequence(FILE * file, ThreadPool<Sketch::SketchInput, S
 	return true;
 }
 
+int Sketch::finishSegmentOutput()
+{
+    // The last segment is written even if empty, so the file is valid when
+    // there were no references.
+    
+    if ( segmentFile.empty() || (segmentStart == references.size() && segmentStart != 0) )
+    {
+        return 0;
+    }
+    
+    return writeSegment();
+}
+
+void Sketch::setSegmentOutput(const string & fileNew, uint64_t segmentSizeNew)
+{
+    segmentFile = fileNew;
+    segmentSize = segmentSizeNew;
+    segmentStart = references.size();
+    
+    // start with an empty file, so segments can be appended
+    
+    int fd = open(segmentFile.c_str(), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    
+    if ( fd < 0 )
+    {
+        cerr << "ERROR: could not open " << segmentFile << " for writing.\n";
+        exit(1);
+    }
+    
+    close(fd);
+}
+
 void Sketch::useThreadOutput(SketchOutput * output)
 {
-	references.insert(references.end(), output->references.begin(), output->references.end());
+	if ( output->mapping )
+	{
+		mappings.push_back(output->mapping);
+	}
+	
+	references.insert(references.end(), make_move_iterator(output->references.begin()), make_move_iterator(output->references.end()));
 	positionHashesByReference.insert(positionHashesByReference.end(), output->positionHashesByReference.begin(), output->positionHashesByReference.end());
 	delete output;
+	
+	if ( ! segmentFile.empty() && references.size() - segmentStart >= segmentSize )
+	{
+		// the references would otherwise be kept (and written again) with
+		// the next segment, so a failed write ends the run
+		
+		if ( writeSegment() )
+		{
+			exit(1);
+		}
+	}
 }
 
 bool Sketch::writeToFile() const
@@ -380,9 +569,14 @@ bool Sketch::writeToFile() const
     return writeToCapnp(file.c_str()) == 0;
 }
 
-int Sketch::writeToCapnp(const char * file) const
+int Sketch::writeToCapnp(const char * file, bool packed, bool append, uint64_t start, const vector<string> * removed) const
 {
-    int fd = open(file, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    // Appending adds a segment to an existing sketch file, which must have
+    // compatible parameters. References before start are not written. The
+    // segment can also remove references of the file by name (see
+    // getLiveReferences).
+    
+    int fd = open(file, O_CREAT | O_WRONLY | (append ? O_APPEND : O_TRUNC), 0644);
     
     if ( fd < 0 )
     {
@@ -395,11 +589,11 @@ int Sketch::writeToCapnp(const char * file) const
     
     capnp::MinHash::ReferenceList::Builder referenceListBuilder = (parameters.seed == 42 ? builder.initReferenceListOld() : builder.initReferenceList());
     
-    capnp::List<capnp::MinHash::ReferenceList::Reference>::Builder referencesBuilder = referenceListBuilder.initReferences(references.size());
+    capnp::List<capnp::MinHash::ReferenceList::Reference>::Builder referencesBuilder = referenceListBuilder.initReferences(references.size() - start);
     
-    for ( uint64_t i = 0; i < references.size(); i++ )
+    for ( uint64_t i = start; i < references.size(); i++ )
     {
-        capnp::MinHash::ReferenceList::Reference::Builder referenceBuilder = referencesBuilder[i];
+        capnp::MinHash::ReferenceList::Reference::Builder referenceBuilder = referencesBuilder[i - start];
         
         referenceBuilder.setName(references[i].name);
         referenceBuilder.setComment(references[i].comment);
@@ -409,10 +603,23 @@ int Sketch::writeToCapnp(const char * file) const
         {
             const HashList & hashes = references[i].hashesSorted;
             
-            if ( parameters.use64 )
+            if ( packed )
+            {
+                vector<uint64_t> values(hashes.size());
+                vector<uint8_t> bytes;
+                
+                for ( uint64_t j = 0; j != hashes.size(); j++ )
+                {
+                    values[j] = parameters.use64 ? hashes.at(j).hash64 : hashes.at(j).hash32;
+                }
+                
+                packIntegers(values, true, bytes);
+                referenceBuilder.setHashesPacked(kj::arrayPtr(bytes.data(), bytes.size()));
+            }
+            else if ( parameters.use64 )
             {
                 capnp::List<uint64_t>::Builder hashes64Builder = referenceBuilder.initHashes64(hashes.size());
-            
+                
                 for ( uint64_t j = 0; j != hashes.size(); j++ )
                 {
                     hashes64Builder.set(j, hashes.at(j).hash64);
@@ -421,19 +628,27 @@ int Sketch::writeToCapnp(const char * file) const
             else
             {
                 capnp::List<uint32_t>::Builder hashes32Builder = referenceBuilder.initHashes32(hashes.size());
-            
+                
                 for ( uint64_t j = 0; j != hashes.size(); j++ )
                 {
                     hashes32Builder.set(j, hashes.at(j).hash32);
                 }
             }
             
-            if ( references[i].counts.size() > 0 && parameters.reads )
+            if ( references[i].counts.size() > 0 && parameters.reads && packed )
+            {
+                const vector<uint32_t> & counts = references[i].counts;
+                vector<uint8_t> bytes;
+                
+                packIntegers(vector<uint64_t>(counts.begin(), counts.end()), false, bytes);
+                referenceBuilder.setCounts32Packed(kj::arrayPtr(bytes.data(), bytes.size()));
+            }
+            else if ( references[i].counts.size() > 0 && parameters.reads )
             {
             	const vector<uint32_t> & counts = references[i].counts;
-            	
-                capnp::List<uint32_t>::Builder countsBuilder = referenceBuilder.initCounts32(counts.size());
                 
+                capnp::List<uint32_t>::Builder countsBuilder = referenceBuilder.initCounts32(counts.size());
+				
 				for ( uint64_t j = 0; j != counts.size(); j++ )
 				{
 					countsBuilder.set(j, counts.at(j));
@@ -444,7 +659,7 @@ int Sketch::writeToCapnp(const char * file) const
     
     int locusCount = 0;
     
-    for ( int i = 0; i < positionHashesByReference.size(); i++ )
+    for ( int i = start; i < positionHashesByReference.size(); i++ )
     {
         locusCount += positionHashesByReference.at(i).size();
     }
@@ -454,14 +669,14 @@ int Sketch::writeToCapnp(const char * file) const
     
     int locusIndex = 0;
     
-    for ( int i = 0; i < positionHashesByReference.size(); i++ )
+    for ( int i = start; i < positionHashesByReference.size(); i++ )
     {
         for ( int j = 0; j < positionHashesByReference.at(i).size(); j++ )
         {
             capnp::MinHash::LocusList::Locus::Builder locusBuilder = lociBuilder[locusIndex];
             locusIndex++;
             
-            locusBuilder.setSequence(i);
+            locusBuilder.setSequence(i - start);
             locusBuilder.setPosition(positionHashesByReference.at(i).at(j).position);
             locusBuilder.setHash64(positionHashesByReference.at(i).at(j).hash);
         }
@@ -480,32 +695,175 @@ int Sketch::writeToCapnp(const char * file) const
     getAlphabetAsString(alphabet);
     builder.setAlphabet(alphabet);
     
-    writeMessageToFd(fd, message);
-    close(fd);
+    if ( removed != 0 )
+    {
+        capnp::List<capnp::Text>::Builder removedBuilder = builder.initRemoved(removed->size());
+        
+        for ( uint64_t i = 0; i < removed->size(); i++ )
+        {
+            removedBuilder.set(i, removed->at(i).c_str());
+        }
+    }
+    
+    try
+    {
+        writeMessageToFd(fd, message);
+    }
+    catch (exception & e)
+    {
+        cerr << "ERROR: could not write to " << file << ".\n";
+        close(fd);
+        return 1;
+    }
+    
+    if ( close(fd) == -1 )
+    {
+        cerr << "ERROR: could not write to " << file << ".\n";
+        return 1;
+    }
+    
+    return 0;
+}
+
+int Sketch::writeSegment()
+{
+    // Writes the references since the last segment, then frees their hashes
+    // and loci, keeping names, comments and lengths.
+    
+    if ( writeToCapnp(segmentFile.c_str(), false, true, segmentStart) )
+    {
+        return 1;
+    }
+    
+    for ( uint64_t i = segmentStart; i < references.size(); i++ )
+    {
+        references[i].hashesSorted = HashList(parameters.use64);
+        vector<uint32_t>().swap(references[i].counts);
+        
+        if ( i < positionHashesByReference.size() )
+        {
+            vector<PositionHash>().swap(positionHashesByReference[i]);
+        }
+    }
+    
+    segmentStart = references.size();
     
     return 0;
 }
 
 void Sketch::createIndex()
 {
-    for ( int i = 0; i < references.size(); i++ )
+    // Names and loci are split into shards by hash, so each shard can be
+    // built by its own thread. Batches of references are bucketed by shard in
+    // parallel, and the buckets are joined in order, so each shard visits
+    // references in the same order as a serial build.
+    
+    vector<IndexReferences> referencesByShard(indexShardCount);
+    vector<IndexLoci> lociByShard(indexShardCount);
+    ThreadPool<IndexInput, IndexOutput> threadPool(0, parameters.parallelism);
+    
+    referenceIndecesById.clear();
+    referenceIndecesById.resize(indexShardCount);
+    lociByHash.clear();
+    lociByHash.resize(indexShardCount);
+    
+    for ( uint64_t start = 0; start < references.size(); start += indexBatchSize )
+    {
+        uint64_t end = start + indexBatchSize < references.size() ? start + indexBatchSize : references.size();
+        
+        threadPool.runWhenThreadAvailable(new IndexInput(*this, start, end), assignIndexShards);
+        
+        while ( threadPool.outputAvailable() )
+        {
+            joinIndexShards(threadPool.popOutputWhenAvailable(), referencesByShard, lociByShard);
+        }
+    }
+    
+    while ( threadPool.running() )
     {
-        referenceIndecesById[references[i].name] = i;
+        joinIndexShards(threadPool.popOutputWhenAvailable(), referencesByShard, lociByShard);
     }
     
-    for ( int i = 0; i < positionHashesByReference.size(); i++ )
+    for ( uint64_t i = 0; i < indexShardCount; i++ )
     {
-        for ( int j = 0; j < positionHashesByReference.at(i).size(); j++ )
+        threadPool.runWhenThreadAvailable(new IndexInput(*this, 0, 0, i, &referencesByShard[i], &lociByShard[i]), buildIndexShard);
+        
+        while ( threadPool.outputAvailable() )
         {
-            const PositionHash & positionHash = positionHashesByReference.at(i).at(j);
-            
-            lociByHash[positionHash.hash].push_back(Locus(i, positionHash.position));
+            delete threadPool.popOutputWhenAvailable();
         }
     }
     
+    while ( threadPool.running() )
+    {
+        delete threadPool.popOutputWhenAvailable();
+    }
+    
     kmerSpace = pow(parameters.alphabetSize, parameters.kmerSize);
 }
 
+Sketch::IndexOutput * assignIndexShards(Sketch::IndexInput * input)
+{
+    const Sketch & sketch = input->sketch;
+    Sketch::IndexOutput * output = new Sketch::IndexOutput();
+    
+    output->referencesByShard.resize(indexShardCount);
+    output->lociByShard.resize(indexShardCount);
+    
+    for ( uint64_t i = input->start; i < input->end; i++ )
+    {
+        output->referencesByShard[std::hash<string>()(sketch.references[i].name) % indexShardCount].push_back(i);
+        
+        if ( i >= sketch.positionHashesByReference.size() )
+        {
+            continue;
+        }
+        
+        for ( uint64_t j = 0; j < sketch.positionHashesByReference[i].size(); j++ )
+        {
+            const Sketch::PositionHash & positionHash = sketch.positionHashesByReference[i][j];
+            
+            output->lociByShard[positionHash.hash % indexShardCount].push_back(std::pair<Sketch::hash_t, Sketch::Locus>(positionHash.hash, Sketch::Locus(i, positionHash.position)));
+        }
+    }
+    
+    return output;
+}
+
+void joinIndexShards(Sketch::IndexOutput * output, vector<Sketch::IndexReferences> & referencesByShard, vector<Sketch::IndexLoci> & lociByShard)
+{
+    // appends a batch's buckets to each shard's and deletes the output
+    
+    for ( uint64_t i = 0; i < indexShardCount; i++ )
+    {
+        referencesByShard[i].insert(referencesByShard[i].end(), output->referencesByShard[i].begin(), output->referencesByShard[i].end());
+        lociByShard[i].insert(lociByShard[i].end(), output->lociByShard[i].begin(), output->lociByShard[i].end());
+    }
+    
+    delete output;
+}
+
+Sketch::IndexOutput * buildIndexShard(Sketch::IndexInput * input)
+{
+    Sketch & sketch = input->sketch;
+    unordered_map<string, int> & referenceIndecesById = sketch.referenceIndecesById[input->shard];
+    unordered_map<Sketch::hash_t, vector<Sketch::Locus>> & lociByHash = sketch.lociByHash[input->shard];
+    
+    for ( uint64_t i = 0; i < input->references->size(); i++ )
+    {
+        uint64_t index = input->references->at(i);
+        
+        referenceIndecesById[sketch.references[index].name] = index;
+    }
+    
+    for ( uint64_t i = 0; i < input->loci->size(); i++ )
+    {
+        lociByHash[input->loci->at(i).first].push_back(input->loci->at(i).second);
+    }
+    
+    return new Sketch::IndexOutput();
+}
+
 void addMinHashes(MinHashHeap & minHashHeap, char * seq, uint64_t length, const Sketch::Parameters & parameters)
 {
     int kmerSize = parameters.kmerSize;
@@ -560,14 +918,14 @@ void addMinHashes(MinHashHeap & minHashHeap, char * seq, uint64_t length, const
 			// skipped to end
 			break;
 		}
-            
+        
         const char *kmer_fwd = seq + i;
         const char *kmer_rev = seqRev + length - i - kmerSize;
         const char * kmer = (noncanonical || memcmp(kmer_fwd, kmer_rev, kmerSize) <= 0) ? kmer_fwd : kmer_rev;
         bool filter = false;
         
         hash_u hash = getHash(kmer, kmerSize, parameters.seed, parameters.use64);
-        
+		
 		minHashHeap.tryInsert(hash);
     }
     
@@ -577,6 +935,182 @@ void addMinHashes(MinHashHeap & minHashHeap, char * seq, uint64_t length, const
     }
 }
 
+Sketch::DecodeOutput * decodeCapnpReferences(Sketch::DecodeInput * input)
+{
+    // Each task reads through its own message reader, since readers count
+    // traversal against their limits without synchronization.
+    
+    const Sketch::Parameters & parameters = input->parameters;
+    Sketch::DecodeOutput * output = new Sketch::DecodeOutput();
+    
+    output->mapped = false;
+    output->counts = false;
+    
+    const vector<Sketch::Segment> & segments = input->segments;
+    uint64_t referenceCount = segments.back().referenceStart + segments.back().referenceCount;
+    std::unique_ptr<capnp::FlatArrayMessageReader> message;
+    capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader;
+    uint64_t segment = segments.size(); // none read yet
+    
+    for ( uint64_t i = input->start; i < input->end; i++ )
+    {
+        uint64_t index = input->indices ? input->indices->at(i) : i;
+        
+        if ( index >= referenceCount )
+        {
+            cerr << "ERROR: Reference " << index << " is out of bounds." << endl;
+            exit(1);
+        }
+        
+        if ( segment == segments.size() || index < segments[segment].referenceStart || index >= segments[segment].referenceStart + segments[segment].referenceCount )
+        {
+            segment = 0;
+            
+            while ( index >= segments[segment].referenceStart + segments[segment].referenceCount )
+            {
+                segment++;
+            }
+            
+            message.reset(new capnp::FlatArrayMessageReader(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(segments[segment].data), segments[segment].size / sizeof(capnp::word)), getCapnpReaderOptions()));
+            referencesReader = getReferencesReader(message->getRoot<capnp::MinHash>());
+        }
+        
+        capnp::MinHash::ReferenceList::Reference::Reader referenceReader = referencesReader[index - segments[segment].referenceStart];
+        
+        Sketch::Reference & reference = input->references[i];
+        
+        reference.name = referenceReader.getName();
+        reference.comment = referenceReader.getComment();
+        
+        if ( referenceReader.getLength64() )
+        {
+        	reference.length = referenceReader.getLength64();
+        }
+        else
+        {
+	        reference.length = referenceReader.getLength();
+	    }
+        
+        reference.hashesSorted.setUse64(parameters.use64);
+        uint64_t hashCount;
+        
+        // Hash lists are stored as contiguous little-endian arrays in the
+        // (unpacked) message, so on little-endian hosts references can point
+        // straight into the mapping and share pages with other processes.
+        // Packed lists must be decoded.
+        
+        if ( referenceReader.hasHashesPacked() )
+        {
+            capnp::Data::Reader packedReader = referenceReader.getHashesPacked();
+            vector<uint64_t> values;
+            
+            if ( ! unpackIntegers(packedReader.begin(), packedReader.size(), true, values) )
+            {
+                cerr << "ERROR: Packed hashes of \"" << referenceReader.getName().cStr() << "\" are corrupt." << endl;
+                exit(1);
+            }
+            
+            hashCount = values.size() < parameters.minHashesPerWindow ? values.size() : parameters.minHashesPerWindow;
+            reference.hashesSorted.resize(hashCount);
+            
+            for ( uint64_t j = 0; j < hashCount; j++ )
+            {
+                if ( parameters.use64 )
+                {
+                    reference.hashesSorted.set64(j, values[j]);
+                }
+                else
+                {
+                    reference.hashesSorted.set32(j, values[j]);
+                }
+            }
+        }
+        else if ( parameters.use64 )
+        {
+            capnp::List<uint64_t>::Reader hashesReader = referenceReader.getHashes64();
+        	
+        	hashCount = hashesReader.size();
+        	
+        	if ( hashCount > parameters.minHashesPerWindow )
+        	{
+        		hashCount = parameters.minHashesPerWindow;
+        	}
+        	
+        	if ( hostLittleEndian && input->map )
+        	{
+        		reference.hashesSorted.setMapped(capnp::AnyList::Reader(hashesReader).getRawBytes().begin(), hashCount);
+        		output->mapped = true;
+        	}
+        	else
+        	{
+	            reference.hashesSorted.resize(hashCount);
+	            
+	            for ( uint64_t j = 0; j < hashCount; j++ )
+	            {
+	                reference.hashesSorted.set64(j, hashesReader[j]);
+	            }
+	        }
+        }
+        else
+        {
+            capnp::List<uint32_t>::Reader hashesReader = referenceReader.getHashes32();
+        	
+        	hashCount = hashesReader.size();
+        	
+        	if ( hashCount > parameters.minHashesPerWindow )
+        	{
+        		hashCount = parameters.minHashesPerWindow;
+        	}
+        	
+        	if ( hostLittleEndian && input->map )
+        	{
+        		reference.hashesSorted.setMapped(capnp::AnyList::Reader(hashesReader).getRawBytes().begin(), hashCount);
+        		output->mapped = true;
+        	}
+        	else
+        	{
+	            reference.hashesSorted.resize(hashCount);
+	            
+	            for ( uint64_t j = 0; j < hashCount; j++ )
+	            {
+	                reference.hashesSorted.set32(j, hashesReader[j]);
+	            }
+	        }
+        }
+        
+        if ( referenceReader.hasCounts32Packed() )
+        {
+            capnp::Data::Reader packedReader = referenceReader.getCounts32Packed();
+            vector<uint64_t> values;
+            
+            if ( ! unpackIntegers(packedReader.begin(), packedReader.size(), false, values) || values.size() < hashCount )
+            {
+                cerr << "ERROR: Packed counts of \"" << referenceReader.getName().cStr() << "\" are corrupt." << endl;
+                exit(1);
+            }
+            
+            reference.counts.assign(values.begin(), values.begin() + hashCount);
+            output->counts = true;
+        }
+        else if ( referenceReader.hasCounts32() )
+        {
+			capnp::List<uint32_t>::Reader countsReader = referenceReader.getCounts32();
+			
+			reference.counts.resize(hashCount);
+			
+			for ( uint64_t j = 0; j < hashCount; j++ )
+			{
+				reference.counts[j] = countsReader[j];
+			}
+			
+			output->counts = true;
+        }
+    }
+    
+    
+    return output;
+}
+
 void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * seq, uint32_t length, const Sketch::Parameters & parameters, int verbosity)
 {
     // Find positions whose hashes are min-hashes in any window of a sequence
@@ -664,7 +1198,7 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
         if ( i < nextValidKmer && verbosity > 1 )
         {
             cout << "  [";
-        
+            
             for ( int j = i; j < i + kmerSize; j++ )
             {
                 cout << seq[j];
@@ -680,12 +1214,12 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
             if ( verbosity > 1 )
             {
                 cout << "   ";
-            
+                
                 for ( int j = i; j < i + kmerSize; j++ )
                 {
                     cout << seq[j]; 
                 }
-            
+                
                 cout << "   " << i << '\t' << hash << endl;
             }
             
@@ -794,7 +1328,7 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
                     
                     unique++;
                 }
-            
+                
                 candidatesByHash.erase(windowFront);
             }
         }
@@ -877,7 +1411,7 @@ void getMinHashPositions(vector<Sketch::PositionHash> & positionHashes, char * s
     if ( verbosity > 1 )
     {
         cout << endl << "Minmers:" << endl;
-    
+        
         for ( int i = 0; i < positionHashes.size(); i++ )
         {
             cout << "   " << positionHashes.at(i).position << '\t' << positionHashes.at(i).hash << endl;
@@ -901,116 +1435,376 @@ bool hasSuffix(string const & whole, string const & suffix)
 
 Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
 {
-	const char * file = input->fileNames[0].c_str();
-    int fd = open(file, O_RDONLY);
+    return loadCapnpReferences(input->fileNames[0].c_str(), input->parameters, 0, input->mapping);
+}
+
+bool getCapnpReferenceNames(const char * file, vector<string> & names)
+{
+    // Reads only the names, so hashes and the rest of each reference are not
+    // paged in.
     
-    struct stat fileInfo;
+    std::shared_ptr<Sketch::Mapping> mapping = mapSketchFile(file, false);
     
-    if ( stat(file, &fileInfo) == -1 )
+    if ( ! mapping )
     {
-        return 0;
+        return false;
     }
     
-	Sketch::SketchOutput * output = new Sketch::SketchOutput();
-	vector<Sketch::Reference> & references = output->references;
-	
-    void * data = mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-    
-    capnp::ReaderOptions readerOptions;
-    
-    readerOptions.traversalLimitInWords = 1000000000000;
-    readerOptions.nestingLimit = 1000000;
+    if ( isColumnarSketch(*mapping) )
+    {
+        return getColumnarReferenceNames(file, names);
+    }
     
-    capnp::FlatArrayMessageReader * message = new capnp::FlatArrayMessageReader(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(data), fileInfo.st_size / sizeof(capnp::word)), readerOptions);
-    capnp::MinHash::Reader reader = message->getRoot<capnp::MinHash>();
+    vector<Sketch::Segment> segments;
+    bool success = getCapnpSegments(mapping->data, mapping->size, segments);
     
-    capnp::MinHash::ReferenceList::Reader referenceListReader = reader.getReferenceList().getReferences().size() ? reader.getReferenceList() : reader.getReferenceListOld();
+    names.clear();
     
-    capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader = referenceListReader.getReferences();
+    for ( uint64_t i = 0; success && i < segments.size(); i++ )
+    {
+        capnp::FlatArrayMessageReader message(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(segments[i].data), segments[i].size / sizeof(capnp::word)), getCapnpReaderOptions());
+        capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader = getReferencesReader(message.getRoot<capnp::MinHash>());
+        
+        for ( uint64_t j = 0; j < referencesReader.size(); j++ )
+        {
+            names.push_back(referencesReader[j].getName());
+        }
+    }
     
-    references.resize(referencesReader.size());
+    vector<uint64_t> live;
     
-    for ( uint64_t i = 0; i < referencesReader.size(); i++ )
+    if ( success && getLiveReferences(segments, live) )
     {
-        capnp::MinHash::ReferenceList::Reference::Reader referenceReader = referencesReader[i];
+        vector<string> namesLive(live.size());
         
-        Sketch::Reference & reference = references[i];
+        for ( uint64_t i = 0; i < live.size(); i++ )
+        {
+            namesLive[i].swap(names[live[i]]);
+        }
         
-        reference.name = referenceReader.getName();
-        reference.comment = referenceReader.getComment();
+        names.swap(namesLive);
+    }
+    
+    return success;
+}
+
+std::shared_ptr<Sketch::Mapping> mapSketchFile(const char * file, bool exitOnError)
+{
+    int fd = open(file, O_RDONLY);
+    struct stat fileInfo;
+    
+    // The file is mapped under a shared lock, so that segments being
+    // appended (under an exclusive one; see lockSketchFile) are either whole
+    // or not seen. Later appends do not change the mapped bytes, and
+    // compaction replaces the file rather than rewriting it.
+    
+    if ( fd < 0 || flock(fd, LOCK_SH) == -1 || fstat(fd, &fileInfo) == -1 )
+    {
+        if ( fd >= 0 )
+        {
+            close(fd);
+        }
         
-        if ( referenceReader.getLength64() )
+        if ( ! exitOnError )
         {
-        	reference.length = referenceReader.getLength64();
+            return std::shared_ptr<Sketch::Mapping>();
         }
-        else
+        
+        cerr << "ERROR: could not open \"" << file << "\" for reading." << endl;
+        exit(1);
+    }
+    
+    // the mapping stays valid after the descriptor is closed (which unlocks)
+    
+    void * data = fileInfo.st_size == 0 ? MAP_FAILED : mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    close(fd);
+    
+    if ( data == MAP_FAILED )
+    {
+        if ( ! exitOnError )
         {
-	        reference.length = referenceReader.getLength();
-	    }
+            return std::shared_ptr<Sketch::Mapping>();
+        }
         
-        reference.hashesSorted.setUse64(input->parameters.use64);
-        uint64_t hashCount;
+        cerr << "ERROR: \"" << file << "\" is not a valid sketch file." << endl;
+        exit(1);
+    }
+    
+    return std::make_shared<Sketch::Mapping>(data, fileInfo.st_size);
+}
+
+int lockSketchFile(const char * file)
+{
+    // Returns a descriptor holding an exclusive lock on the file (created if
+    // needed), to be closed once done appending to or replacing it, or -1. If
+    // the file is replaced while waiting, the replacement is locked instead.
+    
+    while ( true )
+    {
+        int fd = open(file, O_CREAT | O_RDONLY, 0644);
+        struct stat fileInfo;
+        struct stat pathInfo;
         
-        if ( input->parameters.use64 )
+        if ( fd < 0 || flock(fd, LOCK_EX) == -1 || fstat(fd, &fileInfo) == -1 )
         {
-            capnp::List<uint64_t>::Reader hashesReader = referenceReader.getHashes64();
+            if ( fd >= 0 )
+            {
+                close(fd);
+            }
+            
+            return -1;
+        }
         
-        	hashCount = hashesReader.size();
-        	
-        	if ( hashCount > input->parameters.minHashesPerWindow )
-        	{
-        		hashCount = input->parameters.minHashesPerWindow;
-        	}
-        	
-            reference.hashesSorted.resize(hashCount);
+        if ( stat(file, &pathInfo) == 0 && pathInfo.st_dev == fileInfo.st_dev && pathInfo.st_ino == fileInfo.st_ino )
+        {
+            return fd;
+        }
         
-            for ( uint64_t j = 0; j < hashCount; j++ )
+        close(fd);
+    }
+}
+
+Sketch::HeaderOutput * readSketchHeader(Sketch::HeaderInput * input)
+{
+    Sketch::HeaderOutput * output = new Sketch::HeaderOutput();
+    
+    output->mapping = mapSketchFile(input->file.c_str());
+    output->sketch = std::make_shared<Sketch>();
+    output->sketch->initParametersFromMapping(*output->mapping, input->file.c_str());
+    
+    return output;
+}
+
+bool getCapnpSegments(const void * data, uint64_t size, vector<Sketch::Segment> & segments)
+{
+    // Splits a mapped sketch file into its messages, returning false if it
+    // has none or ends with a partial one.
+    
+    const capnp::word * words = reinterpret_cast<const capnp::word *>(data);
+    uint64_t wordCount = size / sizeof(capnp::word);
+    uint64_t referenceStart = 0;
+    
+    segments.clear();
+    
+    if ( size % sizeof(capnp::word) != 0 )
+    {
+        return false;
+    }
+    
+    try
+    {
+        while ( wordCount > 0 )
+        {
+            capnp::FlatArrayMessageReader message(kj::ArrayPtr<const capnp::word>(words, wordCount), getCapnpReaderOptions());
+            uint64_t segmentWords = message.getEnd() - words;
+            Sketch::Segment segment;
+            
+            if ( segmentWords == 0 || segmentWords > wordCount )
             {
-                reference.hashesSorted.set64(j, hashesReader[j]);
+                return false;
             }
+            
+            segment.data = words;
+            segment.size = segmentWords * sizeof(capnp::word);
+            segment.referenceStart = referenceStart;
+            segment.referenceCount = getReferencesReader(message.getRoot<capnp::MinHash>()).size();
+            segment.removals = message.getRoot<capnp::MinHash>().hasRemoved();
+            
+            segments.push_back(segment);
+            referenceStart += segment.referenceCount;
+            words += segmentWords;
+            wordCount -= segmentWords;
         }
-        else
+    }
+    catch (exception & e)
+    {
+        return false;
+    }
+    
+    return segments.size() > 0;
+}
+
+bool getLiveReferences(const vector<Sketch::Segment> & segments, vector<uint64_t> & live)
+{
+    // Returns false if no references were removed. Otherwise, live is set to
+    // the positions of the rest. Removals apply only to references of earlier
+    // segments, so that names can be added again, and segments are therefore
+    // read last to first.
+    
+    live.clear();
+    
+    bool removals = false;
+    
+    for ( uint64_t i = 0; i < segments.size(); i++ )
+    {
+        removals = removals || segments[i].removals;
+    }
+    
+    if ( ! removals )
+    {
+        return false;
+    }
+    
+    unordered_set<string> removed;
+    
+    for ( uint64_t i = segments.size(); i > 0; i-- )
+    {
+        const Sketch::Segment & segment = segments[i - 1];
+        capnp::FlatArrayMessageReader message(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(segment.data), segment.size / sizeof(capnp::word)), getCapnpReaderOptions());
+        capnp::MinHash::Reader reader = message.getRoot<capnp::MinHash>();
+        capnp::List<capnp::MinHash::ReferenceList::Reference>::Reader referencesReader = getReferencesReader(reader);
+        
+        for ( uint64_t j = referencesReader.size(); j > 0; j-- )
         {
-            capnp::List<uint32_t>::Reader hashesReader = referenceReader.getHashes32();
-        	
-        	hashCount = hashesReader.size();
-        	
-        	if ( hashCount > input->parameters.minHashesPerWindow )
-        	{
-        		hashCount = input->parameters.minHashesPerWindow;
-        	}
-        	
-            reference.hashesSorted.resize(hashCount);
+            if ( removed.count(referencesReader[j - 1].getName().cStr()) == 0 )
+            {
+                live.push_back(segment.referenceStart + j - 1);
+            }
+        }
         
-            for ( uint64_t j = 0; j < hashCount; j++ )
+        if ( segment.removals )
+        {
+            capnp::List<capnp::Text>::Reader removedReader = reader.getRemoved();
+            
+            for ( uint64_t j = 0; j < removedReader.size(); j++ )
+            {
+                removed.insert(removedReader[j].cStr());
+            }
+        }
+    }
+    
+    std::reverse(live.begin(), live.end());
+    
+    return true;
+}
+
+bool hasRemovedReferences(const Sketch::Mapping & mapping)
+{
+    vector<Sketch::Segment> segments;
+    
+    if ( isColumnarSketch(mapping) || ! getCapnpSegments(mapping.data, mapping.size, segments) )
+    {
+        return false;
+    }
+    
+    for ( uint64_t i = 0; i < segments.size(); i++ )
+    {
+        if ( segments[i].removals )
+        {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+Sketch::SketchOutput * loadCapnpReferences(const char * file, const Sketch::Parameters & parameters, const vector<uint64_t> * indices, std::shared_ptr<Sketch::Mapping> mapping)
+{
+    // Only the references at the given indices (all, if none are given) are
+    // decoded; capnp messages are random access, so the rest are not touched.
+    // The file is mapped here unless a mapping (e.g. from reading its header)
+    // is given.
+    
+    if ( ! mapping )
+    {
+        mapping = mapSketchFile(file);
+    }
+    
+    if ( isColumnarSketch(*mapping) )
+    {
+        return loadColumnarReferences(mapping, file, parameters, indices);
+    }
+	
+	Sketch::SketchOutput * output = new Sketch::SketchOutput();
+	vector<Sketch::Reference> & references = output->references;
+    
+    vector<Sketch::Segment> segments;
+    
+    if ( ! getCapnpSegments(mapping->data, mapping->size, segments) )
+    {
+        cerr << "ERROR: \"" << file << "\" is not a valid sketch file." << endl;
+        exit(1);
+    }
+    
+    uint64_t referenceCount = segments.back().referenceStart + segments.back().referenceCount;
+    vector<uint64_t> live;
+    
+    // If references were removed, indices are among the rest, so they are
+    // translated to positions in the file.
+    
+    if ( getLiveReferences(segments, live) )
+    {
+        if ( indices )
+        {
+            vector<uint64_t> liveIndices(indices->size());
+            
+            for ( uint64_t i = 0; i < indices->size(); i++ )
             {
-                reference.hashesSorted.set32(j, hashesReader[j]);
+                if ( indices->at(i) >= live.size() )
+                {
+                    cerr << "ERROR: Reference " << indices->at(i) << " is out of bounds." << endl;
+                    exit(1);
+                }
+                
+                liveIndices[i] = live[indices->at(i)];
             }
+            
+            live.swap(liveIndices);
         }
         
-        if ( referenceReader.hasCounts32() )
+        indices = &live;
+    }
+    
+    references.resize(indices ? indices->size() : referenceCount);
+    
+    // Ranges of references are decoded by separate threads into the slots
+    // sized above.
+    
+    // Small files are copied so that their mappings can be released once
+    // loaded, rather than one being held for each of many query sketches.
+    
+    ThreadPool<Sketch::DecodeInput, Sketch::DecodeOutput> threadPool(decodeCapnpReferences, parameters.parallelism);
+    bool map = mapping->size >= mappedSizeMin;
+    bool mapped = false;
+    
+    for ( uint64_t start = 0; start < references.size(); start += decodeBatchSize )
+    {
+        uint64_t end = start + decodeBatchSize < references.size() ? start + decodeBatchSize : references.size();
+        
+        threadPool.runWhenThreadAvailable(new Sketch::DecodeInput(segments, map, parameters, indices, references, start, end));
+        
+        while ( threadPool.outputAvailable() )
         {
-			capnp::List<uint32_t>::Reader countsReader = referenceReader.getCounts32();
-		
-			reference.counts.resize(hashCount);
-		
-			for ( uint64_t j = 0; j < hashCount; j++ )
-			{
-				reference.counts[j] = countsReader[j];
-			}
+            Sketch::DecodeOutput * decoded = threadPool.popOutputWhenAvailable();
+            mapped = mapped || decoded->mapped;
+            output->counts = output->counts || decoded->counts;
+            delete decoded;
         }
     }
     
-    capnp::MinHash::LocusList::Reader locusListReader = reader.getLocusList();
-    capnp::List<capnp::MinHash::LocusList::Locus>::Reader lociReader = locusListReader.getLoci();
+    while ( threadPool.running() )
+    {
+        Sketch::DecodeOutput * decoded = threadPool.popOutputWhenAvailable();
+        mapped = mapped || decoded->mapped;
+        output->counts = output->counts || decoded->counts;
+        delete decoded;
+    }
     
     output->positionHashesByReference.resize(references.size());
     
-    for ( uint64_t i = 0; i < lociReader.size(); i++ )
+    for ( uint64_t i = 0; ! indices && i < segments.size(); i++ )
     {
-        capnp::MinHash::LocusList::Locus::Reader locusReader = lociReader[i];
-        //cout << locusReader.getHash64() << '\t' << locusReader.getSequence() << '\t' << locusReader.getPosition() << endl;
-        output->positionHashesByReference[locusReader.getSequence()].push_back(Sketch::PositionHash(locusReader.getPosition(), locusReader.getHash64()));
+        capnp::FlatArrayMessageReader message(kj::ArrayPtr<const capnp::word>(reinterpret_cast<const capnp::word *>(segments[i].data), segments[i].size / sizeof(capnp::word)), getCapnpReaderOptions());
+        capnp::MinHash::LocusList::Reader locusListReader = message.getRoot<capnp::MinHash>().getLocusList();
+        capnp::List<capnp::MinHash::LocusList::Locus>::Reader lociReader = locusListReader.getLoci();
+        
+        for ( uint64_t j = 0; j < lociReader.size(); j++ )
+        {
+            capnp::MinHash::LocusList::Locus::Reader locusReader = lociReader[j];
+            //cout << locusReader.getHash64() << '\t' << locusReader.getSequence() << '\t' << locusReader.getPosition() << endl;
+            output->positionHashesByReference[segments[i].referenceStart + locusReader.getSequence()].push_back(Sketch::PositionHash(locusReader.getPosition(), locusReader.getHash64()));
+        }
     }
     
     /*
@@ -1052,9 +1846,10 @@ Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input)
     cout << endl;
     */
     
-    munmap(data, fileInfo.st_size);
-    close(fd);
-    delete message;
+    if ( mapped )
+    {
+        output->mapping = mapping;
+    }
     
     return output;
 }
@@ -1082,18 +1877,18 @@ void setAlphabetFromString(Sketch::Parameters & parameters, const char * charact
 {
     parameters.alphabetSize = 0;
     memset(parameters.alphabet, 0, 256);
-    
+	
 	const char * character = characters;
 	
 	while ( *character != 0 )
 	{
 		char characterUpper = *character;
-		
+        
         if ( ! parameters.preserveCase && characterUpper > 96 && characterUpper < 123 )
         {
             characterUpper -= 32;
         }
-        
+		
 		parameters.alphabet[characterUpper] = true;
 		character++;
 	}
@@ -1126,12 +1921,12 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 	
 	output->references.resize(1);
 	Sketch::Reference & reference = output->references[0];
-	
+    
     MinHashHeap minHashHeap(parameters.use64, parameters.minHashesPerWindow, parameters.reads ? parameters.minCov : 1, parameters.memoryBound);
-
+	
 	reference.length = 0;
 	reference.hashesSorted.setUse64(parameters.use64);
-	
+    
     int l;
     int count = 0;
 	bool skipped = false;
@@ -1289,7 +2084,7 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 	{
 		setMinHashesForReference(reference, minHashHeap);
 	}
-	
+    
     if ( parameters.reads )
     {
        	cerr << "Estimated genome size: " << minHashHeap.estimateSetSize() << endl;
@@ -1309,6 +2104,34 @@ Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input)
 	return output;
 }
 
+Sketch::SketchOutput * sketchFileCached(Sketch::SketchInput * input)
+{
+    string cacheFile = getCacheFile(input->fileNames[0], input->parameters);
+    
+    if ( cacheFile == "" )
+    {
+        return sketchFile(input);
+    }
+    
+    Sketch::SketchOutput * output = loadFromCache(cacheFile, input->fileNames[0], input->parameters);
+    
+    if ( output == 0 )
+    {
+        output = sketchFile(input);
+        
+        Sketch sketch;
+        sketch.parameters = input->parameters;
+        sketch.references = output->references;
+        
+        if ( ! writeToCache(cacheFile, sketch) )
+        {
+            cerr << "WARNING: could not write " << cacheFile << " to cache." << endl;
+        }
+    }
+    
+    return output;
+}
+
 Sketch::SketchOutput * sketchSequence(Sketch::SketchInput * input)
 {
 	const Sketch::Parameters & parameters = input->parameters;
@@ -1354,7 +2177,7 @@ int def(int fdSource, int fdDest, int level)
     z_stream strm;
     unsigned char in[CHUNK];
     unsigned char out[CHUNK];
-
+    
     /* allocate deflate state */
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
@@ -1362,7 +2185,7 @@ int def(int fdSource, int fdDest, int level)
     ret = deflateInit(&strm, level);
     if (ret != Z_OK)
         return ret;
-
+    
     /* compress until end of file */
     do {
         strm.avail_in = read(fdSource, in, CHUNK);
@@ -1372,7 +2195,7 @@ int def(int fdSource, int fdDest, int level)
         }
         flush = strm.avail_in == 0 ? Z_FINISH : Z_NO_FLUSH;
         strm.next_in = in;
-
+        
         /* run deflate() on input until output buffer not full, finish
            compression if all of source has been read in */
         do {
@@ -1387,11 +2210,11 @@ int def(int fdSource, int fdDest, int level)
             }
         } while (strm.avail_out == 0);
         assert(strm.avail_in == 0);     /* all input will be used */
-
+        
         /* done when last data in file processed */
     } while (flush != Z_FINISH);
     assert(ret == Z_STREAM_END);        /* stream will be complete */
-
+    
     /* clean up and return */
     (void)deflateEnd(&strm);
     return Z_OK;
@@ -1410,7 +2233,7 @@ int inf(int fdSource, int fdDest)
     z_stream strm;
     unsigned char in[CHUNK];
     unsigned char out[CHUNK];
-
+    
     /* allocate inflate state */
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
@@ -1420,7 +2243,7 @@ int inf(int fdSource, int fdDest)
     ret = inflateInit(&strm);
     if (ret != Z_OK)
         return ret;
-
+    
     /* decompress until deflate stream ends or end of file */
     do {
         strm.avail_in = read(fdSource, in, CHUNK);
@@ -1431,7 +2254,7 @@ int inf(int fdSource, int fdDest)
         if (strm.avail_in == 0)
             break;
         strm.next_in = in;
-
+        
         /* run inflate() on input until output buffer not full */
         do {
             strm.avail_out = CHUNK;
@@ -1452,10 +2275,10 @@ int inf(int fdSource, int fdDest)
                 return Z_ERRNO;
             }
         } while (strm.avail_out == 0);
-
+        
         /* done when inflate() says it's done */
     } while (ret != Z_STREAM_END);
-
+    
     /* clean up and return */
     (void)inflateEnd(&strm);
     return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
@@ -11,6 +11,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include <map>
+#include <memory>
 #include <vector>
 #include <string>
 #include <string.h>
@@ -20,6 +21,12 @@
 static const char * capnpHeader = "Cap'n Proto";
 static const int capnpHeaderLength = strlen(capnpHeader);
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static const bool hostLittleEndian = true;
+#else
+static const bool hostLittleEndian = false;
+#endif
+
 static const char * suffixSketch = ".msh";
 static const char * suffixSketchWindowed = ".msw";
 
@@ -53,7 +60,8 @@ public:
             memoryBound(0),
             minCov(1),
             targetCov(0),
-            genomeSize(0)
+            genomeSize(0),
+            cache("")
         {
         	memset(alphabet, 0, 256);
         }
@@ -77,7 +85,8 @@ public:
             memoryBound(other.memoryBound),
             minCov(other.minCov),
             targetCov(other.targetCov),
-            genomeSize(other.genomeSize)
+            genomeSize(other.genomeSize),
+            cache(other.cache)
 		{
 			memcpy(alphabet, other.alphabet, 256);
 		}
@@ -101,6 +110,7 @@ public:
         uint32_t minCov;
         double targetCov;
         uint64_t genomeSize;
+        std::string cache; // directory of cached sketches of sequence files (see cache.h)
     };
     
     struct PositionHash
@@ -139,6 +149,19 @@ public:
         std::vector<uint32_t> counts;
     };
     
+    struct Mapping
+    {
+        // A sketch file mapped into memory, which hashes of references loaded
+        // from it point into rather than being copied; unmapped when the last
+        // sketch sharing it is destroyed.
+        
+        Mapping(void * dataNew, uint64_t sizeNew) : data(dataNew), size(sizeNew) {}
+        ~Mapping();
+        
+        void * data;
+        uint64_t size;
+    };
+    
     struct SketchInput
     {
     	SketchInput(std::vector<std::string> fileNamesNew, char * seqNew, uint64_t lengthNew, const std::string & nameNew, const std::string & commentNew, const Sketch::Parameters & parametersNew)
@@ -169,19 +192,112 @@ public:
     	std::string comment;
     	
     	Sketch::Parameters parameters;
+    	
+    	std::shared_ptr<Mapping> mapping; // of a sketch file, if already mapped
     };
     
     struct SketchOutput
     {
     	std::vector<Reference> references;
 	    std::vector<std::vector<PositionHash>> positionHashesByReference;
+	    std::shared_ptr<Mapping> mapping; // if references point into it
+	    bool counts; // if hash counts were loaded, which files only keep for read sets
+    };
+    
+    struct Segment
+    {
+        // One of the capnp messages making up a sketch file. Appending to a
+        // file adds messages, and the references of all of them are read in
+        // order as a single list, except for ones removed by later messages.
+        
+        const void * data;
+        uint64_t size; // bytes
+        uint64_t referenceStart;
+        uint64_t referenceCount;
+        bool removals; // if it removes references of earlier messages
+    };
+    
+    struct DecodeInput
+    {
+        // A range of references in a mapped sketch file, decoded into slots of
+        // a list that was sized beforehand, so ranges can be decoded at once.
+        
+        DecodeInput(const std::vector<Segment> & segmentsNew, bool mapNew, const Parameters & parametersNew, const std::vector<uint64_t> * indicesNew, std::vector<Reference> & referencesNew, uint64_t startNew, uint64_t endNew)
+            :
+            segments(segmentsNew),
+            map(mapNew),
+            parameters(parametersNew),
+            indices(indicesNew),
+            references(referencesNew),
+            start(startNew),
+            end(endNew)
+            {}
+        
+        const std::vector<Segment> & segments;
+        bool map; // point hashes into the mapping rather than copying them
+        const Parameters & parameters;
+        const std::vector<uint64_t> * indices; // all references if 0
+        std::vector<Reference> & references;
+        uint64_t start;
+        uint64_t end;
+    };
+    
+    struct DecodeOutput
+    {
+        bool mapped; // if any hashes point into the mapping
+        bool counts; // if any references have hash counts
+    };
+    
+    struct HeaderInput
+    {
+        HeaderInput(const std::string & fileNew) : file(fileNew) {}
+        
+        std::string file;
+    };
+    
+    struct HeaderOutput
+    {
+        // The parameters of a sketch file, and its mapping, which is reused
+        // to load it.
+        
+        std::shared_ptr<Sketch> sketch;
+        std::shared_ptr<Mapping> mapping;
+    };
+    
+    typedef std::vector<uint64_t> IndexReferences; // of one index shard, in order
+    typedef std::vector<std::pair<hash_t, Locus>> IndexLoci;
+    
+    struct IndexInput
+    {
+        IndexInput(Sketch & sketchNew, uint64_t startNew, uint64_t endNew, uint64_t shardNew = 0, const IndexReferences * referencesNew = 0, const IndexLoci * lociNew = 0)
+            :
+            sketch(sketchNew),
+            start(startNew),
+            end(endNew),
+            shard(shardNew),
+            references(referencesNew),
+            loci(lociNew)
+            {}
+        
+        Sketch & sketch;
+        uint64_t start; // range of references to assign to shards
+        uint64_t end;
+        uint64_t shard; // shard of the indices to build, from its references and loci
+        const IndexReferences * references;
+        const IndexLoci * loci;
+    };
+    
+    struct IndexOutput
+    {
+        std::vector<IndexReferences> referencesByShard;
+        std::vector<IndexLoci> lociByShard;
     };
     
     void getAlphabetAsString(std::string & alphabet) const;
     uint32_t getAlphabetSize() const {return parameters.alphabetSize;}
     bool getConcatenated() const {return parameters.concatenated;}
     float getError() const {return parameters.error;}
-    int getHashCount() const {return lociByHash.size();}
+    int getHashCount() const;
     uint32_t getHashSeed() const {return parameters.seed;}
     const std::vector<Locus> & getLociByHash(hash_t hash) const;
     float getMinHashesPerWindow() const {return parameters.minHashesPerWindow;}
@@ -198,40 +314,73 @@ public:
     uint64_t getWindowSize() const {return parameters.windowSize;}
     bool getNoncanonical() const {return parameters.noncanonical;}
     bool hasHashCounts() const {return references.size() > 0 && references.at(0).counts.size() > 0;}
-    bool hasLociByHash(hash_t hash) const {return lociByHash.count(hash);}
+    bool hasLociByHash(hash_t hash) const;
+    int initFromCapnpReferences(const char * file, const std::vector<uint64_t> & indices);
+    bool isCompatible(const Sketch & sketchTest, const std::string & file, bool contain = false) const;
     int initFromFiles(const std::vector<std::string> & files, const Parameters & parametersNew, int verbosity = 0, bool enforceParameters = false, bool contain = false);
     void initFromReads(const std::vector<std::string> & files, const Parameters & parametersNew);
+    int initFromMapping(std::shared_ptr<Mapping> mapping, const char * file, const std::vector<uint64_t> * indices = 0);
+    void initFromReferences(const Sketch & sketch, const std::vector<uint64_t> & indices);
     uint64_t initParametersFromCapnp(const char * file);
+    uint64_t initParametersFromMapping(const Mapping & mapping, const char * file);
+    int finishSegmentOutput();
     void setReferenceName(int i, const std::string name) {references[i].name = name;}
     void setReferenceComment(int i, const std::string comment) {references[i].comment = comment;}
+    void setSegmentOutput(const std::string & file, uint64_t segmentSize);
 	bool sketchFileBySequence(FILE * file, ThreadPool<Sketch::SketchInput, Sketch::SketchOutput> * threadPool);
 	void useThreadOutput(SketchOutput * output);
     void warnKmerSize(uint64_t lengthMax, const std::string & lengthMaxName, double randomChance, int kMin, int warningCount) const;
     bool writeToFile() const;
-    int writeToCapnp(const char * file) const;
-    
+    int writeToCapnp(const char * file, bool packed = false, bool append = false, uint64_t start = 0, const std::vector<std::string> * removed = 0) const;
+
 private:
     
+    friend IndexOutput * assignIndexShards(IndexInput * input);
+    friend IndexOutput * buildIndexShard(IndexInput * input);
+    friend SketchOutput * sketchFileCached(SketchInput * input);
+    
     void createIndex();
+    int writeSegment();
     
     std::vector<Reference> references;
-    std::unordered_map<std::string, int> referenceIndecesById;
+    std::vector<std::unordered_map<std::string, int>> referenceIndecesById; // sharded by name
     std::vector<std::vector<PositionHash>> positionHashesByReference;
-    std::unordered_map<hash_t, std::vector<Locus>> lociByHash;
+    std::vector<std::unordered_map<hash_t, std::vector<Locus>>> lociByHash; // sharded by hash
+    std::vector<std::shared_ptr<Mapping>> mappings;
     
     Parameters parameters;
     double kmerSpace;
     std::string file;
+    
+    // When set, references are written to this file in segments of this many
+    // as they are added, and their hashes are freed (see setSegmentOutput).
+    //
+    std::string segmentFile;
+    uint64_t segmentSize;
+    uint64_t segmentStart; // first reference not yet written
 };
 
 void addMinHashes(MinHashHeap & minHashHeap, char * seq, uint64_t length, const Sketch::Parameters & parameters);
+Sketch::IndexOutput * assignIndexShards(Sketch::IndexInput * input);
+Sketch::IndexOutput * buildIndexShard(Sketch::IndexInput * input);
+void joinIndexShards(Sketch::IndexOutput * output, std::vector<Sketch::IndexReferences> & referencesByShard, std::vector<Sketch::IndexLoci> & lociByShard);
+Sketch::DecodeOutput * decodeCapnpReferences(Sketch::DecodeInput * input);
 void getMinHashPositions(std::vector<Sketch::PositionHash> & loci, char * seq, uint32_t length, const Sketch::Parameters & parameters, int verbosity = 0);
+bool getCapnpReferenceNames(const char * file, std::vector<std::string> & names);
+bool getCapnpSegments(const void * data, uint64_t size, std::vector<Sketch::Segment> & segments);
+bool getLiveReferences(const std::vector<Sketch::Segment> & segments, std::vector<uint64_t> & live);
+bool hasRemovedReferences(const Sketch::Mapping & mapping);
 bool hasSuffix(std::string const & whole, std::string const & suffix);
 Sketch::SketchOutput * loadCapnp(Sketch::SketchInput * input);
+Sketch::SketchOutput * loadCapnpReferences(const char * file, const Sketch::Parameters & parameters, const std::vector<uint64_t> * indices, std::shared_ptr<Sketch::Mapping> mapping = std::shared_ptr<Sketch::Mapping>());
+std::shared_ptr<Sketch::Mapping> mapSketchFile(const char * file, bool exitOnError = true);
+Sketch::HeaderOutput * readSketchHeader(Sketch::HeaderInput * input);
+int lockSketchFile(const char * file);
 void reverseComplement(const char * src, char * dest, int length);
 void setAlphabetFromString(Sketch::Parameters & parameters, const char * characters);
 void setMinHashesForReference(Sketch::Reference & reference, const MinHashHeap & hashes);
 Sketch::SketchOutput * sketchFile(Sketch::SketchInput * input);
+Sketch::SketchOutput * sketchFileCached(Sketch::SketchInput * input);
 Sketch::SketchOutput * sketchSequence(Sketch::SketchInput * input);
 
 int def(int fdSource, int fdDest, int level);
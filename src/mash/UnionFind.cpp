@@ -0,0 +1,73 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "UnionFind.h"
+
+UnionFind::UnionFind(uint64_t size)
+    :
+    parents(size)
+{
+    for ( uint64_t i = 0; i < size; i++ )
+    {
+        parents[i].store(i);
+    }
+}
+
+uint64_t UnionFind::find(uint64_t index)
+{
+    // Path halving: each step points the index at its grandparent if nothing
+    // else has changed its parent in the meantime.
+    
+    while ( true )
+    {
+        uint64_t parent = parents[index].load();
+        
+        if ( parent == index )
+        {
+            return index;
+        }
+        
+        uint64_t grandparent = parents[parent].load();
+        
+        if ( grandparent != parent )
+        {
+            parents[index].compare_exchange_weak(parent, grandparent);
+        }
+        
+        index = grandparent;
+    }
+}
+
+void UnionFind::join(uint64_t index1, uint64_t index2)
+{
+    while ( true )
+    {
+        uint64_t root1 = find(index1);
+        uint64_t root2 = find(index2);
+        
+        if ( root1 == root2 )
+        {
+            return;
+        }
+        
+        if ( root1 < root2 )
+        {
+            uint64_t swap = root1;
+            root1 = root2;
+            root2 = swap;
+        }
+        
+        // Link the higher root below the lower one, unless it stopped being a
+        // root since it was found, in which case try again.
+        
+        uint64_t expected = root1;
+        
+        if ( parents[root1].compare_exchange_strong(expected, root2) )
+        {
+            return;
+        }
+    }
+}
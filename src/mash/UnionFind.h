@@ -0,0 +1,33 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef UnionFind_h
+#define UnionFind_h
+
+#include <atomic>
+#include <inttypes.h>
+#include <vector>
+
+// Disjoint sets of indices that can be joined from several threads at once
+// without locking. A root is always the lowest index in its set, so the
+// result does not depend on the order of joins.
+
+class UnionFind
+{
+public:
+    
+    UnionFind(uint64_t size);
+    
+    uint64_t find(uint64_t index);
+    void join(uint64_t index1, uint64_t index2);
+    uint64_t size() const {return parents.size();}
+
+private:
+    
+    std::vector<std::atomic<uint64_t>> parents;
+};
+
+#endif
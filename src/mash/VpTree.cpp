@@ -0,0 +1,298 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "VpTree.h"
+#include "sidecar.h"
+#include <algorithm>
+
+using std::pair;
+using std::string;
+using std::vector;
+
+static const char * vpTreeMagic = "MASHVPT3";
+
+bool VpTree::initFromSidecar(const string & sketchFile, uint64_t referenceCountNew)
+{
+    FILE * stream = openSidecarForReading(sketchFile, suffixVpTree, vpTreeMagic, referenceCountNew);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    uint64_t counts[2];
+    bool success = fread(counts, sizeof(uint64_t), 2, stream) == 2 && counts[1] <= referenceCountNew;
+    
+    if ( success )
+    {
+        nodes.resize(counts[0]);
+        buckets.resize(counts[1]);
+        
+        success =
+            fread(nodes.data(), sizeof(Node), nodes.size(), stream) == nodes.size() &&
+            fread(buckets.data(), sizeof(uint64_t), buckets.size(), stream) == buckets.size();
+    }
+    
+    for ( uint64_t i = 0; success && i < nodes.size(); i++ )
+    {
+        const Node & node = nodes[i];
+        
+        success =
+            node.vantage < referenceCountNew &&
+            node.inner < int64_t(nodes.size()) &&
+            node.outer < int64_t(nodes.size()) &&
+            node.bucketStart + node.bucketCount <= buckets.size();
+    }
+    
+    fclose(stream);
+    
+    if ( ! success )
+    {
+        nodes.clear();
+        buckets.clear();
+    }
+    
+    referenceCount = referenceCountNew;
+    
+    return success;
+}
+
+void VpTree::initFromSketch(const Sketch & sketch)
+{
+    vector<uint64_t> indices(sketch.getReferenceCount());
+    
+    for ( uint64_t i = 0; i < indices.size(); i++ )
+    {
+        indices[i] = i;
+    }
+    
+    nodes.clear();
+    buckets.clear();
+    referenceCount = indices.size();
+    
+    if ( indices.size() > 0 )
+    {
+        build(sketch, indices, 0, indices.size());
+    }
+}
+
+uint64_t VpTree::rangeQuery(const Sketch & sketch, const Sketch::Reference & query, uint64_t sketchSize, double radius, vector<uint64_t> & results) const
+{
+    // Returns, sorted, every reference whose estimated Jaccard distance to the
+    // query (with the given sketch size) could be within the radius, for
+    // callers to make the final decision with their own measure, and the
+    // number of comparisons made to find them. If the query's sketch size is
+    // smaller than the tree's, its estimates are not bounded by the tree's
+    // distances, so all references are returned.
+    
+    uint64_t comparisons = 0;
+    vector<int64_t> stack;
+    
+    results.clear();
+    
+    if ( sketchSize < sketch.getMinHashesPerWindow() )
+    {
+        for ( uint64_t i = 0; i < referenceCount; i++ )
+        {
+            results.push_back(i);
+        }
+        
+        return 0;
+    }
+    
+    radius = sketchRadius(radius);
+    
+    if ( nodes.size() > 0 )
+    {
+        stack.push_back(0);
+    }
+    
+    while ( stack.size() > 0 )
+    {
+        const Node & node = nodes[stack.back()];
+        
+        stack.pop_back();
+        
+        for ( uint64_t i = node.bucketStart; i < node.bucketStart + node.bucketCount; i++ )
+        {
+            comparisons++;
+            
+            if ( jaccardDistance(sketch, sketch.getReference(buckets[i]), query) <= radius )
+            {
+                results.push_back(buckets[i]);
+            }
+        }
+        
+        if ( node.bucketCount > 0 )
+        {
+            continue;
+        }
+        
+        double distance = jaccardDistance(sketch, sketch.getReference(node.vantage), query);
+        
+        comparisons++;
+        
+        if ( distance <= radius )
+        {
+            results.push_back(node.vantage);
+        }
+        
+        // The distance is a metric, so the triangle inequality holds exactly
+        // (the slack only absorbs rounding).
+        
+        if ( node.inner >= 0 && distance - radius - vpTreeSlack <= node.radius )
+        {
+            stack.push_back(node.inner);
+        }
+        
+        if ( node.outer >= 0 && distance + radius + vpTreeSlack >= node.radius )
+        {
+            stack.push_back(node.outer);
+        }
+    }
+    
+    std::sort(results.begin(), results.end());
+    
+    return comparisons;
+}
+
+bool VpTree::writeToSidecar(const string & sketchFile) const
+{
+    FILE * stream = openSidecarForWriting(sketchFile, suffixVpTree, vpTreeMagic, referenceCount);
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    uint64_t counts[2] = {nodes.size(), buckets.size()};
+    
+    bool success =
+        fwrite(counts, sizeof(uint64_t), 2, stream) == 2 &&
+        fwrite(nodes.data(), sizeof(Node), nodes.size(), stream) == nodes.size() &&
+        fwrite(buckets.data(), sizeof(uint64_t), buckets.size(), stream) == buckets.size();
+    
+    return fclose(stream) == 0 && success;
+}
+
+double VpTree::jaccardDistance(const Sketch & sketch, const Sketch::Reference & ref, const Sketch::Reference & query)
+{
+    // Jaccard distance between the sets of (up to sketch size) hashes in the
+    // two sketches, as opposed to the estimate of it for the k-mer sets.
+    
+    const HashList & hashesRef = ref.hashesSorted;
+    const HashList & hashesQry = query.hashesSorted;
+    uint64_t sizeRef = std::min<uint64_t>(hashesRef.size(), sketch.getMinHashesPerWindow());
+    uint64_t sizeQry = std::min<uint64_t>(hashesQry.size(), sketch.getMinHashesPerWindow());
+    uint64_t i = 0;
+    uint64_t j = 0;
+    uint64_t common = 0;
+    
+    while ( i < sizeRef && j < sizeQry )
+    {
+        if ( hashLessThan(hashesRef.at(i), hashesQry.at(j), hashesRef.get64()) )
+        {
+            i++;
+        }
+        else if ( hashLessThan(hashesQry.at(j), hashesRef.at(i), hashesRef.get64()) )
+        {
+            j++;
+        }
+        else
+        {
+            i++;
+            j++;
+            common++;
+        }
+    }
+    
+    uint64_t total = sizeRef + sizeQry - common;
+    
+    return total ? 1. - double(common) / total : 0.;
+}
+
+double VpTree::sketchRadius(double radius)
+{
+    // For sketches of size s with c hashes in common, an estimate of Jaccard
+    // distance of at most r means at least (1 - r)s of the first s hashes of
+    // their union are shared, so c >= (1 - r)s and the union of the hash sets
+    // has at most 2s - c hashes. The distance between the hash sets is thus at
+    // most 1 - (1 - r) / (1 + r) = 2r / (1 + r).
+    
+    return 2. * radius / (1. + radius);
+}
+
+int64_t VpTree::build(const Sketch & sketch, vector<uint64_t> & indices, uint64_t start, uint64_t end)
+{
+    int64_t index = nodes.size();
+    
+    nodes.push_back(Node());
+    
+    Node & node = nodes.back();
+    
+    node.inner = -1;
+    node.outer = -1;
+    node.bucketStart = buckets.size();
+    node.bucketCount = 0;
+    
+    if ( end - start <= vpTreeLeafSize )
+    {
+        node.vantage = indices[start];
+        node.radius = 0;
+        node.bucketCount = end - start;
+        buckets.insert(buckets.end(), indices.begin() + start, indices.begin() + end);
+        
+        return index;
+    }
+    
+    // The first reference is the vantage point; the rest are split at the
+    // median distance to it. Distances between unrelated genomes saturate, so
+    // if the median is the largest distance, split off the closer ones
+    // instead (if there are enough to keep the tree shallow), since nothing
+    // can be pruned by a boundary that everything is on.
+    
+    uint64_t vantage = indices[start];
+    const Sketch::Reference & ref = sketch.getReference(vantage);
+    vector<pair<double, uint64_t>> distances;
+    
+    for ( uint64_t i = start + 1; i < end; i++ )
+    {
+        distances.push_back(pair<double, uint64_t>(jaccardDistance(sketch, ref, sketch.getReference(indices[i])), indices[i]));
+    }
+    
+    std::sort(distances.begin(), distances.end());
+    
+    uint64_t middle = distances.size() / 2;
+    
+    if ( distances[middle].first == distances.back().first )
+    {
+        uint64_t closer = std::lower_bound(distances.begin(), distances.end(), pair<double, uint64_t>(distances.back().first, 0)) - distances.begin();
+        
+        if ( closer > 0 && closer >= distances.size() / vpTreeSplitMin )
+        {
+            middle = closer - 1;
+        }
+    }
+    
+    for ( uint64_t i = 0; i < distances.size(); i++ )
+    {
+        indices[start + 1 + i] = distances[i].second;
+    }
+    
+    double radius = distances[middle].first;
+    
+    // node may move as children are added
+    
+    int64_t inner = build(sketch, indices, start + 1, start + 1 + middle + 1);
+    int64_t outer = start + 1 + middle + 1 < end ? build(sketch, indices, start + 1 + middle + 1, end) : -1;
+    
+    nodes[index].vantage = vantage;
+    nodes[index].radius = radius;
+    nodes[index].inner = inner;
+    nodes[index].outer = outer;
+    
+    return index;
+}
@@ -0,0 +1,59 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef VpTree_h
+#define VpTree_h
+
+#include "Sketch.h"
+#include <string>
+#include <vector>
+
+static const char * suffixVpTree = ".vpt";
+
+static const uint64_t vpTreeLeafSize = 16;
+static const uint64_t vpTreeSplitMin = 32; // smallest inner subtree, as a fraction (1 / x) of a node
+static const double vpTreeSlack = 1e-9; // for rounding in the triangle inequality
+
+// Vantage-point tree over the references in a sketch, for range queries that
+// skip references which provably cannot be within the range. Estimates of
+// Jaccard distance from sketches do not obey the triangle inequality, so the
+// tree instead uses the exact Jaccard distance between the sketches' hash
+// sets, which is a metric, and searches it with a radius wide enough to
+// include every reference whose estimate could be within the range (see
+// sketchRadius()). Results are thus a superset of the estimates in range.
+
+class VpTree
+{
+public:
+    
+    struct Node
+    {
+        uint64_t vantage;
+        double radius; // median distance to vantage point; inner subtree is within it
+        int64_t inner; // child node indices, or -1
+        int64_t outer;
+        uint64_t bucketStart; // leaves only
+        uint64_t bucketCount;
+    };
+    
+    bool initFromSidecar(const std::string & sketchFile, uint64_t referenceCount);
+    void initFromSketch(const Sketch & sketch);
+    uint64_t rangeQuery(const Sketch & sketch, const Sketch::Reference & query, uint64_t sketchSize, double radius, std::vector<uint64_t> & results) const;
+    bool writeToSidecar(const std::string & sketchFile) const;
+    
+    static double jaccardDistance(const Sketch & sketch, const Sketch::Reference & ref, const Sketch::Reference & query);
+    static double sketchRadius(double radius);
+
+private:
+    
+    int64_t build(const Sketch & sketch, std::vector<uint64_t> & indices, uint64_t start, uint64_t end);
+    
+    std::vector<Node> nodes; // root first
+    std::vector<uint64_t> buckets;
+    uint64_t referenceCount;
+};
+
+#endif
@@ -0,0 +1,155 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "cache.h"
+#include "MurmurHash3.h"
+#include "columnar.h"
+#include <fcntl.h>
+#include <inttypes.h>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::string;
+using std::vector;
+
+static const char * cacheVersion = "mash-cache-1"; // changed if entries would no longer match their keys
+
+string getCacheFile(const string & file, const Sketch::Parameters & parameters)
+{
+    char * path = realpath(file.c_str(), 0);
+    struct stat fileInfo;
+    
+    if ( path == 0 || stat(path, &fileInfo) == -1 )
+    {
+        free(path);
+        return "";
+    }
+    
+    // to the nanosecond, so a file rewritten within a second is not matched
+    
+#ifdef __APPLE__
+    const struct timespec & modified = fileInfo.st_mtimespec;
+#else
+    const struct timespec & modified = fileInfo.st_mtim;
+#endif
+    
+    std::ostringstream key;
+    
+    key
+        << cacheVersion << '\0'
+        << path << '\0'
+        << fileInfo.st_size << '\0'
+        << fileInfo.st_ino << '\0'
+        << modified.tv_sec << '.' << modified.tv_nsec << '\0'
+        << parameters.kmerSize << '\0'
+        << parameters.minHashesPerWindow << '\0'
+        << parameters.seed << '\0'
+        << parameters.noncanonical << '\0'
+        << parameters.preserveCase << '\0';
+    
+    for ( int i = 0; i < 256; i++ )
+    {
+        if ( parameters.alphabet[i] )
+        {
+            key << char(i);
+        }
+    }
+    
+    free(path);
+    
+    string keyString = key.str();
+    uint64_t digest[2];
+    char name[33];
+    
+    MurmurHash3_x64_128(keyString.data(), keyString.size(), 0, digest);
+    snprintf(name, sizeof(name), "%016" PRIx64 "%016" PRIx64, digest[0], digest[1]);
+    
+    return parameters.cache + "/" + name + suffixSketch;
+}
+
+Sketch::SketchOutput * loadFromCache(const string & cacheFile, const string & file, const Sketch::Parameters & parameters)
+{
+    int fd = open(cacheFile.c_str(), O_RDONLY);
+    struct stat fileInfo;
+    
+    if ( fd < 0 )
+    {
+        return 0;
+    }
+    
+    void * data = fstat(fd, &fileInfo) == -1 || fileInfo.st_size == 0 ? MAP_FAILED : mmap(NULL, fileInfo.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    close(fd);
+    
+    if ( data == MAP_FAILED )
+    {
+        return 0;
+    }
+    
+    // Entries that are not whole, single-sketch files with the expected
+    // parameters are ignored (and overwritten), rather than trusted.
+    
+    std::shared_ptr<Sketch::Mapping> mapping = std::make_shared<Sketch::Mapping>(data, fileInfo.st_size);
+    vector<Sketch::Segment> segments;
+    
+    if ( isColumnarSketch(*mapping) || ! getCapnpSegments(mapping->data, mapping->size, segments) || segments.size() != 1 || segments[0].referenceCount != 1 )
+    {
+        return 0;
+    }
+    
+    Sketch sketchCached;
+    sketchCached.initParametersFromMapping(*mapping, cacheFile.c_str());
+    
+    if
+    (
+        sketchCached.getKmerSize() != parameters.kmerSize ||
+        sketchCached.getMinHashesPerWindow() != parameters.minHashesPerWindow ||
+        sketchCached.getHashSeed() != parameters.seed ||
+        sketchCached.getNoncanonical() != parameters.noncanonical ||
+        sketchCached.getPreserveCase() != parameters.preserveCase
+    )
+    {
+        return 0;
+    }
+    
+    Sketch::SketchOutput * output = loadCapnpReferences(cacheFile.c_str(), parameters, 0, mapping);
+    
+    // the file may have been cached under a different relative path
+    //
+    output->references[0].name = file;
+    
+    return output;
+}
+
+bool writeToCache(const string & cacheFile, const Sketch & sketch)
+{
+    string fileTemp = cacheFile + ".XXXXXX";
+    vector<char> name(fileTemp.begin(), fileTemp.end());
+    
+    name.push_back(0);
+    
+    int fd = mkstemp(name.data());
+    
+    if ( fd < 0 )
+    {
+        return false;
+    }
+    
+    fchmod(fd, 0644);
+    close(fd);
+    
+    if ( sketch.writeToCapnp(name.data()) != 0 || rename(name.data(), cacheFile.c_str()) == -1 )
+    {
+        unlink(name.data());
+        return false;
+    }
+    
+    return true;
+}
@@ -0,0 +1,25 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef cache_h
+#define cache_h
+
+#include "Sketch.h"
+#include <string>
+
+// Sketches of whole sequence files can be kept in a cache directory (see
+// -cache), in sketch files named by a digest of the real path, size, inode and
+// modification time of the sequence file and of the parameters that affect the
+// sketch. A file is thus only sketched again if it or the parameters change.
+// Entries are written to temporary files and renamed into place, so processes
+// sharing a directory never see partial ones; if two sketch the same file at
+// once, the last rename wins with an identical sketch.
+
+std::string getCacheFile(const std::string & file, const Sketch::Parameters & parameters); // empty if the file cannot be cached
+Sketch::SketchOutput * loadFromCache(const std::string & cacheFile, const std::string & file, const Sketch::Parameters & parameters); // 0 if not cached
+bool writeToCache(const std::string & cacheFile, const Sketch & sketch);
+
+#endif
@@ -0,0 +1,443 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "columnar.h"
+#include <fcntl.h>
+#include <iostream>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+static uint64_t alignColumnar(uint64_t offset)
+{
+    return (offset + columnarAlignment - 1) / columnarAlignment * columnarAlignment;
+}
+
+static bool checkColumnarSection(uint64_t offset, uint64_t count, uint64_t width, uint64_t size)
+{
+    return offset % width == 0 && offset <= size && count <= (size - offset) / width;
+}
+
+static bool checkColumnarHeader(const ColumnarHeader & header, uint64_t size)
+{
+    uint64_t count = header.referenceCount;
+    uint64_t hashBytes = header.flags & columnarUse64 ? 8 : 4;
+    
+    return
+        hostLittleEndian &&
+        strncmp(header.magic, columnarMagic, columnarMagicLength) == 0 &&
+        header.fileSize == size &&
+        header.alphabet[sizeof(header.alphabet) - 1] == 0 &&
+        header.hashesOffset % columnarAlignment == 0 &&
+        checkColumnarSection(header.hashesOffset, header.hashCount, hashBytes, size) &&
+        (header.countsOffset == 0 || checkColumnarSection(header.countsOffset, header.hashCount, sizeof(uint32_t), size)) &&
+        checkColumnarSection(header.startsOffset, count, sizeof(uint64_t), size) &&
+        checkColumnarSection(header.sizesOffset, count, sizeof(uint64_t), size) &&
+        checkColumnarSection(header.lengthsOffset, count, sizeof(uint64_t), size) &&
+        count < size &&
+        checkColumnarSection(header.namesOffset, 2 * count + 1, sizeof(uint64_t), size) &&
+        header.stringsOffset <= size;
+}
+
+static const ColumnarHeader * getColumnarHeader(const Sketch::Mapping & mapping, const char * file)
+{
+    const ColumnarHeader * header = reinterpret_cast<const ColumnarHeader *>(mapping.data);
+    
+    if ( mapping.size < sizeof(ColumnarHeader) || ! checkColumnarHeader(*header, mapping.size) )
+    {
+        cerr << "ERROR: \"" << file << "\" is not a valid columnar sketch" << (hostLittleEndian ? "" : " (columnar sketches require a little-endian host)") << "." << endl;
+        return 0;
+    }
+    
+    return header;
+}
+
+static const ColumnarHeader * mapColumnar(const char * file, uint64_t & size)
+{
+    int fd = open(file, O_RDONLY);
+    struct stat fileInfo;
+    
+    if ( fd < 0 || fstat(fd, &fileInfo) == -1 )
+    {
+        cerr << "ERROR: could not open \"" << file << "\" for reading." << endl;
+        
+        if ( fd >= 0 )
+        {
+            close(fd);
+        }
+        
+        return 0;
+    }
+    
+    size = fileInfo.st_size;
+    
+    void * data = size < sizeof(ColumnarHeader) ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    
+    close(fd);
+    
+    if ( data == MAP_FAILED || ! checkColumnarHeader(*reinterpret_cast<const ColumnarHeader *>(data), size) )
+    {
+        cerr << "ERROR: \"" << file << "\" is not a valid columnar sketch" << (hostLittleEndian ? "" : " (columnar sketches require a little-endian host)") << "." << endl;
+        
+        if ( data != MAP_FAILED )
+        {
+            munmap(data, size);
+        }
+        
+        return 0;
+    }
+    
+    return reinterpret_cast<const ColumnarHeader *>(data);
+}
+
+uint64_t getColumnarParameters(const Sketch::Mapping & mapping, const char * file, Sketch::Parameters & parameters)
+{
+    const ColumnarHeader * header = getColumnarHeader(mapping, file);
+    
+    if ( header == 0 )
+    {
+        exit(1);
+    }
+    
+    parameters.kmerSize = header->kmerSize;
+    parameters.error = header->error;
+    parameters.minHashesPerWindow = header->minHashesPerWindow;
+    parameters.windowSize = header->windowSize;
+    parameters.concatenated = header->flags & columnarConcatenated;
+    parameters.noncanonical = header->flags & columnarNoncanonical;
+    parameters.preserveCase = header->flags & columnarPreserveCase;
+    parameters.seed = header->hashSeed;
+    
+    setAlphabetFromString(parameters, header->alphabet);
+    
+    parameters.use64 = header->flags & columnarUse64;
+    
+    // Cap'n Proto sketches only keep hash counts of read sets, so this lets
+    // them survive conversion back.
+    //
+    parameters.reads = header->countsOffset != 0;
+    
+    return header->referenceCount;
+}
+
+bool getColumnarReferenceNames(const char * file, vector<string> & names)
+{
+    uint64_t size;
+    const ColumnarHeader * header = mapColumnar(file, size);
+    
+    if ( header == 0 )
+    {
+        return false;
+    }
+    
+    const char * data = reinterpret_cast<const char *>(header);
+    const uint64_t * offsets = reinterpret_cast<const uint64_t *>(data + header->namesOffset);
+    bool success = true;
+    
+    names.resize(header->referenceCount);
+    
+    for ( uint64_t i = 0; success && i < names.size(); i++ )
+    {
+        success = offsets[2 * i] <= offsets[2 * i + 1] && offsets[2 * i + 1] <= size - header->stringsOffset;
+        
+        if ( success )
+        {
+            names[i].assign(data + header->stringsOffset + offsets[2 * i], offsets[2 * i + 1] - offsets[2 * i]);
+        }
+    }
+    
+    munmap((void *)header, size);
+    
+    return success;
+}
+
+bool isColumnarSketch(const char * file)
+{
+    char magic[columnarMagicLength];
+    FILE * stream = fopen(file, "rb");
+    
+    if ( stream == 0 )
+    {
+        return false;
+    }
+    
+    bool columnar = fread(magic, 1, columnarMagicLength, stream) == columnarMagicLength && strncmp(magic, columnarMagic, columnarMagicLength) == 0;
+    
+    fclose(stream);
+    
+    return columnar;
+}
+
+bool isColumnarSketch(const Sketch::Mapping & mapping)
+{
+    return mapping.size >= columnarMagicLength && strncmp(reinterpret_cast<const char *>(mapping.data), columnarMagic, columnarMagicLength) == 0;
+}
+
+Sketch::SketchOutput * loadColumnarReferences(std::shared_ptr<Sketch::Mapping> mapping, const char * file, const Sketch::Parameters & parameters, const vector<uint64_t> * indices)
+{
+    const ColumnarHeader * header = getColumnarHeader(*mapping, file);
+    uint64_t size = mapping->size;
+    
+    if ( header == 0 )
+    {
+        return 0;
+    }
+    
+    if ( bool(header->flags & columnarUse64) != parameters.use64 )
+    {
+        cerr << "ERROR: The hash size of \"" << file << "\" does not match its parameters." << endl;
+        exit(1);
+    }
+    
+    const char * data = reinterpret_cast<const char *>(header);
+    const uint64_t * starts = reinterpret_cast<const uint64_t *>(data + header->startsOffset);
+    const uint64_t * sizes = reinterpret_cast<const uint64_t *>(data + header->sizesOffset);
+    const uint64_t * lengths = reinterpret_cast<const uint64_t *>(data + header->lengthsOffset);
+    const uint64_t * offsets = reinterpret_cast<const uint64_t *>(data + header->namesOffset);
+    const uint32_t * counts = header->countsOffset ? reinterpret_cast<const uint32_t *>(data + header->countsOffset) : 0;
+    uint64_t hashBytes = parameters.use64 ? 8 : 4;
+    uint64_t stringsSize = size - header->stringsOffset;
+    
+    Sketch::SketchOutput * output = new Sketch::SketchOutput();
+    vector<Sketch::Reference> & references = output->references;
+    
+    references.resize(indices ? indices->size() : header->referenceCount);
+    output->positionHashesByReference.resize(references.size());
+    
+    for ( uint64_t i = 0; i < references.size(); i++ )
+    {
+        uint64_t index = indices ? indices->at(i) : i;
+        
+        if
+        (
+            index >= header->referenceCount ||
+            starts[index] > header->hashCount ||
+            sizes[index] > header->hashCount - starts[index] ||
+            offsets[2 * index] > offsets[2 * index + 1] ||
+            offsets[2 * index + 1] > offsets[2 * index + 2] ||
+            offsets[2 * index + 2] > stringsSize
+        )
+        {
+            cerr << "ERROR: Reference " << index << " of \"" << file << "\" is out of bounds." << endl;
+            exit(1);
+        }
+        
+        Sketch::Reference & reference = references[i];
+        const char * strings = data + header->stringsOffset;
+        
+        reference.name.assign(strings + offsets[2 * index], offsets[2 * index + 1] - offsets[2 * index]);
+        reference.comment.assign(strings + offsets[2 * index + 1], offsets[2 * index + 2] - offsets[2 * index + 1]);
+        reference.length = lengths[index];
+        
+        uint64_t hashCount = sizes[index];
+        
+        if ( hashCount > parameters.minHashesPerWindow )
+        {
+            hashCount = parameters.minHashesPerWindow;
+        }
+        
+        reference.hashesSorted.setUse64(parameters.use64);
+        reference.hashesSorted.setMapped(data + header->hashesOffset + starts[index] * hashBytes, hashCount);
+        
+        if ( counts != 0 )
+        {
+            reference.counts.assign(counts + starts[index], counts + starts[index] + hashCount);
+        }
+    }
+    
+    output->mapping = mapping;
+    output->counts = counts != 0;
+    
+    return output;
+}
+
+static bool writeColumnarPadding(FILE * stream, uint64_t & position, uint64_t offset)
+{
+    static const char zeros[columnarAlignment] = {0};
+    
+    while ( position < offset )
+    {
+        uint64_t size = offset - position < columnarAlignment ? offset - position : columnarAlignment;
+        
+        if ( fwrite(zeros, 1, size, stream) != size )
+        {
+            return false;
+        }
+        
+        position += size;
+    }
+    
+    return position == offset;
+}
+
+template <class T>
+static bool writeColumnarColumn(FILE * stream, uint64_t & position, uint64_t offset, const vector<T> & column)
+{
+    bool success = writeColumnarPadding(stream, position, offset) && fwrite(column.data(), sizeof(T), column.size(), stream) == column.size();
+    
+    position += column.size() * sizeof(T);
+    
+    return success;
+}
+
+int writeColumnar(const Sketch & sketch, const char * file)
+{
+    if ( ! hostLittleEndian )
+    {
+        cerr << "ERROR: Columnar sketches require a little-endian host." << endl;
+        return 1;
+    }
+    
+    ColumnarHeader header;
+    string alphabet;
+    
+    sketch.getAlphabetAsString(alphabet);
+    
+    if ( alphabet.length() >= sizeof(header.alphabet) )
+    {
+        cerr << "ERROR: The alphabet is too large for a columnar sketch." << endl;
+        return 1;
+    }
+    
+    uint64_t count = sketch.getReferenceCount();
+    uint64_t hashBytes = sketch.getUse64() ? 8 : 4;
+    uint64_t rowAlignment = columnarAlignment / hashBytes;
+    vector<uint64_t> starts(count);
+    vector<uint64_t> sizes(count);
+    vector<uint64_t> lengths(count);
+    vector<uint64_t> offsets(2 * count + 1);
+    bool counts = false;
+    
+    // rows of the hash matrix are padded to the alignment
+    
+    uint64_t hashCount = 0;
+    uint64_t stringsSize = 0;
+    
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        const Sketch::Reference & reference = sketch.getReference(i);
+        
+        starts[i] = hashCount;
+        sizes[i] = reference.hashesSorted.size();
+        lengths[i] = reference.length;
+        counts = counts || reference.counts.size() != 0;
+        hashCount += (sizes[i] + rowAlignment - 1) / rowAlignment * rowAlignment;
+        
+        offsets[2 * i] = stringsSize;
+        stringsSize += reference.name.length();
+        offsets[2 * i + 1] = stringsSize;
+        stringsSize += reference.comment.length();
+    }
+    
+    offsets[2 * count] = stringsSize;
+    
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, columnarMagic, columnarMagicLength);
+    strcpy(header.alphabet, alphabet.c_str());
+    
+    header.kmerSize = sketch.getKmerSize();
+    header.hashSeed = sketch.getHashSeed();
+    header.flags =
+        (sketch.getUse64() ? columnarUse64 : 0) |
+        (sketch.getPreserveCase() ? columnarPreserveCase : 0) |
+        (sketch.getNoncanonical() ? columnarNoncanonical : 0) |
+        (sketch.getConcatenated() ? columnarConcatenated : 0);
+    header.error = sketch.getError();
+    header.minHashesPerWindow = sketch.getMinHashesPerWindow();
+    header.windowSize = sketch.getWindowSize();
+    header.referenceCount = count;
+    header.hashCount = hashCount;
+    header.hashesOffset = alignColumnar(sizeof(header));
+    header.countsOffset = counts ? alignColumnar(header.hashesOffset + hashCount * hashBytes) : 0;
+    header.startsOffset = alignColumnar(counts ? header.countsOffset + hashCount * sizeof(uint32_t) : header.hashesOffset + hashCount * hashBytes);
+    header.sizesOffset = alignColumnar(header.startsOffset + count * sizeof(uint64_t));
+    header.lengthsOffset = alignColumnar(header.sizesOffset + count * sizeof(uint64_t));
+    header.namesOffset = alignColumnar(header.lengthsOffset + count * sizeof(uint64_t));
+    header.stringsOffset = alignColumnar(header.namesOffset + offsets.size() * sizeof(uint64_t));
+    header.fileSize = header.stringsOffset + stringsSize;
+    
+    FILE * stream = fopen(file, "wb");
+    
+    if ( stream == 0 )
+    {
+        cerr << "ERROR: could not open " << file << " for writing." << endl;
+        return 1;
+    }
+    
+    uint64_t position = 0;
+    bool success = fwrite(&header, sizeof(header), 1, stream) == 1;
+    
+    position += sizeof(header);
+    
+    for ( uint64_t i = 0; success && i < count; i++ )
+    {
+        const HashList & hashes = sketch.getReference(i).hashesSorted;
+        
+        if ( hashBytes == 8 )
+        {
+            vector<uint64_t> row(sizes[i]);
+            
+            for ( uint64_t j = 0; j < row.size(); j++ )
+            {
+                row[j] = hashes.at(j).hash64;
+            }
+            
+            success = writeColumnarColumn(stream, position, header.hashesOffset + starts[i] * hashBytes, row);
+        }
+        else
+        {
+            vector<uint32_t> row(sizes[i]);
+            
+            for ( uint64_t j = 0; j < row.size(); j++ )
+            {
+                row[j] = hashes.at(j).hash32;
+            }
+            
+            success = writeColumnarColumn(stream, position, header.hashesOffset + starts[i] * hashBytes, row);
+        }
+    }
+    
+    success = success && writeColumnarPadding(stream, position, header.hashesOffset + hashCount * hashBytes);
+    
+    for ( uint64_t i = 0; success && counts && i < count; i++ )
+    {
+        vector<uint32_t> row(sketch.getReference(i).counts);
+        
+        row.resize(sizes[i], 0);
+        success = writeColumnarColumn(stream, position, header.countsOffset + starts[i] * sizeof(uint32_t), row);
+    }
+    
+    success = success &&
+        (! counts || writeColumnarPadding(stream, position, header.countsOffset + hashCount * sizeof(uint32_t))) &&
+        writeColumnarColumn(stream, position, header.startsOffset, starts) &&
+        writeColumnarColumn(stream, position, header.sizesOffset, sizes) &&
+        writeColumnarColumn(stream, position, header.lengthsOffset, lengths) &&
+        writeColumnarColumn(stream, position, header.namesOffset, offsets) &&
+        writeColumnarPadding(stream, position, header.stringsOffset);
+    
+    for ( uint64_t i = 0; success && i < count; i++ )
+    {
+        const Sketch::Reference & reference = sketch.getReference(i);
+        
+        success =
+            fwrite(reference.name.data(), 1, reference.name.length(), stream) == reference.name.length() &&
+            fwrite(reference.comment.data(), 1, reference.comment.length(), stream) == reference.comment.length();
+    }
+    
+    if ( fclose(stream) != 0 || ! success )
+    {
+        cerr << "ERROR: could not write " << file << "." << endl;
+        return 1;
+    }
+    
+    return 0;
+}
@@ -0,0 +1,62 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef columnar_h
+#define columnar_h
+
+#include "Sketch.h"
+#include <inttypes.h>
+#include <string>
+#include <vector>
+
+// Version 2 sketch files store references by column rather than as Cap'n Proto
+// structs: a fixed header of parameters, a matrix of hashes with each row
+// starting on a 64-byte boundary, then columns of row starts, row sizes,
+// lengths and name offsets, and a table of names and comments. They keep the
+// .msh suffix and are told apart by their magic, so they can be read anywhere
+// a sketch file can. Hashes are used in place from the mapped file, so loading
+// does not depend on the number of hashes. Files are little-endian.
+
+static const char * columnarMagic = "MASHCOL2";
+static const int columnarMagicLength = 8;
+static const uint64_t columnarAlignment = 64; // bytes
+
+static const uint32_t columnarUse64 = 1;
+static const uint32_t columnarPreserveCase = 2;
+static const uint32_t columnarNoncanonical = 4;
+static const uint32_t columnarConcatenated = 8;
+
+struct ColumnarHeader
+{
+    char magic[columnarMagicLength];
+    uint32_t kmerSize;
+    uint32_t hashSeed;
+    uint32_t flags;
+    uint32_t reserved;
+    double error;
+    uint64_t minHashesPerWindow;
+    uint64_t windowSize;
+    uint64_t referenceCount;
+    uint64_t hashCount; // slots in the hash matrix, including row padding
+    uint64_t hashesOffset; // byte offsets of sections from the file start
+    uint64_t countsOffset; // 0 if there are no hash counts
+    uint64_t startsOffset;
+    uint64_t sizesOffset;
+    uint64_t lengthsOffset;
+    uint64_t namesOffset; // name and comment of reference i are strings 2i and 2i + 1
+    uint64_t stringsOffset;
+    uint64_t fileSize;
+    char alphabet[256]; // null-terminated
+};
+
+uint64_t getColumnarParameters(const Sketch::Mapping & mapping, const char * file, Sketch::Parameters & parameters);
+bool getColumnarReferenceNames(const char * file, std::vector<std::string> & names);
+bool isColumnarSketch(const char * file);
+bool isColumnarSketch(const Sketch::Mapping & mapping);
+Sketch::SketchOutput * loadColumnarReferences(std::shared_ptr<Sketch::Mapping> mapping, const char * file, const Sketch::Parameters & parameters, const std::vector<uint64_t> * indices);
+int writeColumnar(const Sketch & sketch, const char * file);
+
+#endif
@@ -5,15 +5,23 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "CommandBounds.h"
+#include "CommandCompact.h"
 #include "CommandList.h"
 #include "CommandSketch.h"
 #include "CommandFind.h"
 #include "CommandDistance.h"
+#include "CommandExtract.h"
 #include "CommandScreen.h"
 #include "CommandTriangle.h"
 #include "CommandContain.h"
+#include "CommandConvert.h"
+#include "CommandIndex.h"
 #include "CommandInfo.h"
 #include "CommandPaste.h"
+#include "CommandRemove.h"
+#include "CommandSearch.h"
+#include "CommandServe.h"
+#include "CommandSplit.h"
 
 int main(int argc, const char ** argv)
 {
@@ -33,6 +41,14 @@ int main(int argc, const char ** argv)
     commandList.addCommand(new mash::CommandInfo());
     commandList.addCommand(new mash::CommandPaste());
     commandList.addCommand(new mash::CommandBounds());
+    commandList.addCommand(new mash::CommandServe());
+    commandList.addCommand(new mash::CommandIndex());
+    commandList.addCommand(new mash::CommandSearch());
+    commandList.addCommand(new mash::CommandExtract());
+    commandList.addCommand(new mash::CommandConvert());
+    commandList.addCommand(new mash::CommandRemove());
+    commandList.addCommand(new mash::CommandCompact());
+    commandList.addCommand(new mash::CommandSplit());
     
     return commandList.run(argc, argv);
 }
@@ -0,0 +1,171 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "packing.h"
+#include <string.h>
+
+using std::vector;
+
+static const int packCountBytes = 8;
+static const int packReadPadding = 9; // bytes that may be read past the start of a value
+
+static inline uint64_t loadLittle64(const uint8_t * bytes)
+{
+    uint64_t value = 0;
+    
+    for ( int i = 0; i < 8; i++ )
+    {
+        value |= uint64_t(bytes[i]) << (8 * i);
+    }
+    
+    return value;
+}
+
+static inline uint64_t getPackedBytes(uint64_t count, int width)
+{
+    return (count * width + 7) / 8;
+}
+
+static void unpackBlock(const uint8_t * block, uint64_t count, int width, bool delta, uint64_t & previous, uint64_t * values)
+{
+    // block must be readable for packReadPadding bytes past its last value
+    
+    uint64_t mask = width == 64 ? ~uint64_t(0) : (uint64_t(1) << width) - 1;
+    
+    for ( uint64_t i = 0; i < count; i++ )
+    {
+        uint64_t bit = i * width;
+        const uint8_t * bytes = block + bit / 8;
+        int shift = bit % 8;
+        uint64_t value = loadLittle64(bytes) >> shift;
+        
+        if ( shift + width > 64 )
+        {
+            value |= uint64_t(bytes[8]) << (64 - shift);
+        }
+        
+        value &= mask;
+        
+        if ( delta )
+        {
+            value += previous;
+            previous = value;
+        }
+        
+        values[i] = value;
+    }
+}
+
+void packIntegers(const vector<uint64_t> & values, bool delta, vector<uint8_t> & packed)
+{
+    packed.clear();
+    
+    for ( int i = 0; i < packCountBytes; i++ )
+    {
+        packed.push_back(uint64_t(values.size()) >> (8 * i));
+    }
+    
+    uint64_t previous = 0;
+    
+    for ( uint64_t start = 0; start < values.size(); start += packBlockSize )
+    {
+        uint64_t end = start + packBlockSize < values.size() ? start + packBlockSize : values.size();
+        uint64_t deltas[packBlockSize];
+        uint64_t bits = 0;
+        
+        for ( uint64_t i = start; i < end; i++ )
+        {
+            deltas[i - start] = delta ? values[i] - previous : values[i];
+            bits |= deltas[i - start];
+            previous = values[i];
+        }
+        
+        int width = 0;
+        
+        while ( width < 64 && (bits >> width) != 0 )
+        {
+            width++;
+        }
+        
+        packed.push_back(width);
+        
+        uint64_t offset = packed.size();
+        
+        packed.resize(offset + getPackedBytes(end - start, width), 0);
+        
+        for ( uint64_t i = 0; i < end - start; i++ )
+        {
+            uint64_t bit = i * width;
+            
+            for ( int j = 0; j < width; )
+            {
+                int shift = bit % 8;
+                int take = 8 - shift < width - j ? 8 - shift : width - j;
+                
+                packed[offset + bit / 8] |= ((deltas[i] >> j) & ((1 << take) - 1)) << shift;
+                j += take;
+                bit += take;
+            }
+        }
+    }
+}
+
+bool unpackIntegers(const uint8_t * packed, uint64_t size, bool delta, vector<uint64_t> & values)
+{
+    if ( size < packCountBytes )
+    {
+        return false;
+    }
+    
+    uint64_t count = loadLittle64(packed);
+    uint64_t position = packCountBytes;
+    uint64_t previous = 0;
+    
+    if ( count / packBlockSize > size )
+    {
+        return false; // more blocks than bytes
+    }
+    
+    values.resize(count);
+    
+    for ( uint64_t start = 0; start < count; start += packBlockSize )
+    {
+        uint64_t blockCount = start + packBlockSize < count ? packBlockSize : count - start;
+        
+        if ( position >= size || packed[position] > 64 )
+        {
+            return false;
+        }
+        
+        int width = packed[position];
+        uint64_t bytes = getPackedBytes(blockCount, width);
+        
+        position++;
+        
+        if ( bytes > size - position )
+        {
+            return false;
+        }
+        
+        if ( size - position - bytes >= packReadPadding )
+        {
+            unpackBlock(packed + position, blockCount, width, delta, previous, values.data() + start);
+        }
+        else
+        {
+            // near the end, so unpack from a padded copy
+            
+            uint8_t block[packBlockSize * 8 + packReadPadding] = {0};
+            
+            memcpy(block, packed + position, bytes);
+            unpackBlock(block, blockCount, width, delta, previous, values.data() + start);
+        }
+        
+        position += bytes;
+    }
+    
+    return position == size;
+}
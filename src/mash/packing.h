@@ -0,0 +1,27 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef packing_h
+#define packing_h
+
+#include <inttypes.h>
+#include <vector>
+
+static const uint64_t packBlockSize = 128; // values per block
+
+// Compact encoding of integer lists (hashes and their counts) for sketch
+// files. Values are split into fixed blocks, each stored as a bit width (one
+// byte) followed by its values packed at that width, least significant bits
+// first, so every value in a block is unpacked the same way without branches.
+// Sorted lists are delta coded first; the deltas of s uniform hashes need
+// about log2(s) fewer bits than the hashes themselves. Deltas wrap, so any
+// list is encoded losslessly. The list is preceded by its length (8 bytes,
+// little-endian).
+
+void packIntegers(const std::vector<uint64_t> & values, bool delta, std::vector<uint8_t> & packed);
+bool unpackIntegers(const uint8_t * packed, uint64_t size, bool delta, std::vector<uint64_t> & values);
+
+#endif
@@ -0,0 +1,109 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#include "sidecar.h"
+#include <iostream>
+#include <string.h>
+#include <sys/stat.h>
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+static const int sidecarMagicLength = 8;
+
+struct SidecarHeader
+{
+    char magic[sidecarMagicLength];
+    uint64_t sketchSize;
+    uint64_t sketchInode;
+    int64_t sketchTime; // modification, in seconds and nanoseconds, so a sketch
+    int64_t sketchTimeNanoseconds; // rewritten within a second is not matched
+    uint64_t referenceCount;
+};
+
+bool getSidecarHeader(SidecarHeader & header, const string & sketchFile, const char * magic, uint64_t referenceCount)
+{
+    struct stat fileInfo;
+    
+    if ( stat(sketchFile.c_str(), &fileInfo) == -1 )
+    {
+        return false;
+    }
+    
+#ifdef __APPLE__
+    const struct timespec & modified = fileInfo.st_mtimespec;
+#else
+    const struct timespec & modified = fileInfo.st_mtim;
+#endif
+    
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, magic, sidecarMagicLength);
+    header.sketchSize = fileInfo.st_size;
+    header.sketchInode = fileInfo.st_ino;
+    header.sketchTime = modified.tv_sec;
+    header.sketchTimeNanoseconds = modified.tv_nsec;
+    header.referenceCount = referenceCount;
+    
+    return true;
+}
+
+FILE * openSidecarForReading(const string & sketchFile, const char * suffix, const char * magic, uint64_t referenceCount)
+{
+    string file = sketchFile + suffix;
+    FILE * stream = fopen(file.c_str(), "rb");
+    
+    if ( stream == 0 )
+    {
+        return 0;
+    }
+    
+    SidecarHeader header;
+    SidecarHeader headerExpected;
+    
+    if
+    (
+        fread(&header, sizeof(header), 1, stream) != 1 ||
+        ! getSidecarHeader(headerExpected, sketchFile, magic, referenceCount) ||
+        memcmp(&header, &headerExpected, sizeof(header)) != 0
+    )
+    {
+        cerr << "WARNING: " << file << " does not match " << sketchFile << " (rebuild with \"mash index\"); ignoring." << endl;
+        fclose(stream);
+        return 0;
+    }
+    
+    return stream;
+}
+
+FILE * openSidecarForWriting(const string & sketchFile, const char * suffix, const char * magic, uint64_t referenceCount)
+{
+    string file = sketchFile + suffix;
+    SidecarHeader header;
+    
+    if ( ! getSidecarHeader(header, sketchFile, magic, referenceCount) )
+    {
+        cerr << "ERROR: could not get file stats for \"" << sketchFile << "\"." << endl;
+        return 0;
+    }
+    
+    FILE * stream = fopen(file.c_str(), "wb");
+    
+    if ( stream == 0 )
+    {
+        cerr << "ERROR: could not open " << file << " for writing." << endl;
+        return 0;
+    }
+    
+    if ( fwrite(&header, sizeof(header), 1, stream) != 1 )
+    {
+        cerr << "ERROR: could not write " << file << "." << endl;
+        fclose(stream);
+        return 0;
+    }
+    
+    return stream;
+}
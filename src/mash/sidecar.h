@@ -0,0 +1,22 @@
+// Copyright © 2015, Battelle National Biodefense Institute (BNBI);
+// all rights reserved. Authored by: Brian Ondov, Todd Treangen,
+// Sergey Koren, and Adam Phillippy
+//
+// See the LICENSE.txt file included with this software for license information.
+
+#ifndef sidecar_h
+#define sidecar_h
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string>
+
+// Sidecar files hold data derived from a sketch file (signatures, indexes) and
+// are stored next to it as <sketch><suffix>. Their header records the size,
+// inode and modification time (to the nanosecond) of the sketch file, so ones
+// left behind by an older sketch file are ignored rather than silently used.
+
+FILE * openSidecarForReading(const std::string & sketchFile, const char * suffix, const char * magic, uint64_t referenceCount);
+FILE * openSidecarForWriting(const std::string & sketchFile, const char * suffix, const char * magic, uint64_t referenceCount);
+
+#endif
@@ -5,7 +5,10 @@
 // See the LICENSE.txt file included with this software for license information.
 
 #include "sketchParameterSetup.h"
+#include <errno.h>
 #include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
 
 using std::cerr;
 using std::endl;
@@ -35,6 +38,25 @@ int sketchParameterSetup(Sketch::Parameters & parameters, const Command & comman
 	    parameters.warning = command.getOption("warning").getArgumentAsNumber();
 	}
 	
+    if ( command.hasOption("cache") && command.getOption("cache").active )
+    {
+        parameters.cache = command.getOption("cache").argument;
+        
+        struct stat cacheInfo;
+        
+        if
+        (
+            (mkdir(parameters.cache.c_str(), 0777) == -1 && errno != EEXIST) ||
+            stat(parameters.cache.c_str(), &cacheInfo) == -1 ||
+            ! S_ISDIR(cacheInfo.st_mode) ||
+            access(parameters.cache.c_str(), W_OK) == -1
+        )
+        {
+            cerr << "ERROR: " << parameters.cache << " is not a writable directory (see -" << command.getOption("cache").identifier << ")." << endl;
+            return 1;
+        }
+    }
+    
 	if ( command.getOption("memory").active )
 	{
 		parameters.reads = true;